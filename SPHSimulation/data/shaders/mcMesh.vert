@@ -0,0 +1,17 @@
+#version 400
+
+layout (location = 0) in vec3 VertexPosition;
+layout (location = 1) in vec3 VertexNormal;
+
+// Texture space position (data x and z swapped), like the geometry shader mesher outputs
+noperspective out vec4 gPosition;
+out vec3 gNormal;
+
+uniform mat4 MVP;
+
+void main(void)
+{
+	gPosition = vec4(VertexPosition, 1.0);
+	gNormal = VertexNormal;
+	gl_Position = MVP * gPosition;
+}
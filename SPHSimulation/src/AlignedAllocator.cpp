@@ -0,0 +1,246 @@
+#include "AlignedAllocator.h"
+#include "AllocationCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <iostream>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+namespace
+{
+	// Kept in the ALIGNMENT bytes in front of every normal block.
+	struct BlockHeader
+	{
+		void* block;		// Start of the underlying allocation
+		size_t bytes;		// Its size
+		bool fallback;		// Asked for large pages and did not get them
+	};
+
+	atomic<bool> largePages( false );
+	atomic<size_t> largePageBytes( 0 );
+	atomic<size_t> fallbackBytes( 0 );
+	atomic<bool> reportedLargePages( false );
+	atomic<bool> reportedFallback( false );
+
+	// Large page blocks by their start, with their size in bytes
+	mutex largeBlockLock;
+	map<void*, size_t> largeBlocks;
+
+	size_t roundUp( size_t bytes, size_t multiple )
+	{
+		return ( bytes + multiple - 1 ) / multiple * multiple;
+	}
+
+	// Prints the outcome of the large page requests, once for success and once for failure.
+	void report( bool gotLargePages, const char* message )
+	{
+		atomic<bool>& reported = gotLargePages ? reportedLargePages : reportedFallback;
+		if( reported.exchange( true ) ) return;
+		if( gotLargePages )
+		{
+			cout << "aligned memory: " << message << endl;
+		}
+		else
+		{
+			cout << "aligned memory: large pages unavailable (" << message << "), using normal pages" << endl;
+		}
+	}
+
+#ifdef _WIN32
+	const char* LARGE_PAGE_STATE = "granted";
+
+	bool enableLockMemoryPrivilege()
+	{
+		HANDLE token;
+		if( !OpenProcessToken( GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token ) ) return false;
+
+		TOKEN_PRIVILEGES privileges;
+		privileges.PrivilegeCount = 1;
+		privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		// AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED if the user lacks the right
+		bool enabled = LookupPrivilegeValue( NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid ) &&
+					   AdjustTokenPrivileges( token, FALSE, &privileges, 0, NULL, NULL ) &&
+					   GetLastError() == ERROR_SUCCESS;
+		CloseHandle( token );
+		return enabled;
+	}
+
+	// Explicit large pages, null if they are not available.
+	void* allocateLargePages( size_t& bytes )
+	{
+		static const bool privilege = enableLockMemoryPrivilege();
+		size_t pageSize = GetLargePageMinimum();
+		if( !privilege || pageSize == 0 )
+		{
+			report( false, pageSize == 0 ? "not supported" : "no SeLockMemoryPrivilege" );
+			return 0;
+		}
+
+		bytes = roundUp( bytes, pageSize );
+		void* block = VirtualAlloc( NULL, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE );
+		if( block )
+		{
+			report( true, "explicit large pages granted (MEM_LARGE_PAGES)" );
+		}
+		else
+		{
+			report( false, "VirtualAlloc failed, memory too fragmented" );
+		}
+		return block;
+	}
+
+	void releaseLargePages( void* block, size_t )
+	{
+		VirtualFree( block, 0, MEM_RELEASE );
+	}
+
+	void* allocateNormalPages( size_t bytes )
+	{
+		return _aligned_malloc( bytes, AlignedMemory::ALIGNMENT );
+	}
+
+	void releaseNormalPages( void* block )
+	{
+		_aligned_free( block );
+	}
+#else
+	const char* LARGE_PAGE_STATE = "advised";
+
+	// Transparent huge pages, aligned to the huge page size and advised, null if that fails.
+	void* allocateLargePages( size_t& bytes )
+	{
+		static const size_t HUGE_PAGE_SIZE = 2 << 20;
+		bytes = roundUp( bytes, HUGE_PAGE_SIZE );
+		void* block = 0;
+		if( posix_memalign( &block, HUGE_PAGE_SIZE, bytes ) != 0 )
+		{
+			report( false, "no huge page aligned memory" );
+			return 0;
+		}
+#ifdef MADV_HUGEPAGE
+		if( madvise( block, bytes, MADV_HUGEPAGE ) == 0 )
+		{
+			report( true, "transparent huge pages advised (MADV_HUGEPAGE), the kernel decides whether it backs them" );
+			return block;
+		}
+#endif
+		free( block );
+		report( false, "transparent huge pages not supported" );
+		return 0;
+	}
+
+	void releaseLargePages( void* block, size_t )
+	{
+		free( block );
+	}
+
+	void* allocateNormalPages( size_t bytes )
+	{
+		void* block = 0;
+		return posix_memalign( &block, AlignedMemory::ALIGNMENT, bytes ) == 0 ? block : 0;
+	}
+
+	void releaseNormalPages( void* block )
+	{
+		free( block );
+	}
+#endif
+}
+
+void* AlignedMemory::allocate( size_t bytes )
+{
+	AllocationCounter::countAllocation();
+
+	bool fallback = false;
+	if( largePages && bytes >= LARGE_PAGE_THRESHOLD )
+	{
+		// Large page blocks start on a page, which is ALIGNMENT aligned, and need no header
+		size_t pageBytes = bytes;
+		void* block = allocateLargePages( pageBytes );
+		if( block )
+		{
+			lock_guard<mutex> guard( largeBlockLock );
+			largeBlocks[block] = pageBytes;
+			largePageBytes += pageBytes;
+			return block;
+		}
+		fallback = true;
+	}
+
+	BlockHeader header;
+	header.bytes = bytes + ALIGNMENT;
+	header.fallback = fallback;
+	header.block = allocateNormalPages( header.bytes );
+	if( !header.block ) throw bad_alloc();
+	if( fallback ) fallbackBytes += header.bytes;
+
+	// Blocks start ALIGNMENT aligned, the header goes into the first ALIGNMENT bytes
+	char* memory = static_cast<char*>( header.block ) + ALIGNMENT;
+	*reinterpret_cast<BlockHeader*>( memory - ALIGNMENT ) = header;
+	return memory;
+}
+
+void AlignedMemory::release( void* memory )
+{
+	if( !memory ) return;
+
+	if( largePageBytes > 0 )
+	{
+		size_t pageBytes = 0;
+		{
+			lock_guard<mutex> guard( largeBlockLock );
+			auto found = largeBlocks.find( memory );
+			if( found != largeBlocks.end() )
+			{
+				pageBytes = found->second;
+				largeBlocks.erase( found );
+			}
+		}
+		if( pageBytes > 0 )
+		{
+			largePageBytes -= pageBytes;
+			releaseLargePages( memory, pageBytes );
+			return;
+		}
+	}
+
+	BlockHeader header = *reinterpret_cast<BlockHeader*>( static_cast<char*>( memory ) - ALIGNMENT );
+	if( header.fallback ) fallbackBytes -= header.bytes;
+	releaseNormalPages( header.block );
+}
+
+void AlignedMemory::setLargePages( bool value )
+{
+	largePages = value;
+}
+
+bool AlignedMemory::usesLargePages()
+{
+	return largePages;
+}
+
+size_t AlignedMemory::getLargePageBytes()
+{
+	return largePageBytes;
+}
+
+const char* AlignedMemory::getLargePageState()
+{
+	return LARGE_PAGE_STATE;
+}
+
+size_t AlignedMemory::getFallbackBytes()
+{
+	return fallbackBytes;
+}
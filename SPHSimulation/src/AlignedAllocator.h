@@ -0,0 +1,91 @@
+#pragma once
+#ifndef ALIGNED_ALLOCATOR_H
+#define ALIGNED_ALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/*
+	Heap memory for the large arrays of the simulation (particles, grid, neighbour lists, marching
+	cubes fields). Every block starts at an ALIGNMENT (cache line) boundary, so SIMD loads never
+	straddle lines and no two arrays share one.
+
+	With large pages enabled, blocks of at least LARGE_PAGE_THRESHOLD bytes are put into large
+	pages, which cuts the TLB misses of random accesses into big arrays. On Windows these are
+	explicit large pages (VirtualAlloc with MEM_LARGE_PAGES), which need the "Lock pages in memory"
+	right (SeLockMemoryPrivilege) of the user; on Linux the block is aligned to the huge page size
+	and advised as transparent huge pages, which the kernel may or may not back. Requests which can
+	not get them fall back to normal pages. The outcome is printed the first time it is known and
+	can be queried afterwards.
+
+	Normal blocks keep their bookkeeping in the ALIGNMENT bytes in front of them. Large page blocks
+	keep it in a separate table, so a block of a whole number of pages (a 2 MB BrickField slab)
+	takes exactly those pages.
+
+	Blocks are not counted by operator new, they report themselves to AllocationCounter.
+*/
+class AlignedMemory
+{
+public:
+	static const size_t ALIGNMENT = 64;
+	static const size_t LARGE_PAGE_THRESHOLD = 2 << 20;
+
+	// Throws std::bad_alloc if the memory can not be allocated.
+	static void* allocate( size_t bytes );
+	static void release( void* memory );
+
+	// Affects blocks allocated afterwards, off by default.
+	static void setLargePages( bool value );
+	static bool usesLargePages();
+
+	// Bytes of the blocks currently held in large pages, rounded up to whole pages.
+	static size_t getLargePageBytes();
+	// "granted" for explicit large pages, "advised" for transparent huge pages the kernel may back.
+	static const char* getLargePageState();
+	// Bytes of the blocks currently held which asked for large pages and got normal ones.
+	static size_t getFallbackBytes();
+};
+
+// std::allocator replacement handing out AlignedMemory blocks.
+template<class T>
+class AlignedAllocator
+{
+public:
+	typedef T value_type;
+
+	AlignedAllocator()
+	{}
+
+	template<class U>
+	AlignedAllocator( const AlignedAllocator<U>& )
+	{}
+
+	T* allocate( size_t count )
+	{
+		if( count > size_t(-1) / sizeof(T) ) throw std::bad_alloc();
+		return static_cast<T*>( AlignedMemory::allocate( count * sizeof(T) ) );
+	}
+
+	void deallocate( T* memory, size_t )
+	{
+		AlignedMemory::release( memory );
+	}
+};
+
+template<class T, class U>
+bool operator==( const AlignedAllocator<T>&, const AlignedAllocator<U>& )
+{
+	return true;
+}
+
+template<class T, class U>
+bool operator!=( const AlignedAllocator<T>&, const AlignedAllocator<U>& )
+{
+	return false;
+}
+
+template<class T>
+using AlignedVector = std::vector< T, AlignedAllocator<T> >;
+
+#endif
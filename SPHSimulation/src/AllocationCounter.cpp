@@ -0,0 +1,75 @@
+#include "AllocationCounter.h"
+
+#ifdef SPH_COUNT_ALLOCATIONS
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<unsigned long long> allocationCount( 0 );
+static thread_local bool threadCounting = false;
+
+// The other forms of new and delete forward to these ones
+void* operator new( size_t size )
+{
+	if( threadCounting ) allocationCount++;
+	void* memory = malloc( size ? size : 1 );
+	if( !memory ) throw std::bad_alloc();
+	return memory;
+}
+
+void operator delete( void* memory ) noexcept
+{
+	free( memory );
+}
+
+void* operator new[]( size_t size )
+{
+	return operator new( size );
+}
+
+void operator delete[]( void* memory ) noexcept
+{
+	operator delete( memory );
+}
+#endif
+
+bool AllocationCounter::isCounting()
+{
+#ifdef SPH_COUNT_ALLOCATIONS
+	return true;
+#else
+	return false;
+#endif
+}
+
+unsigned long long AllocationCounter::getCount()
+{
+#ifdef SPH_COUNT_ALLOCATIONS
+	return allocationCount;
+#else
+	return 0;
+#endif
+}
+
+void AllocationCounter::setThreadCounting( bool value )
+{
+#ifdef SPH_COUNT_ALLOCATIONS
+	threadCounting = value;
+#endif
+}
+
+bool AllocationCounter::isThreadCounting()
+{
+#ifdef SPH_COUNT_ALLOCATIONS
+	return threadCounting;
+#else
+	return false;
+#endif
+}
+
+void AllocationCounter::countAllocation()
+{
+#ifdef SPH_COUNT_ALLOCATIONS
+	if( threadCounting ) allocationCount++;
+#endif
+}
@@ -0,0 +1,28 @@
+#pragma once
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+/*
+	Debug hook counting the heap allocations of the program, used to check that a simulation step
+	allocates nothing once the buffers are warmed up (see SPHSystem3d::getStepAllocations).
+	Counting replaces the global operator new and is only built with SPH_COUNT_ALLOCATIONS (add
+	it to the preprocessor definitions of the project), otherwise the count stays 0.
+
+	Only threads which enabled counting are counted, so the threads running beside a step (export
+	writer, playback prefetch, preview encoders) are not charged to it. ThreadPool workers count
+	while they run a parallelFor started by a counting thread.
+*/
+class AllocationCounter
+{
+public:
+	static bool isCounting();
+	// Allocations of the counting threads since the start of the program.
+	static unsigned long long getCount();
+	// Enables counting for the calling thread, off by default.
+	static void setThreadCounting( bool value );
+	static bool isThreadCounting();
+	// Counts an allocation made without operator new (AlignedMemory).
+	static void countAllocation();
+};
+
+#endif
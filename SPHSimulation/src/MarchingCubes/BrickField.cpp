@@ -0,0 +1,174 @@
+#include "BrickField.h"
+#include "AlignedAllocator.h"
+#include <cstring>
+#include <algorithm>
+
+BrickField::BrickField() :
+	width(0), height(0), depth(0), bricksX(0), bricksY(0), bricksZ(0)
+{
+}
+
+BrickField::BrickField( int w, int h, int d ) :
+	width(0), height(0), depth(0), bricksX(0), bricksY(0), bricksZ(0)
+{
+	resize( w, h, d );
+}
+
+BrickField::~BrickField()
+{
+	releaseAll();
+}
+
+void BrickField::releaseAll()
+{
+	for( size_t i=0; i<slabs.size(); i++ )
+	{
+		AlignedMemory::release( slabs[i] );
+	}
+	slabs.clear();
+	pool.clear();
+	freeSlots.clear();
+	activeBricks.clear();
+}
+
+void BrickField::resize( int w, int h, int d )
+{
+	releaseAll();
+
+	width = w;
+	height = h;
+	depth = d;
+	bricksX = (w + BRICK_MASK) >> BRICK_BITS;
+	bricksY = (h + BRICK_MASK) >> BRICK_BITS;
+	bricksZ = (d + BRICK_MASK) >> BRICK_BITS;
+	brickSlots.assign( bricksX*bricksY*bricksZ, -1 );
+}
+
+void BrickField::addSlab()
+{
+	int count = std::min( std::max( (int)pool.size(), (int)SLAB_MIN_BRICKS ), (int)SLAB_MAX_BRICKS );
+	float* slab = static_cast<float*>( AlignedMemory::allocate( count*BRICK_VOLUME*sizeof(float) ) );
+	slabs.push_back( slab );
+
+	// Free slots are taken from the back, the first brick of the slab is used first
+	int first = (int)pool.size();
+	for( int i=0; i<count; i++ )
+	{
+		pool.push_back( slab + i*BRICK_VOLUME );
+	}
+	for( int i=count-1; i>=0; i-- )
+	{
+		freeSlots.push_back( first + i );
+	}
+}
+
+float* BrickField::allocateBrick( int brick )
+{
+	if( freeSlots.empty() )
+	{
+		addSlab();
+	}
+	int slot = freeSlots.back();
+	freeSlots.pop_back();
+
+	float* data = pool[slot];
+	memset( data, 0, BRICK_VOLUME*sizeof(float) );
+	brickSlots[brick] = slot;
+	activeBricks.push_back( brick );
+	return data;
+}
+
+void BrickField::clear()
+{
+	for( size_t i=0; i<activeBricks.size(); i++ )
+	{
+		int& slot = brickSlots[ activeBricks[i] ];
+		freeSlots.push_back( slot );
+		slot = -1;
+	}
+	activeBricks.clear();
+}
+
+void BrickField::getBrickCoords( int brick, int& bx, int& by, int& bz ) const
+{
+	bz = brick % bricksZ;
+	brick /= bricksZ;
+	by = brick % bricksY;
+	bx = brick / bricksY;
+}
+
+const std::vector<int>& BrickField::getActiveBricks() const
+{
+	return activeBricks;
+}
+
+void BrickField::getMeshBricks( std::vector<int>& bricks, std::vector<char>& marks ) const
+{
+	bricks.clear();
+	marks.resize( getBrickCount(), 0 );
+
+	int bx, by, bz, brick;
+	for( size_t n=0; n<activeBricks.size(); n++ )
+	{
+		getBrickCoords( activeBricks[n], bx, by, bz );
+		for( int i=bx-1; i<=bx; i++ )
+		{
+			for( int j=by-1; j<=by; j++ )
+			{
+				for( int k=bz-1; k<=bz; k++ )
+				{
+					if( i<0 || j<0 || k<0 ) continue;
+					brick = brickIndex( i, j, k );
+					if( marks[brick] ) continue;
+					marks[brick] = 1;
+					bricks.push_back( brick );
+				}
+			}
+		}
+	}
+
+	for( size_t n=0; n<bricks.size(); n++ )
+	{
+		marks[ bricks[n] ] = 0;
+	}
+}
+
+int BrickField::getBrickCount() const
+{
+	return (int)brickSlots.size();
+}
+
+int BrickField::getBricksX() const
+{
+	return bricksX;
+}
+
+int BrickField::getBricksY() const
+{
+	return bricksY;
+}
+
+int BrickField::getBricksZ() const
+{
+	return bricksZ;
+}
+
+int BrickField::getWidth() const
+{
+	return width;
+}
+
+int BrickField::getHeight() const
+{
+	return height;
+}
+
+int BrickField::getDepth() const
+{
+	return depth;
+}
+
+size_t BrickField::getMemoryUsage() const
+{
+	return pool.size()*BRICK_VOLUME*sizeof(float) + brickSlots.size()*sizeof(int);
+}
@@ -0,0 +1,119 @@
+#pragma once
+#ifndef BRICK_FIELD_H
+#define BRICK_FIELD_H
+
+#include <vector>
+
+/*
+	Sparse scalar field for the marching cubes grids. The domain is split into bricks of
+	BRICK_SIZE^3 values which are allocated the first time something is written into them.
+	Voxels in bricks that were never touched read as 0.
+
+	Bricks come from a pool which is kept between frames, so clear() only releases the bricks
+	that are in use, they are zeroed when they are next allocated, and nothing is reallocated in
+	the steady state. Memory and clear cost therefore follow the volume touched by the data, not
+	the size of the grid.
+
+	The pool grows by slabs of bricks, each an AlignedMemory block doubling the pool up to
+	SLAB_MAX_BRICKS bricks (exactly 2 MB, large page blocks carry no header so that is one large
+	page), so every brick is cache line aligned and large fields sit in a few large blocks.
+
+	Values inside a brick are stored like the dense fields were, z changes fastest:
+	brick[ (lx*BRICK_SIZE + ly)*BRICK_SIZE + lz ].
+*/
+class BrickField
+{
+public:
+	static const int BRICK_BITS = 3;
+	static const int BRICK_SIZE = 1 << BRICK_BITS;
+	static const int BRICK_MASK = BRICK_SIZE - 1;
+	static const int BRICK_VOLUME = BRICK_SIZE*BRICK_SIZE*BRICK_SIZE;
+	static const int SLAB_MIN_BRICKS = 64;
+	static const int SLAB_MAX_BRICKS = 1024;
+
+private:
+	int width;
+	int height;
+	int depth;
+	int bricksX;
+	int bricksY;
+	int bricksZ;
+
+	std::vector<int> brickSlots;		// Per brick index into pool, -1 if not allocated
+	std::vector<float*> slabs;
+	std::vector<float*> pool;			// All bricks ever allocated, pointers into the slabs
+	std::vector<int> freeSlots;			// Pool entries not used by any brick
+	std::vector<int> activeBricks;		// Brick indices currently allocated, in allocation order
+
+	void addSlab();
+	float* allocateBrick( int brick );
+	void releaseAll();
+
+public:
+	BrickField();
+	BrickField( int w, int h, int d );
+	~BrickField();
+
+	// Changes the dimensions, all data is lost.
+	void resize( int w, int h, int d );
+	// Returns the active bricks to the pool, they are zeroed when they are next allocated.
+	void clear();
+
+	inline int brickIndex( int bx, int by, int bz ) const
+	{
+		return (bx*bricksY + by)*bricksZ + bz;
+	}
+	inline static int localIndex( int lx, int ly, int lz )
+	{
+		return (lx*BRICK_SIZE + ly)*BRICK_SIZE + lz;
+	}
+
+	// Value at the given voxel, 0 for voxels in unallocated bricks. No bounds checking.
+	inline float get( int x, int y, int z ) const
+	{
+		int slot = brickSlots[ brickIndex( x>>BRICK_BITS, y>>BRICK_BITS, z>>BRICK_BITS ) ];
+		if( slot < 0 ) return 0.0f;
+		return pool[slot][ localIndex( x&BRICK_MASK, y&BRICK_MASK, z&BRICK_MASK ) ];
+	}
+	// Reference to the given voxel, allocates its brick if needed. No bounds checking.
+	inline float& at( int x, int y, int z )
+	{
+		int brick = brickIndex( x>>BRICK_BITS, y>>BRICK_BITS, z>>BRICK_BITS );
+		int slot = brickSlots[ brick ];
+		float* data = slot < 0 ? allocateBrick( brick ) : pool[slot];
+		return data[ localIndex( x&BRICK_MASK, y&BRICK_MASK, z&BRICK_MASK ) ];
+	}
+
+	// Brick data or NULL if the brick is not allocated.
+	inline float* findBrick( int brick ) const
+	{
+		int slot = brickSlots[ brick ];
+		return slot < 0 ? nullptr : pool[slot];
+	}
+	// Brick data, allocated (zeroed) if needed.
+	inline float* getBrick( int brick )
+	{
+		int slot = brickSlots[ brick ];
+		return slot < 0 ? allocateBrick( brick ) : pool[slot];
+	}
+	void getBrickCoords( int brick, int& bx, int& by, int& bz ) const;
+
+	const std::vector<int>& getActiveBricks() const;
+	// Collects the active bricks and their neighbours in the negative directions, whose cubes read
+	// one voxel into the active bricks. These hold the origin of every cube that can cross a non
+	// negative treshold. marks is scratch space of getBrickCount() zeros, left zeroed.
+	void getMeshBricks( std::vector<int>& bricks, std::vector<char>& marks ) const;
+	int getBrickCount() const;
+	int getBricksX() const;
+	int getBricksY() const;
+	int getBricksZ() const;
+
+	int getWidth() const;
+	int getHeight() const;
+	int getDepth() const;
+
+	// Bytes held by the brick pool and the brick table.
+	size_t getMemoryUsage() const;
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include "MappedData.h"
 #include "DataLine.h"
 #include "ShaderProgram.h"
+#include <cstring>
 
 MarchingCubes::MarchingCubes( )
 {
@@ -23,6 +24,8 @@ MarchingCubes::MarchingCubes( )
 	useInterpolated = true;
 
 	pointGrid = 0;
+	meshedField = NULL;
+	meshesValid = false;
 }
 
 MarchingCubes::MarchingCubes( int w, int h, int d, char maxValue, glm::vec3 pos, glm::vec3 scl )
@@ -53,6 +56,10 @@ MarchingCubes::MarchingCubes( int w, int h, int d, char maxValue, glm::vec3 pos,
 
 	pointGrid = 0;
 
+	meshedField = new char[ dataSize ];
+	blockMeshes.resize( DATA_CHANGE_SIZE );
+	meshesValid = false;
+
 	clear();
 }
 
@@ -89,6 +96,10 @@ MarchingCubes::MarchingCubes( const char* filePath )
 
 	pointGrid = 0;
 
+	meshedField = new char[ dataSize ];
+	blockMeshes.resize( DATA_CHANGE_SIZE );
+	meshesValid = false;
+
 	clear();
 }
 
@@ -96,26 +107,53 @@ MarchingCubes::~MarchingCubes()
 {
 	delete [] dataField;
 	delete [] dataChanged;
+	delete [] meshedField;
 	delete [] triangles;
 	delete [] normals;
 	if( pointGrid ) delete [] pointGrid;
 }
 
+// The last block also takes the remainder when the size does not divide by DATA_CHANGE_DIV
+int MarchingCubes::getBlockIndex( int x, int y, int z )
+{
+	int dx = contain( x / dataChangedWidth, 0, DATA_CHANGE_DIV-1 );
+	int dy = contain( y / dataChangedHeight, 0, DATA_CHANGE_DIV-1 );
+	int dz = contain( z / dataChangedDepth, 0, DATA_CHANGE_DIV-1 );
+	return dx*DATA_CHANGE_DIV*DATA_CHANGE_DIV + dy*DATA_CHANGE_DIV + dz;
+}
+
+void MarchingCubes::getBlockRange( int block, int blockSize, int size, int& start, int& end )
+{
+	start = block*blockSize;
+	end = block == DATA_CHANGE_DIV-1 ? size-1 : (block+1)*blockSize;
+	if( end > size-1 ) end = size-1;
+}
+
+// Cubes with the origin one voxel below also read the voxel, so their blocks are marked too.
 void MarchingCubes::setDataChanged( int x, int y, int z, bool value )
 {
-	int dx = x / dataChangedWidth;
-	int dy = y / dataChangedHeight;
-	int dz = z / dataChangedDepth;
-	dataChanged[ dx*DATA_CHANGE_DIV*DATA_CHANGE_DIV + dy*DATA_CHANGE_DIV + dz ] = value;
+	if( !value )
+	{
+		dataChanged[ getBlockIndex( x, y, z ) ] = false;
+		return;
+	}
+	for(int i=x-1; i<=x; i++)
+	{
+		for(int j=y-1; j<=y; j++)
+		{
+			for(int k=z-1; k<=z; k++)
+			{
+				if( i<0 || j<0 || k<0 ) continue;
+				dataChanged[ getBlockIndex( i, j, k ) ] = true;
+			}
+		}
+	}
 	dataChangedGlobal = true;
 }
 
 bool MarchingCubes::getDataChanged( int x, int y, int z )
 {
-	int dx = x / dataChangedWidth;
-	int dy = y / dataChangedHeight;
-	int dz = z / dataChangedDepth;	
-	return dataChanged[ dx*DATA_CHANGE_DIV*DATA_CHANGE_DIV + dy*DATA_CHANGE_DIV + dz ];
+	return dataChanged[ getBlockIndex( x, y, z ) ];
 }
 
 void MarchingCubes::setAllDataChanged( bool value )
@@ -147,14 +185,16 @@ void MarchingCubes::flip( int x, int y, int z )
 	setDataChanged( x,y,z );
 }
 
+// All blocks are marked, also those without triangles: a neighbour remeshed after the clear copies
+// their shared border into meshedField. The comparison with meshedField decides if they have to be
+// regenerated, so clearing and refilling unchanged regions does not remesh them.
 void MarchingCubes::clear()
 {
 	for(int i=0; i<dataWidth*dataHeight*dataDepth; i++)
 	{
 		dataField[i] = 0;
 	}
-	setAllDataChanged( false );
-	trianglesCount = 0;
+	setAllDataChanged( true );
 }
 
 void MarchingCubes::drawGrid( glm::vec3 colorFalse, glm::vec3 colorTrue )
@@ -203,7 +243,7 @@ void MarchingCubes::drawGrid( glm::vec3 colorFalse, glm::vec3 colorTrue )
 	glPopMatrix();
 }
 
-void MarchingCubes::generateTriangles( int x, int countX, int y, int countY, int z, int countZ )
+void MarchingCubes::generateTriangles( int x, int countX, int y, int countY, int z, int countZ, BlockMesh& mesh )
 {
 	int HD = dataHeight*dataDepth;
 	int iHD;	// i*dataHeight*dataDepth
@@ -212,14 +252,16 @@ void MarchingCubes::generateTriangles( int x, int countX, int y, int countY, int
 
 	char cube[8];	
 	int cubeIndex;
-	// x-1<0 ? 0 : x-1 <- causes slowdon, without it doesnt draw properly
-	for(int i=x-1<0?0:x-1; i<dataWidth-1 && i<x+countX ; i++)
+	int count = 0;
+	mesh.triangles.resize( mesh.triangles.capacity() );
+	mesh.normals.resize( mesh.triangles.size() );
+	for(int i=x; i<dataWidth-1 && i<x+countX ; i++)
 	{
 		iHD = i*HD;
-		for(int j=y-1<0?0:y-1; j<dataHeight-1 && j<y+countY ; j++)
+		for(int j=y; j<dataHeight-1 && j<y+countY ; j++)
 		{
 			iHDjD = iHD + j*dataDepth;
-			for(int k=z-1<0?0:z-1; k<dataDepth-1 && k<z+countZ ; k++)
+			for(int k=z; k<dataDepth-1 && k<z+countZ ; k++)
 			{
 				index0 = iHDjD  + k;			// i*dataHeight*dataDepth + j*dataDepth + k
 				index1 = index0 + dataDepth;	// i*dataHeight*dataDepth + (j+1)*dataDepth + k
@@ -235,96 +277,154 @@ void MarchingCubes::generateTriangles( int x, int countX, int y, int countY, int
 				cube[6] = dataField[index2 + 1 ];
 				cube[7] = dataField[index3 + 1 ];
 
+				if( count + MarchingCubesFactory::MAX_VERTICES > (int)mesh.triangles.size() )
+				{
+					mesh.triangles.resize( mesh.triangles.size()*2 + MarchingCubesFactory::MAX_VERTICES );
+					mesh.normals.resize( mesh.triangles.size() );
+				}
+
 				if(useInterpolated)
 				{
-					trianglesCount += MarchingCubesFactory::getInterpolatedCube( cube, dataMax, triangles, normals, trianglesCount, glm::vec3(i,j,k), treshold);
+					count += MarchingCubesFactory::getInterpolatedCube( cube, dataMax, &mesh.triangles[0], &mesh.normals[0], count, glm::vec3(i,j,k), treshold);
 				}else
 				{
 					cubeIndex = MarchingCubesFactory::getCubeIndex( cube );				
-					trianglesCount += MarchingCubesFactory::getCube( cubeIndex, triangles, normals, trianglesCount, glm::vec3(i,j,k));
-				}
-
-				if( trianglesCount > trianglesSize - MarchingCubesFactory::MAX_VERTICES )
-				{
-					int newSize = trianglesSize + TRIANGLE_COUNT_INCREASE;				
-					glm::vec3* newTriangles = new glm::vec3[ newSize ];
-					glm::vec3* newNormals = new glm::vec3[ newSize ];
-
-					memcpy( newTriangles, triangles, trianglesSize * sizeof(glm::vec3) );
-					memcpy( newNormals, normals, trianglesSize * sizeof(glm::vec3) );
-
-					trianglesSize = newSize;
-					delete [] triangles;
-					delete [] normals;
-					triangles = newTriangles;
-					normals = newNormals;
+					count += MarchingCubesFactory::getCube( cubeIndex, &mesh.triangles[0], &mesh.normals[0], count, glm::vec3(i,j,k));
 				}
 			}
 		}
 	}
-	setDataChanged( x, y, z, false );
+	// Capacity is kept for the next time the block is meshed
+	mesh.triangles.resize( count );
+	mesh.normals.resize( count );
 }
 
+void MarchingCubes::generateBlock( int block )
+{
+	int bx = block / (DATA_CHANGE_DIV*DATA_CHANGE_DIV);
+	int by = (block / DATA_CHANGE_DIV) % DATA_CHANGE_DIV;
+	int bz = block % DATA_CHANGE_DIV;
+	int x0, x1, y0, y1, z0, z1;
+	getBlockRange( bx, dataChangedWidth, dataWidth, x0, x1 );
+	getBlockRange( by, dataChangedHeight, dataHeight, y0, y1 );
+	getBlockRange( bz, dataChangedDepth, dataDepth, z0, z1 );
+	generateTriangles( x0, x1-x0, y0, y1-y0, z0, z1-z0, blockMeshes[block] );
+}
 
-void MarchingCubes::generateTriangles()
+// Cubes of the block read the voxels from the block start up to and including its end.
+bool MarchingCubes::blockDataChanged( int block )
 {
-	int HD = dataHeight*dataDepth;
-	int iHD;	// i*dataHeight*dataDepth
-	int iHDjD;  // i*dataHeight*dataDepth + j*dataDepth
-	int index0, index1, index2, index3;	// helping indices
+	int x0, x1, y0, y1, z0, z1;
+	getBlockRange( block / (DATA_CHANGE_DIV*DATA_CHANGE_DIV), dataChangedWidth, dataWidth, x0, x1 );
+	getBlockRange( (block / DATA_CHANGE_DIV) % DATA_CHANGE_DIV, dataChangedHeight, dataHeight, y0, y1 );
+	getBlockRange( block % DATA_CHANGE_DIV, dataChangedDepth, dataDepth, z0, z1 );
+	if( x1 <= x0 || y1 <= y0 || z1 <= z0 ) return false;
+
+	int row;
+	for(int i=x0; i<=x1; i++)
+	{
+		for(int j=y0; j<=y1; j++)
+		{
+			row = i*dataHeight*dataDepth + j*dataDepth + z0;
+			if( memcmp( dataField + row, meshedField + row, z1-z0+1 ) != 0 ) return true;
+		}
+	}
+	return false;
+}
 
-	char cube[8];	
-	int cubeIndex;
-	for(int i=0; i<dataWidth-1; i++)
+void MarchingCubes::copyBlockData( int block )
+{
+	int x0, x1, y0, y1, z0, z1;
+	getBlockRange( block / (DATA_CHANGE_DIV*DATA_CHANGE_DIV), dataChangedWidth, dataWidth, x0, x1 );
+	getBlockRange( (block / DATA_CHANGE_DIV) % DATA_CHANGE_DIV, dataChangedHeight, dataHeight, y0, y1 );
+	getBlockRange( block % DATA_CHANGE_DIV, dataChangedDepth, dataDepth, z0, z1 );
+	if( x1 <= x0 || y1 <= y0 || z1 <= z0 ) return;
+
+	int row;
+	for(int i=x0; i<=x1; i++)
 	{
-		iHD = i*HD;
-		for(int j=0; j<dataHeight-1; j++)
+		for(int j=y0; j<=y1; j++)
 		{
-			iHDjD = iHD + j*dataDepth;
-			for(int k=0; k<dataDepth-1; k++)
-			{
-				index0 = iHDjD  + k;			// i*dataHeight*dataDepth + j*dataDepth + k
-				index1 = index0 + dataDepth;	// i*dataHeight*dataDepth + (j+1)*dataDepth + k
-				index2 = index1 + HD;			// (i+1)*dataHeight*dataDepth + (j+1)*dataDepth + k
-				index3 = index0 + HD;			// (i+1)*dataHeight*dataDepth + j*dataDepth + k
+			row = i*dataHeight*dataDepth + j*dataDepth + z0;
+			memcpy( meshedField + row, dataField + row, z1-z0+1 );
+		}
+	}
+}
 
-				cube[0] = dataField[index0];
-				cube[1] = dataField[index1];
-				cube[2] = dataField[index2];
-				cube[3] = dataField[index3];
-				cube[4] = dataField[index0 + 1 ];
-				cube[5] = dataField[index1 + 1 ];
-				cube[6] = dataField[index2 + 1 ];
-				cube[7] = dataField[index3 + 1 ];
+void MarchingCubes::generateTriangles()
+{
+	for(int i=0; i<DATA_CHANGE_SIZE; i++)
+	{
+		generateBlock( i );
+	}
+	memcpy( meshedField, dataField, dataSize );
+	meshesValid = true;
+	setAllDataChanged( false );
+	assembleTriangles();
+}
 
-				if(useInterpolated)
-				{
-					trianglesCount += MarchingCubesFactory::getInterpolatedCube( cube, dataMax, triangles, normals, trianglesCount, glm::vec3(i,j,k), treshold);
-				}else
-				{
-					cubeIndex = MarchingCubesFactory::getCubeIndex( cube );				
-					trianglesCount += MarchingCubesFactory::getCube( cubeIndex, triangles, normals, trianglesCount, glm::vec3(i,j,k));
-				}
+// All blocks are compared before any is copied, blocks share the voxels at their borders.
+void MarchingCubes::updateTriangles()
+{
+	if( !meshesValid )
+	{
+		generateTriangles();
+		return;
+	}
+	if( !dataChangedGlobal ) return;
 
-				if( trianglesCount > trianglesSize - MarchingCubesFactory::MAX_VERTICES )
-				{
-					int newSize = trianglesSize + TRIANGLE_COUNT_INCREASE;				
-					glm::vec3* newTriangles = new glm::vec3[ newSize ];
-					glm::vec3* newNormals = new glm::vec3[ newSize ];
-
-					memcpy( newTriangles, triangles, trianglesSize * sizeof(glm::vec3) );
-					memcpy( newNormals, normals, trianglesSize * sizeof(glm::vec3) );
-
-					trianglesSize = newSize;
-					delete [] triangles;
-					delete [] normals;
-					triangles = newTriangles;
-					normals = newNormals;
-				}
-			}
+	changedBlocks.clear();
+	for(int i=0; i<DATA_CHANGE_SIZE; i++)
+	{
+		if( dataChanged[i] && blockDataChanged( i ) )
+		{
+			changedBlocks.push_back( i );
 		}
 	}
+	for(size_t n=0; n<changedBlocks.size(); n++)
+	{
+		generateBlock( changedBlocks[n] );
+	}
+	for(size_t n=0; n<changedBlocks.size(); n++)
+	{
+		copyBlockData( changedBlocks[n] );
+	}
 	setAllDataChanged( false );
+
+	if( !changedBlocks.empty() )
+	{
+		assembleTriangles();
+	}
+}
+
+void MarchingCubes::assembleTriangles()
+{
+	int total = 0;
+	for(int i=0; i<DATA_CHANGE_SIZE; i++)
+	{
+		total += (int)blockMeshes[i].triangles.size();
+	}
+
+	// Everything is copied again, so growing needs no copy
+	if( total > trianglesSize )
+	{
+		trianglesSize = total + TRIANGLE_COUNT_INCREASE;
+		delete [] triangles;
+		delete [] normals;
+		triangles = new glm::vec3[ trianglesSize ];
+		normals = new glm::vec3[ trianglesSize ];
+	}
+
+	trianglesCount = 0;
+	for(int i=0; i<DATA_CHANGE_SIZE; i++)
+	{
+		const BlockMesh& mesh = blockMeshes[i];
+		int count = (int)mesh.triangles.size();
+		if( count == 0 ) continue;
+		memcpy( triangles + trianglesCount, &mesh.triangles[0], count*sizeof(glm::vec3) );
+		memcpy( normals + trianglesCount, &mesh.normals[0], count*sizeof(glm::vec3) );
+		trianglesCount += count;
+	}
 }
 
 
@@ -348,29 +448,7 @@ void MarchingCubes::drawLightedCubes( GLfloat material[4] )
 
 void MarchingCubes::drawTriangleBuffer()
 {
-	//if(dataChanged) generateTriangles();	
-	if(dataChangedGlobal)
-	{
-		trianglesCount = 0;
-		for(int i=0; i<DATA_CHANGE_DIV; i++)
-		{
-			for(int j=0; j<DATA_CHANGE_DIV; j++)
-			{
-				for(int k=0; k<DATA_CHANGE_DIV; k++)
-				{
-					if( dataChanged[ i*DATA_CHANGE_DIV*DATA_CHANGE_DIV + j*DATA_CHANGE_DIV + k ] )
-					{
-
-						generateTriangles( 
-							i*dataChangedWidth, dataChangedWidth, 
-							j*dataChangedHeight, dataChangedHeight,
-							k*dataChangedDepth, dataChangedDepth );
-					}
-				}
-			}
-		}
-		dataChangedGlobal = false;
-	}
+	updateTriangles();
 	if( trianglesCount == 0 ) return;
 
 	glEnableClientState( GL_VERTEX_ARRAY );
@@ -434,6 +512,7 @@ char* MarchingCubes::getData()
 int MarchingCubes::increaseTreshold()
 {
 	treshold = (treshold+1)%dataMax;
+	meshesValid = false;
 	return treshold;
 }
 
@@ -4,6 +4,7 @@
 
 #include "GlmVec.h"
 #include <GL\glew.h>
+#include <vector>
 class MappedData;
 class ShaderProgram;
 
@@ -12,7 +13,13 @@ class ShaderProgram;
 	using MarchingCubesFactory class. Data weight is one byte value, used to offset triangle
 	vertices.
 	
-	Improvments: space partitioning for speed increase (octree?), triangle memory management	
+	The grid is split into DATA_CHANGE_DIV^3 blocks and triangles are cached per block. A block
+	owns the cubes with the origin inside it, so a changed voxel marks its own block and the blocks
+	below it whose cubes read it. When drawing, only marked blocks whose data differs from the
+	data they were last meshed from are regenerated, and the draw buffer is assembled from the
+	block segments.
+	
+	Improvments: space partitioning for speed increase (octree?)	
 */
 class MarchingCubes
 {
@@ -34,6 +41,17 @@ class MarchingCubes
 	int dataChangedDepth;
 	bool dataChangedGlobal;
 
+	// Triangles of the cubes of one block
+	struct BlockMesh
+	{
+		std::vector<glm::vec3> triangles;
+		std::vector<glm::vec3> normals;
+	};
+	std::vector<BlockMesh> blockMeshes;
+	std::vector<int> changedBlocks;
+	char* meshedField;		// Data the cached block meshes were generated from
+	bool meshesValid;		// False after treshold or mode changes, all blocks are regenerated
+
 
 	bool useInterpolated;
 
@@ -50,9 +68,21 @@ class MarchingCubes
 	GLuint pointGridBuffer;
 
 	void generateTriangles();
-	void generateTriangles( int x, int countX, int y, int countY, int z, int countZ );
+	// Meshes the cubes with the origin in the given range into mesh.
+	void generateTriangles( int x, int countX, int y, int countY, int z, int countZ, BlockMesh& mesh );
+	// Regenerates the blocks whose data changed and reassembles the draw buffer.
+	void updateTriangles();
+	void generateBlock( int block );
+	void assembleTriangles();
 	void drawTriangleBuffer();
 
+	int getBlockIndex( int x, int y, int z );
+	// Cube origins of the block along one axis: from start to end (exclusive).
+	void getBlockRange( int block, int blockSize, int dataSize, int& start, int& end );
+	// Compares the voxels read by the cubes of the block with meshedField.
+	bool blockDataChanged( int block );
+	void copyBlockData( int block );
+
 	void setDataChanged( int x, int y, int z, bool value = true );
 	bool getDataChanged( int x, int y, int z );
 	void setAllDataChanged( bool value );
@@ -65,6 +95,7 @@ public:
 
 	void setUseInterpolated( bool use )
 	{
+		if( use != useInterpolated ) meshesValid = false;
 		useInterpolated = use;
 	}
 
@@ -4,18 +4,20 @@
 #include "Utility.h"
 #include "MappedData.h"
 #include "ShaderProgram.h"
+#include "ThreadPool.h"
 #include <glm\common.hpp>
 #include <glm\geometric.hpp>
+#include <cstring>
 
 MarchingCubesBasic::MarchingCubesBasic( )
 {
-	dataField = NULL;
 	dataWidth = 0;
 	dataHeight = 0;
 	dataDepth = 0;
 	position = glm::vec3(0,0,0);
 	span = glm::vec3(1,1,1);
 	dSpan = glm::vec3(0,0,0);
+	splatsClamped = true;
 	triangles = NULL;
 	normals = 0;
 	trianglesCount = 0;
@@ -30,8 +32,10 @@ MarchingCubesBasic::MarchingCubesBasic( int w, int h, int d, float treshold, flo
 	dataDepth = d<DATA_CHANGE_DIV ? DATA_CHANGE_DIV : d;
 	dataSize = dataWidth * dataHeight * dataDepth;
 	dSpan = span / glm::vec3( dataWidth, dataHeight, dataDepth );
+	splatter.setVoxelSize( dSpan );
+	splatsClamped = true;
 
-	dataField = new float[ dataSize ];
+	dataField.resize( dataWidth, dataHeight, dataDepth );
 				
 	trianglesCount = 0;
 	trianglesSize = TRIANGLE_COUNT_INCREASE;
@@ -56,7 +60,9 @@ MarchingCubesBasic::MarchingCubesBasic( const char* filePath )
 	dataDepth = dataDepth<DATA_CHANGE_DIV ? DATA_CHANGE_DIV : dataDepth;
 	dataSize = dataWidth * dataHeight * dataDepth;
 	dSpan = span / glm::vec3( dataWidth, dataHeight, dataDepth );
-	dataField = new float[ dataSize ];
+	splatter.setVoxelSize( dSpan );
+	splatsClamped = true;
+	dataField.resize( dataWidth, dataHeight, dataDepth );
 
 	dataMax = paramFile.getData("base","maxValue").get<float>();
 	treshold = paramFile.getData("base","treshold").get<float>();
@@ -71,7 +77,6 @@ MarchingCubesBasic::MarchingCubesBasic( const char* filePath )
 
 MarchingCubesBasic::~MarchingCubesBasic()
 {
-	delete [] dataField;
 	delete [] triangles;
 	delete [] normals;
 }
@@ -79,33 +84,41 @@ MarchingCubesBasic::~MarchingCubesBasic()
 void MarchingCubesBasic::set( int x, int y, int z, float value )
 {
 	if( x<1 || y<1  || z<1 || x>=dataWidth-1 || y>=dataHeight-1 || z>=dataDepth-1 ) return;	
-	float &data = dataField[ x*dataHeight*dataDepth + y*dataDepth + z ];
+	float &data = dataField.at( x, y, z );
 	data = contain(value+data, 0.0f, dataMax);
 }
 
 void MarchingCubesBasic::set( int position, float value )
 {
-	if( position<0 || position>this->dataSize ) return;	
-	dataField[ position ] = contain(value, 0.0f, dataMax);
+	if( position<0 || position>=this->dataSize ) return;	
+	dataField.at( position / (dataHeight*dataDepth), (position / dataDepth) % dataHeight, position % dataDepth ) = contain(value, 0.0f, dataMax);
+	dataChanged = true;
 }
 
 void MarchingCubesBasic::setUnchecked( int x, int y, int z, float value )
 {
-	float &data = dataField[ x*dataHeight*dataDepth + y*dataDepth + z ];
+	float &data = dataField.at( x, y, z );
 	data = contain(value+data, 0.0f, dataMax);
 }
 
 void MarchingCubesBasic::clear()
 {
-	for(int i=0; i<dataWidth*dataHeight*dataDepth; i++)
-	{
-		dataField[i] = 0;
-	}
+	dataField.clear();
+	splatsClamped = true;
 	trianglesCount = 0;
+	dataChanged = false;
+}
+
+void MarchingCubesBasic::clampSplats()
+{
+	if( splatsClamped ) return;
+	SphereSplatter::clampField( dataField, dataMax );
+	splatsClamped = true;
 }
 
 void MarchingCubesBasic::drawGrid( glm::vec3 colorFalse, glm::vec3 colorTrue )
 {	
+	clampSplats();
 	glMatrixMode(GL_MODELVIEW);	
 	glPushMatrix();
 	glTranslatef(position.x,position.y,position.z);
@@ -125,7 +138,7 @@ void MarchingCubesBasic::drawGrid( glm::vec3 colorFalse, glm::vec3 colorTrue )
 			z = 0;
 			for(int k=0; k<dataDepth; k++)
 			{		
-				value = dataField[ i*dataHeight*dataDepth + j*dataDepth	+ k ];
+				value = dataField.get( i, j, k );
 				if( value > treshold && value < dataMax/2.0 )
 				{
 					color = colorTrue * ((value-treshold) / dataMax);
@@ -151,7 +164,7 @@ void MarchingCubesBasic::drawGrid( glm::vec3 colorFalse, glm::vec3 colorTrue )
 			z = 0;
 			for(int k=0; k<dataDepth; k++)
 			{
-				if( dataField[ i*dataHeight*dataDepth + j*dataDepth	+ k ] < treshold )
+				if( dataField.get( i, j, k ) < treshold )
 				{
 					glVertex3f( x, y, z );		
 				}
@@ -165,58 +178,100 @@ void MarchingCubesBasic::drawGrid( glm::vec3 colorFalse, glm::vec3 colorTrue )
 	glPopMatrix();
 }
 
+void MarchingCubesBasic::getCube( int i, int j, int k, float cube[8] )
+{
+	cube[0] = dataField.get( i,   j,   k );
+	cube[1] = dataField.get( i,   j+1, k );
+	cube[2] = dataField.get( i+1, j+1, k );
+	cube[3] = dataField.get( i+1, j,   k );
+	cube[4] = dataField.get( i,   j,   k+1 );
+	cube[5] = dataField.get( i,   j+1, k+1 );
+	cube[6] = dataField.get( i+1, j+1, k+1 );
+	cube[7] = dataField.get( i+1, j,   k+1 );
+}
+
+// Only cubes touching an allocated brick are visited. Cubes made only of unallocated (zero)
+// voxels lie completely below a non negative treshold and produce no triangles.
+// The first pass classifies the cubes of every mesh brick and counts its vertices, a prefix sum
+// over the bricks then gives every brick its exact place in the vertex buffer, so the second
+// pass can write the vertices in parallel without any locking or reallocation.
 void MarchingCubesBasic::generateTriangles()
 {
 	trianglesCount = 0;	// reset the triangle buffer
+	clampSplats();
+	dataField.getMeshBricks( meshBricks, meshBrickMarks );
 
-	int HD = dataHeight*dataDepth;
-	int iHD;	// i*dataHeight*dataDepth
-	int iHDjD;  // i*dataHeight*dataDepth + j*dataDepth
-	int index0, index1, index2, index3;	// helping indices
+	const int B = BrickField::BRICK_SIZE;
+	const int V = BrickField::BRICK_VOLUME;
+	int brickCount = (int)meshBricks.size();
+	cubeIndices.resize( brickCount*V );
+	meshBrickStarts.assign( brickCount+1, 0 );
 
-	float cube[8];	
-	for(int i=0; i<dataWidth-1; i++)
+	ThreadPool::getInstance().parallelFor( brickCount, [this, B, V]( int n )
 	{
-		iHD = i*HD;
-		for(int j=0; j<dataHeight-1; j++)
+		int bx, by, bz;
+		dataField.getBrickCoords( meshBricks[n], bx, by, bz );
+		int iEnd = glm::min( (bx+1)*B, dataWidth-1 );
+		int jEnd = glm::min( (by+1)*B, dataHeight-1 );
+		int kEnd = glm::min( (bz+1)*B, dataDepth-1 );
+
+		float cube[8];
+		int cubeIndex;
+		int count = 0;
+		unsigned char* indices = &cubeIndices[n*V];
+		memset( indices, 0, V );
+		for(int i=bx*B; i<iEnd; i++)
 		{
-			iHDjD = iHD + j*dataDepth;
-			for(int k=0; k<dataDepth-1; k++)
+			for(int j=by*B; j<jEnd; j++)
 			{
-				index0 = iHDjD  + k;			// i*dataHeight*dataDepth + j*dataDepth + k
-				index1 = index0 + dataDepth;	// i*dataHeight*dataDepth + (j+1)*dataDepth + k
-				index2 = index1 + HD;			// (i+1)*dataHeight*dataDepth + (j+1)*dataDepth + k
-				index3 = index0 + HD;			// (i+1)*dataHeight*dataDepth + j*dataDepth + k
-
-				cube[0] = dataField[index0];
-				cube[1] = dataField[index1];
-				cube[2] = dataField[index2];
-				cube[3] = dataField[index3];
-				cube[4] = dataField[index0 + 1 ];
-				cube[5] = dataField[index1 + 1 ];
-				cube[6] = dataField[index2 + 1 ];
-				cube[7] = dataField[index3 + 1 ];
-
-				trianglesCount += MarchingCubesFactory::getFloatInterpolatedCube( cube, triangles, normals, trianglesCount, glm::vec3(i,j,k), dataMax, treshold);
-			
-				if( trianglesCount > trianglesSize - MarchingCubesFactory::MAX_VERTICES )
+				for(int k=bz*B; k<kEnd; k++)
 				{
-					int newSize = trianglesSize + TRIANGLE_COUNT_INCREASE;				
-					glm::vec3* newTriangles = new glm::vec3[ newSize ];
-					glm::vec3* newNormals = new glm::vec3[ newSize ];
-
-					memcpy( newTriangles, triangles, trianglesSize * sizeof(glm::vec3) );
-					memcpy( newNormals, normals, trianglesSize * sizeof(glm::vec3) );
-
-					trianglesSize = newSize;
-					delete [] triangles;
-					delete [] normals;
-					triangles = newTriangles;
-					normals = newNormals;
+					getCube( i, j, k, cube );
+					cubeIndex = MarchingCubesFactory::getFloatCubeIndex( cube, treshold );
+					indices[ BrickField::localIndex( i-bx*B, j-by*B, k-bz*B ) ] = (unsigned char)cubeIndex;
+					count += MarchingCubesFactory::getVertexCount( cubeIndex );
 				}
 			}
 		}
+		meshBrickStarts[n+1] = count;
+	});
+
+	for(int n=0; n<brickCount; n++)
+	{
+		meshBrickStarts[n+1] += meshBrickStarts[n];
+	}
+	trianglesCount = meshBrickStarts[brickCount];
+
+	// The old contents are regenerated, so growing needs no copy
+	if( trianglesCount > trianglesSize )
+	{
+		trianglesSize = glm::max( trianglesCount + trianglesCount/2, (int)TRIANGLE_COUNT_INCREASE );
+		delete [] triangles;
+		delete [] normals;
+		triangles = new glm::vec3[ trianglesSize ];
+		normals = new glm::vec3[ trianglesSize ];
 	}
+
+	ThreadPool::getInstance().parallelFor( brickCount, [this, B, V]( int n )
+	{
+		int bx, by, bz;
+		dataField.getBrickCoords( meshBricks[n], bx, by, bz );
+		const unsigned char* indices = &cubeIndices[n*V];
+		int vertex = meshBrickStarts[n];
+		int end = meshBrickStarts[n+1];
+		float cube[8];
+		for(int l=0; l<V && vertex<end; l++)
+		{
+			if( !MarchingCubesFactory::edgeTable[ indices[l] ] ) continue;
+
+			int i = bx*B + l/(B*B);
+			int j = by*B + (l/B)%B;
+			int k = bz*B + l%B;
+			getCube( i, j, k, cube );
+			vertex += MarchingCubesFactory::getFloatInterpolatedCube( cube, triangles, normals, vertex, glm::vec3(i,j,k), dataMax, treshold);
+		}
+	});
+
 	dataChanged = false;
 }
 
@@ -266,37 +321,63 @@ void MarchingCubesBasic::drawTriangleBuffer()
 
 void MarchingCubesBasic::putSphere( float x, float y, float z, float r )
 {
-	float value;
-	glm::vec3 start = glm::vec3( x-r, y-r, z-r );
-	start = glm::clamp( start, position, position+span );
-	start -= position;
-	start /= dSpan;
-
-	glm::vec3 end = glm::vec3( x+r, y+r, z+r );
-	start = glm::clamp( end, position, position+span );
-	end -= position;
-	end /= dSpan;
-
 	glm::vec3 center = (glm::vec3( x,y,z ) - position) / dSpan;
-	r /= glm::length( dSpan );
+	// Border voxels are never set, same as in set(). The box includes the voxel of center + r,
+	// like MarchingCubesShaded, the old loop of this grid stopped one voxel before it.
+	splatter.splat( dataField, center, r, glm::ivec3( 1, 1, 1 ), glm::ivec3( dataWidth-2, dataHeight-2, dataDepth-2 ) );
+
+	splatsClamped = false;
+	dataChanged = true;
+}
 
-	for(int i= (int)start.x; i<(int)end.x; i++)
+void MarchingCubesBasic::putSpheres( const std::vector<glm::vec3>& centers, float r )
+{
+	splatCenters.resize( centers.size() );
+	for( size_t i=0; i<centers.size(); i++ )
 	{
-		for(int j= (int)start.y; j<(int)end.y; j++)
-		{
-			for(int k= (int)start.z; k<(int)end.z; k++)
-			{
-				value = r-glm::length(center-glm::vec3(i,j,k))+1;
-				if( value > 0 )
-					set( i, j, k, value );
-				
-			}
-		}
+		splatCenters[i] = (centers[i] - position) / dSpan;
 	}
+	if( splatCenters.empty() ) return;
+	splatter.splatAll( dataField, &splatCenters[0], (int)splatCenters.size(), r, glm::ivec3( 1, 1, 1 ), glm::ivec3( dataWidth-2, dataHeight-2, dataDepth-2 ) );
 
+	splatsClamped = false;
 	dataChanged = true;
 }
 
+int MarchingCubesBasic::getMesh( std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& vertexNormals )
+{
+	if( dataChanged ) generateTriangles();
+
+	vertices.resize( trianglesCount );
+	vertexNormals.resize( trianglesCount );
+	for(int i=0; i<trianglesCount; i++)
+	{
+		vertices[i] = position + triangles[i]*dSpan;
+		vertexNormals[i] = normals[i];
+	}
+	return trianglesCount;
+}
+
+int MarchingCubesBasic::getIndexedMesh( std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& vertexNormals, std::vector<int>& indices )
+{
+	clampSplats();
+	dataField.getMeshBricks( meshBricks, meshBrickMarks );
+	indexedMesh.build( dataField, meshBricks, treshold );
+
+	int count = (int)indexedMesh.vertices.size();
+	vertices.resize( count );
+	vertexNormals.resize( count );
+	for(int i=0; i<count; i++)
+	{
+		vertices[i] = position + indexedMesh.vertices[i]*dSpan;
+		// Gradients transform with the inverse scale
+		glm::vec3 normal = indexedMesh.normals[i] / dSpan;
+		float length = glm::length( normal );
+		vertexNormals[i] = length > 0 ? normal / length : normal;
+	}
+	indices = indexedMesh.indices;
+	return indexedMesh.getTriangleCount();
+}
 
 glm::vec3 MarchingCubesBasic::getScale()
 {
@@ -3,7 +3,11 @@
 #define _MARCHING_CUBES_BASIC_H
 
 #include "GlmVec.h"
+#include "BrickField.h"
+#include "SphereSplatter.h"
+#include "MarchingCubesMesh.h"
 #include <gl\glew.h>
+#include <vector>
 class MappedData;
 class ShaderProgram;
 
@@ -16,11 +20,14 @@ class ShaderProgram;
 */
 class MarchingCubesBasic
 {
-	static const int TRIANGLE_COUNT_INCREASE = 1024;
+	static const int TRIANGLE_COUNT_INCREASE = 1024;	// Minimal vertex buffer size
 	static const int DATA_CHANGE_DIV = 8;
 	static const int DATA_CHANGE_SIZE = DATA_CHANGE_DIV*DATA_CHANGE_DIV*DATA_CHANGE_DIV;
 
-	float* dataField;
+	BrickField dataField;		// Sparse, only bricks touched since the last clear are allocated
+	SphereSplatter splatter;
+	bool splatsClamped;			// putSphere only adds, values are clamped once before they are read
+	std::vector<glm::vec3> splatCenters;	// putSpheres centers in voxel coordinates
 	float treshold;
 	float dataMax;
 	int dataWidth;
@@ -37,8 +44,18 @@ class MarchingCubesBasic
 	glm::vec3* normals;
 	int trianglesCount;
 	int trianglesSize;
+
+	std::vector<int> meshBricks;		// Bricks whose cubes can produce triangles
+	std::vector<char> meshBrickMarks;
+	std::vector<int> meshBrickStarts;	// First vertex of each mesh brick, prefix sum of the counts
+	std::vector<unsigned char> cubeIndices;	// Classification of every cube of the mesh bricks
+	MarchingCubesMesh indexedMesh;
 		
 	void setUnchecked( int x, int y, int z, float value );
+	void clampSplats();
+	// Reads the 8 corners of the cube with the origin in the given voxel.
+	void getCube( int i, int j, int k, float cube[8] );
+	// Two pass parallel meshing over the mesh bricks: classify and count, prefix sum, emit.
 	void generateTriangles();
 //	void generateTriangles( int x, int countX, int y, int countY, int z, int countZ );
 	void drawTriangleBuffer();
@@ -59,6 +76,15 @@ public:
 	void drawLightedCubes( GLfloat material[4] );
 	
 	void putSphere( float x, float y, float z, float r );
+	// Splats all spheres at once on the thread pool, the result equals calling putSphere for each.
+	void putSpheres( const std::vector<glm::vec3>& centers, float r );
+
+	// Copies the current triangle soup (3 vertices per triangle) in world space. Triangles are
+	// regenerated first if the data changed. Does not touch OpenGL, so it can run off the main thread.
+	int getMesh( std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& vertexNormals );
+	// Indexed mesh with shared vertices and smooth (gradient) normals in world space, 3 indices
+	// per triangle. Built from the current data without touching OpenGL. Returns the triangle count.
+	int getIndexedMesh( std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& vertexNormals, std::vector<int>& indices );
 
 	glm::vec3 getScale();
 	glm::vec3 getPosition();	
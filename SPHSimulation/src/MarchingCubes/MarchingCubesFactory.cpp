@@ -50,10 +50,34 @@ int MarchingCubesFactory::getCubeIndex( char verticeValues[8], char treshold )
 	return cubeIndex;
 }
 
-int MarchingCubesFactory::getFloatInterpolatedCube( float verticeValues[8], glm::vec3* triangles, glm::vec3* normals, int start, glm::vec3 offset, float maxValue, float treshold )
+int MarchingCubesFactory::getFloatCubeIndex( float verticeValues[8], float treshold )
 {
 	int cubeIndex = 0;
 	for(int n=0; n<8; n++) if(verticeValues[n]>treshold) cubeIndex |= (1<<n);
+	return cubeIndex;
+}
+
+int MarchingCubesFactory::getVertexCount( int cubeIndex )
+{
+	struct VertexCounts
+	{
+		int counts[256];
+		VertexCounts()
+		{
+			for(int i=0; i<256; i++)
+			{
+				counts[i] = 0;
+				while( counts[i] < 16 && triTable[i][counts[i]] != -1 ) counts[i]++;
+			}
+		}
+	};
+	static const VertexCounts table;
+	return table.counts[cubeIndex];
+}
+
+int MarchingCubesFactory::getFloatInterpolatedCube( float verticeValues[8], glm::vec3* triangles, glm::vec3* normals, int start, glm::vec3 offset, float maxValue, float treshold )
+{
+	int cubeIndex = getFloatCubeIndex( verticeValues, treshold );
 	if(!edgeTable[cubeIndex]) return 0;
 
 	float edgeWeight[12];
@@ -25,6 +25,9 @@ public:
 	static int getFloatInterpolatedCube( float verticeValues[8], glm::vec3* triangles, glm::vec3* normals, int start, glm::vec3 offset, float maxValue = 1, float treshold=0 );
 
 	static int getCubeIndex( char verticeValues[8], char treshold = 0 );
+	static int getFloatCubeIndex( float verticeValues[8], float treshold = 0 );
+	// Number of vertices (3 per triangle) the triTable produces for the cube index.
+	static int getVertexCount( int cubeIndex );
 	
 	static void initTexture();
 	static void setTexture(GLenum textureSlot);
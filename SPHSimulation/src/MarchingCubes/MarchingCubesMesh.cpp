@@ -0,0 +1,163 @@
+#include "MarchingCubesMesh.h"
+#include "MarchingCubesFactory.h"
+#include "BrickField.h"
+#include <glm\common.hpp>
+#include <glm\geometric.hpp>
+#include <algorithm>
+
+// Edges in the order of the MarchingCubesFactory tables, cube corners are
+// 0 (0,0,0) 1 (0,1,0) 2 (1,1,0) 3 (1,0,0) 4 (0,0,1) 5 (0,1,1) 6 (1,1,1) 7 (1,0,1)
+const int MarchingCubesMesh::edgeDirection[12] = {
+	1, 0, 1, 0,		// front face
+	1, 0, 1, 0,		// back face
+	2, 2, 2, 2		// cube middle
+};
+
+const int MarchingCubesMesh::edgeStart[12][3] = {
+	{0,0,0}, {0,1,0}, {1,0,0}, {0,0,0},
+	{0,0,1}, {0,1,1}, {1,0,1}, {0,0,1},
+	{0,0,0}, {0,1,0}, {1,1,0}, {1,0,0}
+};
+
+MarchingCubesMesh::MarchingCubesMesh() :
+	width(0), height(0), depth(0)
+{
+}
+
+void MarchingCubesMesh::clear()
+{
+	vertices.clear();
+	normals.clear();
+	indices.clear();
+}
+
+int MarchingCubesMesh::getTriangleCount() const
+{
+	return (int)indices.size() / 3;
+}
+
+void MarchingCubesMesh::build( const BrickField& field, const std::vector<int>& bricks, float treshold )
+{
+	clear();
+
+	width = field.getWidth();
+	height = field.getHeight();
+	depth = field.getDepth();
+	EdgeEntry empty = { -1, -1 };
+	edgesX.assign( height*depth, empty );
+	for(int n=0; n<2; n++)
+	{
+		edgesY[n].assign( height*depth, empty );
+		edgesZ[n].assign( height*depth, empty );
+	}
+
+	// Brick indices grow with x first, so sorting groups the bricks of each brick column in x
+	sortedBricks = bricks;
+	std::sort( sortedBricks.begin(), sortedBricks.end() );
+
+	const int B = BrickField::BRICK_SIZE;
+	float cube[8];
+	int edgeVertices[12];
+	int bx, by, bz, bx2, by2, bz2;
+	size_t first = 0, last;
+	while( first < sortedBricks.size() )
+	{
+		field.getBrickCoords( sortedBricks[first], bx, by, bz );
+		for( last = first+1; last < sortedBricks.size(); last++ )
+		{
+			field.getBrickCoords( sortedBricks[last], bx2, by2, bz2 );
+			if( bx2 != bx ) break;
+		}
+
+		// One slab at a time over all bricks of the column, the plane cache moves along x
+		int iEnd = glm::min( (bx+1)*B, width-1 );
+		for(int i=bx*B; i<iEnd; i++)
+		{
+			for(size_t n=first; n<last; n++)
+			{
+				field.getBrickCoords( sortedBricks[n], bx2, by, bz );
+				int jEnd = glm::min( (by+1)*B, height-1 );
+				int kEnd = glm::min( (bz+1)*B, depth-1 );
+				for(int j=by*B; j<jEnd; j++)
+				{
+					for(int k=bz*B; k<kEnd; k++)
+					{
+						cube[0] = field.get( i,   j,   k );
+						cube[1] = field.get( i,   j+1, k );
+						cube[2] = field.get( i+1, j+1, k );
+						cube[3] = field.get( i+1, j,   k );
+						cube[4] = field.get( i,   j,   k+1 );
+						cube[5] = field.get( i,   j+1, k+1 );
+						cube[6] = field.get( i+1, j+1, k+1 );
+						cube[7] = field.get( i+1, j,   k+1 );
+
+						int cubeIndex = MarchingCubesFactory::getFloatCubeIndex( cube, treshold );
+						int edges = MarchingCubesFactory::edgeTable[cubeIndex];
+						if( !edges ) continue;
+
+						for(int e=0; e<12; e++)
+						{
+							if( edges & (1<<e) )
+							{
+								edgeVertices[e] = getEdgeVertex( field, i+edgeStart[e][0], j+edgeStart[e][1], k+edgeStart[e][2], edgeDirection[e], treshold );
+							}
+						}
+
+						// Same winding as MarchingCubesFactory
+						const int* tri = MarchingCubesFactory::triTable[cubeIndex];
+						for(int t=0; tri[t] != -1; t+=3)
+						{
+							indices.push_back( edgeVertices[ tri[t+2] ] );
+							indices.push_back( edgeVertices[ tri[t] ] );
+							indices.push_back( edgeVertices[ tri[t+1] ] );
+						}
+					}
+				}
+			}
+		}
+		first = last;
+	}
+}
+
+void MarchingCubesMesh::build( const BrickField& field, float treshold )
+{
+	field.getMeshBricks( meshBricks, brickMarks );
+	build( field, meshBricks, treshold );
+}
+
+int MarchingCubesMesh::getEdgeVertex( const BrickField& field, int x, int y, int z, int direction, float treshold )
+{
+	int cell = y*depth + z;
+	EdgeEntry& entry = direction == 0 ? edgesX[cell] : direction == 1 ? edgesY[x&1][cell] : edgesZ[x&1][cell];
+	if( entry.x == x ) return entry.vertex;
+
+	glm::ivec3 end( x, y, z );
+	end[direction]++;
+	float a = field.get( x, y, z );
+	float b = field.get( end.x, end.y, end.z );
+	// Exactly one end is above the treshold, so a != b
+	float t = ( treshold - a ) / ( b - a );
+
+	glm::vec3 position( (float)x, (float)y, (float)z );
+	position[direction] += t;
+	glm::vec3 gradient = glm::mix( getGradient( field, x, y, z ), getGradient( field, end.x, end.y, end.z ), t );
+	float length = glm::length( gradient );
+
+	entry.x = x;
+	entry.vertex = (int)vertices.size();
+	vertices.push_back( position );
+	normals.push_back( length > 0 ? -gradient / length : glm::vec3( 0, 0, 0 ) );
+	return entry.vertex;
+}
+
+// Central differences, one sided at the borders of the field
+glm::vec3 MarchingCubesMesh::getGradient( const BrickField& field, int x, int y, int z ) const
+{
+	int x0 = glm::max( x-1, 0 ), x1 = glm::min( x+1, width-1 );
+	int y0 = glm::max( y-1, 0 ), y1 = glm::min( y+1, height-1 );
+	int z0 = glm::max( z-1, 0 ), z1 = glm::min( z+1, depth-1 );
+	return glm::vec3(
+		( field.get( x1, y, z ) - field.get( x0, y, z ) ) / (float)glm::max( x1-x0, 1 ),
+		( field.get( x, y1, z ) - field.get( x, y0, z ) ) / (float)glm::max( y1-y0, 1 ),
+		( field.get( x, y, z1 ) - field.get( x, y, z0 ) ) / (float)glm::max( z1-z0, 1 ) );
+}
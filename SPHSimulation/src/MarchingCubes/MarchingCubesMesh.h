@@ -0,0 +1,66 @@
+#pragma once
+#ifndef _MARCHING_CUBES_MESH_H
+#define _MARCHING_CUBES_MESH_H
+
+#include "GlmVec.h"
+#include <vector>
+
+class BrickField;
+
+/*
+	Indexed marching cubes mesh of a BrickField. Every edge crossing of the iso surface becomes
+	one shared vertex, triangles refer to the vertices through an index buffer, so neighbouring
+	cubes do not compute and store the same vertex again. Vertex normals are the interpolated
+	field gradients (central differences) instead of per triangle normals, which gives smooth
+	shading.
+
+	The cubes are visited in slabs of constant x. Vertex indices of the edges are cached for the
+	current slab (x edges) and for its two bounding planes (y and z edges), the plane at x+1 is
+	reused by the next slab. Cache entries carry the x they were written for, so nothing has to
+	be cleared between slabs and only the bricks that can produce triangles are visited.
+
+	Triangles use the same tables and winding as MarchingCubesFactory, vertices are placed at
+	the linearly interpolated treshold crossing. Output is in voxel coordinates.
+*/
+class MarchingCubesMesh
+{
+	struct EdgeEntry
+	{
+		int x;			// Slab or plane the vertex belongs to, -1 if never written
+		int vertex;
+	};
+
+	static const int edgeDirection[12];		// 0 x, 1 y, 2 z
+	static const int edgeStart[12][3];		// Cube corner the edge starts at
+
+	int width;
+	int height;
+	int depth;
+	std::vector<EdgeEntry> edgesX;			// Per (y,z) of the current slab
+	std::vector<EdgeEntry> edgesY[2];		// Per (y,z) of the planes, by x parity
+	std::vector<EdgeEntry> edgesZ[2];
+	std::vector<int> sortedBricks;
+	std::vector<int> meshBricks;
+	std::vector<char> brickMarks;
+
+	int getEdgeVertex( const BrickField& field, int x, int y, int z, int direction, float treshold );
+	glm::vec3 getGradient( const BrickField& field, int x, int y, int z ) const;
+
+public:
+	std::vector<glm::vec3> vertices;
+	std::vector<glm::vec3> normals;		// Unit length, pointing out of the surface (down the field)
+	std::vector<int> indices;			// 3 per triangle
+
+	MarchingCubesMesh();
+
+	// Rebuilds the mesh from the cubes with the origin in the given bricks. bricks has to hold
+	// every brick whose cubes can cross the treshold.
+	void build( const BrickField& field, const std::vector<int>& bricks, float treshold );
+	// Rebuilds the mesh from the allocated bricks and their neighbours in the negative directions.
+	void build( const BrickField& field, float treshold );
+	void clear();
+
+	int getTriangleCount() const;
+};
+
+#endif
@@ -4,14 +4,35 @@
 #include "ShaderProgram.h"
 #include "MarchingCubesFactory.h"
 #include "Camera.h"
+#include "ThreadPool.h"
 #include <glm\geometric.hpp>
 #include <glm\common.hpp>
 #include <glm\gtc\matrix_transform.hpp>
 #include <glm\gtc\type_ptr.hpp>
+#include <glm\gtc\packing.hpp>
+#include <cmath>
+#include <cstring>
 
 using namespace std;
 
+MarchingCubesShaded::Mesher MarchingCubesShaded::parseMesher( const string& name, Mesher fallback )
+{
+	if( name == "gpu" ) return GPU_MESHER;
+	if( name == "cpu" ) return CPU_MESHER;
+	return fallback;
+}
+
 MarchingCubesShaded::MarchingCubesShaded( const char* filePath )
+{
+	init( filePath, nullptr );
+}
+
+MarchingCubesShaded::MarchingCubesShaded( const char* filePath, Mesher mesher )
+{
+	init( filePath, &mesher );
+}
+
+void MarchingCubesShaded::init( const char* filePath, const Mesher* mesherOverride )
 {
 	MappedData paramFile( filePath );
 
@@ -28,14 +49,74 @@ MarchingCubesShaded::MarchingCubesShaded( const char* filePath )
 	
 	dataMax = paramFile.getData("base","maxValue").get<float>();
 	treshold = paramFile.getData("base","treshold").get<float>( 0.5f );
+	mesher = mesherOverride ? *mesherOverride : parseMesher( paramFile.getData("base","mesher").getStringData( "gpu" ) );
+
+	shaderFiles[0] = paramFile.getData("shaders", "v").getStringData();
+	shaderFiles[1] = paramFile.getData("shaders", "g").getStringData();
+	shaderFiles[2] = paramFile.getData("shaders", "f").getStringData();
+	meshShaderFiles[0] = paramFile.getData("meshShaders", "v").getStringData( "data/shaders/mcMesh.vert" );
+	meshShaderFiles[1] = paramFile.getData("meshShaders", "f").getStringData( "data/shaders/mcMesh.frag" );
+
+	halfFloatData = paramFile.getData("base","halfFloat").get<int>( 0 ) != 0;
+	uploadBufferCount = glm::clamp( paramFile.getData("base","uploadBuffers").get<int>( 2 ), 0, (int)MAX_UPLOAD_BUFFERS );
+	uploadBufferIndex = 0;
+	for( int i=0; i<MAX_UPLOAD_BUFFERS; i++ )
+	{
+		uploadBuffers[i] = 0;
+		uploadBufferSizes[i] = 0;
+	}
 
-	string vertex = paramFile.getData("shaders", "v").getStringData();
-	string geometry = paramFile.getData("shaders", "g").getStringData();
-	string fragment = paramFile.getData("shaders", "f").getStringData();
-	
-	mcShader = ShaderProgram::CreateShader( vertex, geometry, fragment);
-	
-	GLuint programHandle = mcShader->getProgramID();
+	float isoValue = paramFile.getData("field", "isoValue").get<float>( 0.5f );
+	fieldScale = treshold / isoValue;
+	fieldSampler.setAnisotropic( paramFile.getData("field", "anisotropic").get<int>( 0 ) != 0 );
+	fieldSampler.setCenterSmoothing( paramFile.getData("field", "centerSmoothing").get<float>( 0.5f ) );
+
+	mcShader = nullptr;
+	meshShader = nullptr;
+	gpuMesherReady = false;
+	cpuMesherReady = false;
+	dataTexID = 0;
+	gridVao = 0;
+	gridHandle = 0;
+	activeCellHandle = 0;
+	activeCellsTreshold = treshold;
+	meshVao = 0;
+	meshVertexBuffer = 0;
+	meshIndexBuffer = 0;
+	meshIndexCount = 0;
+	meshUploaded = false;
+	meshTreshold = treshold;
+
+	dataSize = dataWidth * dataHeight * dataDepth;
+	deltaSpan = vSpan / glm::vec3( dataWidth, dataHeight, dataDepth );
+	dataField.resize( dataWidth, dataHeight, dataDepth );
+	splatter.setVoxelSize( deltaSpan );
+
+	clear();
+}
+
+MarchingCubesShaded::~MarchingCubesShaded( )
+{
+	if( gpuMesherReady )
+	{
+		glDeleteTextures(1,&dataTexID);
+		// delete buffer and vao
+		glDeleteBuffers(1,&gridHandle);
+		glDeleteBuffers(1,&activeCellHandle);
+		glDeleteVertexArrays(1,&gridVao);
+		if( uploadBufferCount > 0 ) glDeleteBuffers(uploadBufferCount,uploadBuffers);
+	}
+	if( cpuMesherReady )
+	{
+		glDeleteBuffers(1,&meshVertexBuffer);
+		glDeleteBuffers(1,&meshIndexBuffer);
+		glDeleteVertexArrays(1,&meshVao);
+	}
+}
+
+void MarchingCubesShaded::initGpuMesher( )
+{
+	mcShader = ShaderProgram::CreateShader( shaderFiles[0], shaderFiles[1], shaderFiles[2] );
 
 	initDataField( );	
 		
@@ -63,20 +144,48 @@ MarchingCubesShaded::MarchingCubesShaded( const char* filePath )
 		mcShader->setUniformV3( "DataStep", 1.0f/dataWidth, 1.0f/dataHeight, 1.0f/dataDepth );
 	mcShader->turnOff();
 
-	clear();
+	gpuMesherReady = true;
 }
 
-MarchingCubesShaded::~MarchingCubesShaded( )
+// Vertices are positions and normals interleaved, in the 0 - 1 texture space the GPU mesher
+// works in (data x and z swapped, see uploadDataField), so both meshers are drawn with the same
+// transform.
+void MarchingCubesShaded::initCpuMesher( )
 {
-	delete [] dataField;
-	// delete buffer and vao
-	glDeleteBuffers(1,&gridHandle);
-	glDeleteVertexArrays(1,&gridVao);
+	meshShader = ShaderProgram::CreateShader( meshShaderFiles[0], meshShaderFiles[1] );
+
+	glGenBuffers(1, &meshVertexBuffer);
+	glGenBuffers(1, &meshIndexBuffer);
+	glGenVertexArrays(1, &meshVao);
+
+	glBindVertexArray(meshVao);
+	glBindBuffer(GL_ARRAY_BUFFER, meshVertexBuffer);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 2*sizeof(glm::vec3), (GLubyte *)NULL);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 2*sizeof(glm::vec3), (GLubyte *)NULL + sizeof(glm::vec3));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	meshShader->turnOn();
+		meshShader->setUniformV3("Color", 0.0f, 0.3f, 1.0f);
+		meshShader->setUniformV3("Diffuse", 0.4f, 0.9f, 0.0f);
+		meshShader->setUniformV3("Specular", 1.0f, 1.0f, 1.0f);
+		meshShader->setUniformV3("Ambient", 0.3f, 0.8f, 0.6f);
+		meshShader->setUniformV3("LightPosition", 20.f, -15.0f, 5.0f);
+	meshShader->turnOff();
+
+	meshUploaded = false;
+	cpuMesherReady = true;
 }
 
 // Create a 3D grid of points in the span od 0,0,0 - 1,1,1
 // This will be bound to the VAO and sent to the shader as vertices
 // Actual data that generates the marching cube mesh is sent as a 3D texture
+// Point (a,b,c) is at (a-1,b-1,c-1) * gridStep and has the index (a*(height+1) + b)*(depth+1) + c.
+// Only the points in the active cell index buffer are drawn.
 void MarchingCubesShaded::initGridBuffer( )
 {
 	gridStep = glm::vec3(1,1,1) / (glm::vec3(dataWidth, dataHeight, dataDepth)-glm::vec3(1,1,1));
@@ -85,18 +194,16 @@ void MarchingCubesShaded::initGridBuffer( )
 	int gridTotalSize =  gridElementCount*3;
 	float* grid = new float[gridTotalSize];
 	int index = 0;
-	bool done = false;
-	for( float x = -gridStep.x; x <= 1.0f && !done; x+=gridStep.x )
+	for( int a = 0; a <= dataWidth; a++ )
 	{
-		for( float y = -gridStep.y; y <= 1.0f && !done; y+=gridStep.y )
+		for( int b = 0; b <= dataHeight; b++ )
 		{
-			for( float z = -gridStep.z; z <= 1.0f && !done; z+=gridStep.z )
+			for( int c = 0; c <= dataDepth; c++ )
 			{
-				grid[ index   ] = x;
-				grid[ index+1 ] = y;
-				grid[ index+2 ] = z;
+				grid[ index   ] = (a-1) * gridStep.x;
+				grid[ index+1 ] = (b-1) * gridStep.y;
+				grid[ index+2 ] = (c-1) * gridStep.z;
 				index += 3;	
-				done = index >= gridTotalSize;
 			}
 		}
 	}
@@ -105,15 +212,119 @@ void MarchingCubesShaded::initGridBuffer( )
 	glBindBuffer( GL_ARRAY_BUFFER, gridHandle );
 	glBufferData( GL_ARRAY_BUFFER, gridTotalSize * sizeof(float), grid, GL_STATIC_DRAW );
 	delete[] grid;
+
+	glGenBuffers(1, &activeCellHandle);
 	
 	glGenVertexArrays( 1, &gridVao );
 	glBindVertexArray( gridVao );
 	glEnableVertexAttribArray(0);
 	glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, 0, (GLubyte *)NULL );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, activeCellHandle );
 
 	glBindVertexArray(0);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 	glDisableVertexAttribArray(0);
+
+	initCellVoxels();
+	activeCellsChanged = true;
+}
+
+// The geometry shader samples the texture with linear filtering at the cube corners. Grid point
+// a is at texture coordinate (a-1)*gridStep, which is voxel coordinate u(a) = (a-1)*gridStep*size - 0.5
+// (size of the texture axis), and its cube reaches to the next point, so it reads the voxels
+// floor(u(a)) to floor(u(a+1))+1, clamped to the field. Grid axis n is texture axis n, which is
+// data axis 2-n (see uploadDataField): grid x reads data z and grid z reads data x.
+void MarchingCubesShaded::initCellVoxels()
+{
+	int gridSizes[3] = { dataWidth, dataHeight, dataDepth };
+	int textureSizes[3] = { dataDepth, dataHeight, dataWidth };
+	for( int axis=0; axis<3; axis++ )
+	{
+		int size = textureSizes[axis];
+		float scale = gridStep[axis] * size;
+		cellVoxels[axis].resize( (gridSizes[axis]+1)*2 );
+		for( int a=0; a<=gridSizes[axis]; a++ )
+		{
+			int first = (int)floor( (a-1)*scale - 0.5f );
+			int last = (int)floor( a*scale - 0.5f ) + 1;
+			cellVoxels[axis][a*2] = glm::clamp( first, 0, size-1 );
+			cellVoxels[axis][a*2+1] = glm::clamp( last, 0, size-1 );
+		}
+	}
+	cellMarks.assign( gridElementCount, 0 );
+}
+
+void MarchingCubesShaded::findActiveCells()
+{
+	const int B = BrickField::BRICK_SIZE;
+	int gridHeight = dataHeight + 1;
+	int gridDepth = dataDepth + 1;
+	int gridSizes[3] = { dataWidth, dataHeight, dataDepth };
+	int textureSizes[3] = { dataDepth, dataHeight, dataWidth };
+
+	activeCells.clear();
+	visitedCells.clear();
+	const std::vector<int>& active = dataField.getActiveBricks();
+	int brick[3], from[3], to[3];
+	for( size_t n=0; n<active.size(); n++ )
+	{
+		dataField.getBrickCoords( active[n], brick[0], brick[1], brick[2] );
+		// Grid cubes sampling any voxel of the brick, grid axis n covers data axis 2-n. Cubes
+		// reading only unallocated voxels see zeros and stay below the treshold.
+		for( int axis=0; axis<3; axis++ )
+		{
+			int lo = brick[2-axis]*B;
+			int hi = glm::min( lo+B, textureSizes[axis] ) - 1;
+			const std::vector<int>& voxels = cellVoxels[axis];
+			from[axis] = 0;
+			while( from[axis] < gridSizes[axis] && voxels[from[axis]*2+1] < lo ) from[axis]++;
+			to[axis] = from[axis] - 1;
+			while( to[axis] < gridSizes[axis] && voxels[(to[axis]+1)*2] <= hi ) to[axis]++;
+		}
+
+		for( int a=from[0]; a<=to[0]; a++ )
+		{
+			for( int b=from[1]; b<=to[1]; b++ )
+			{
+				for( int c=from[2]; c<=to[2]; c++ )
+				{
+					int cell = (a*gridHeight + b)*gridDepth + c;
+					if( cellMarks[cell] ) continue;
+					cellMarks[cell] = 1;
+					visitedCells.push_back( (GLuint)cell );
+
+					// Interpolated samples lie between the smallest and largest voxel read, i runs along data
+					// z and k along data x
+					float low = dataMax, high = 0.0f, value;
+					for( int i=cellVoxels[0][a*2]; i<=cellVoxels[0][a*2+1]; i++ )
+					{
+						for( int j=cellVoxels[1][b*2]; j<=cellVoxels[1][b*2+1]; j++ )
+						{
+							for( int k=cellVoxels[2][c*2]; k<=cellVoxels[2][c*2+1]; k++ )
+							{
+								value = dataField.get( k, j, i );
+								low = glm::min( low, value );
+								high = glm::max( high, value );
+							}
+						}
+					}
+					if( low < treshold && high >= treshold )
+					{
+						activeCells.push_back( (GLuint)cell );
+					}
+				}
+			}
+		}
+	}
+
+	for( size_t n=0; n<visitedCells.size(); n++ )
+	{
+		cellMarks[ visitedCells[n] ] = 0;
+	}
+
+	activeCellsTreshold = treshold;
+	activeCellsChanged = false;
 }
 
 void MarchingCubesShaded::initDataField( )
@@ -131,41 +342,211 @@ void MarchingCubesShaded::initDataField( )
 	glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
 	glDisable(GL_TEXTURE_3D);
 
-	dataSize = dataWidth * dataHeight * dataDepth;
-	deltaSpan = vSpan / glm::vec3( dataWidth, dataHeight, dataDepth );
-	dataField = new float[ dataSize ]();
+	if( uploadBufferCount > 0 ) glGenBuffers(uploadBufferCount, uploadBuffers);
+
 	dataChanged = true;
+	textureAllocated = false;
 	// data is updated when changed
-//	glTexImage3D( GL_TEXTURE_3D, 0, GL_ALPHA32F_ARB, dataWidth, dataHeight, dataDepth, 0, GL_ALPHA, GL_FLOAT, dataField);
-	
+}
+
+void MarchingCubesShaded::clampSplats()
+{
+	if (!splatsClamped)
+	{
+		SphereSplatter::clampField( dataField, dataMax );
+		splatsClamped = true;
+	}
+}
+
+void MarchingCubesShaded::updateMesh()
+{
+	if( !meshChanged && meshTreshold == treshold ) return;
+
+	clampSplats();
+	cpuMesh.build( dataField, treshold );
+	meshTreshold = treshold;
+	meshChanged = false;
+	meshUploaded = false;
+}
+
+void MarchingCubesShaded::uploadMesh()
+{
+	// Voxel (x,y,z) is at texture coordinate ((z,y,x) + 0.5) / texture size, where the GPU mesher
+	// samples it. Normals scale inversely to the positions.
+	glm::vec3 textureSize( dataDepth, dataHeight, dataWidth );
+	int count = (int)cpuMesh.vertices.size();
+	meshVertexData.resize( count*2 );
+	for( int i=0; i<count; i++ )
+	{
+		const glm::vec3& vertex = cpuMesh.vertices[i];
+		const glm::vec3& normal = cpuMesh.normals[i];
+		glm::vec3 textureNormal = glm::vec3( normal.z, normal.y, normal.x ) * textureSize;
+		float length = glm::length( textureNormal );
+		meshVertexData[i*2] = ( glm::vec3( vertex.z, vertex.y, vertex.x ) + 0.5f ) / textureSize;
+		meshVertexData[i*2+1] = length > 0 ? textureNormal / length : textureNormal;
+	}
+	meshIndexCount = (GLsizei)cpuMesh.indices.size();
+
+	glBindBuffer( GL_ARRAY_BUFFER, meshVertexBuffer );
+	glBufferData( GL_ARRAY_BUFFER, meshVertexData.size()*sizeof(glm::vec3), meshVertexData.empty() ? NULL : &meshVertexData[0], GL_STREAM_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, meshIndexCount*sizeof(int), meshIndexCount ? &cpuMesh.indices[0] : NULL, GL_STREAM_DRAW );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+	meshUploaded = true;
+}
+
+// Copies the active bricks into the staging memory, after one zero brick used to clear bricks.
+void MarchingCubesShaded::stageBricks( char* staging )
+{
+	const int V = BrickField::BRICK_VOLUME;
+	const std::vector<int>& active = dataField.getActiveBricks();
+	if( halfFloatData )
+	{
+		unsigned short* target = (unsigned short*)staging;
+		memset( target, 0, V*sizeof(unsigned short) );
+		ThreadPool::getInstance().parallelFor( (int)active.size(), [&]( int n )
+		{
+			const float* source = dataField.findBrick( active[n] );
+			unsigned short* brick = target + (n+1)*V;
+			for( int i=0; i<V; i++ )
+			{
+				brick[i] = glm::packHalf1x16( source[i] );
+			}
+		});
+	}
+	else
+	{
+		float* target = (float*)staging;
+		memset( target, 0, V*sizeof(float) );
+		ThreadPool::getInstance().parallelFor( (int)active.size(), [&]( int n )
+		{
+			memcpy( target + (n+1)*V, dataField.findBrick( active[n] ), V*sizeof(float) );
+		});
+	}
+}
+
+// The field is stored with z changing fastest, so the texture is width = depth and depth = width.
+// Each brick maps to a sub box of the texture, partial bricks at the far faces are clipped.
+void MarchingCubesShaded::uploadDataField()
+{
+	static const std::vector<float> zeroBrick( BrickField::BRICK_VOLUME, 0.0f );
+	const int B = BrickField::BRICK_SIZE;
+	const int V = BrickField::BRICK_VOLUME;
+
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	glPixelStorei( GL_UNPACK_ROW_LENGTH, B );
+	glPixelStorei( GL_UNPACK_IMAGE_HEIGHT, B );
+
+	if( !textureAllocated )
+	{
+		// Allocated once, later frames only replace bricks
+		glTexImage3D( GL_TEXTURE_3D, 0, halfFloatData ? GL_ALPHA16F_ARB : GL_ALPHA32F_ARB, dataDepth, dataHeight, dataWidth, 0, GL_ALPHA, GL_FLOAT, NULL );
+		uploadedBricks.resize( dataField.getBrickCount() );
+		for( int i=0, iLen = dataField.getBrickCount(); i<iLen; i++ )
+		{
+			uploadedBricks[i] = i;
+		}
+		textureAllocated = true;
+	}
+
+	clearedBricks.clear();
+	for( size_t i=0; i<uploadedBricks.size(); i++ )
+	{
+		if( !dataField.findBrick( uploadedBricks[i] ) ) clearedBricks.push_back( uploadedBricks[i] );
+	}
+
+	const std::vector<int>& active = dataField.getActiveBricks();
+	GLenum type = halfFloatData ? GL_HALF_FLOAT : GL_FLOAT;
+	size_t valueSize = halfFloatData ? sizeof(unsigned short) : sizeof(float);
+	GLsizeiptr stagingSize = (GLsizeiptr)( (active.size()+1) * V * valueSize );
+
+	char* staging = nullptr;
+	bool mapped = false;
+	if( uploadBufferCount > 0 )
+	{
+		int index = uploadBufferIndex;
+		uploadBufferIndex = (uploadBufferIndex+1) % uploadBufferCount;
+		glBindBuffer( GL_PIXEL_UNPACK_BUFFER, uploadBuffers[index] );
+		if( stagingSize > uploadBufferSizes[index] )
+		{
+			uploadBufferSizes[index] = stagingSize + stagingSize/2;
+			glBufferData( GL_PIXEL_UNPACK_BUFFER, uploadBufferSizes[index], NULL, GL_STREAM_DRAW );
+		}
+		// Invalidating lets the driver hand out new memory while an older transfer still reads the buffer
+		staging = (char*)glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, stagingSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT );
+		mapped = staging != nullptr;
+		if( !mapped ) glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+	}
+	if( !mapped && halfFloatData )
+	{
+		halfData.resize( stagingSize / sizeof(unsigned short) );
+		staging = (char*)halfData.data();
+	}
+
+	// Offsets into the bound pixel buffer, or pointers into client memory
+	const char* base = nullptr;
+	if( staging )
+	{
+		stageBricks( staging );
+		if( mapped ) glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+		else base = staging;
+	}
+
+	int bx, by, bz;
+	for( size_t i=0; i<clearedBricks.size(); i++ )
+	{
+		dataField.getBrickCoords( clearedBricks[i], bx, by, bz );
+		glTexSubImage3D( GL_TEXTURE_3D, 0, bz*B, by*B, bx*B,
+						 glm::min( B, dataDepth - bz*B ), glm::min( B, dataHeight - by*B ), glm::min( B, dataWidth - bx*B ),
+						 GL_ALPHA, type, staging ? (const GLvoid*)base : (const GLvoid*)zeroBrick.data() );
+	}
+
+	for( size_t i=0; i<active.size(); i++ )
+	{
+		dataField.getBrickCoords( active[i], bx, by, bz );
+		glTexSubImage3D( GL_TEXTURE_3D, 0, bz*B, by*B, bx*B,
+						 glm::min( B, dataDepth - bz*B ), glm::min( B, dataHeight - by*B ), glm::min( B, dataWidth - bx*B ),
+						 GL_ALPHA, type, staging ? (const GLvoid*)( base + (i+1)*V*valueSize ) : (const GLvoid*)dataField.findBrick( active[i] ) );
+	}
+	uploadedBricks = active;
+
+	if( mapped ) glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+	glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+	glPixelStorei( GL_UNPACK_IMAGE_HEIGHT, 0 );
 }
 
 void MarchingCubesShaded::setUnchecked( int x, int y, int z, float value )
 {
-	float &data = dataField[ x*dataHeight*dataDepth + y*dataDepth + z ];
+	float &data = dataField.at( x, y, z );
 	data = contain(value+data, 0.0f, dataMax);
 	dataChanged = true;
+	meshChanged = true;
 }
 
 void MarchingCubesShaded::set( int x, int y, int z, float value )
 {
 	if( x<1 || y<1  || z<1 || x>=dataWidth-1 || y>=dataHeight-1 || z>=dataDepth-1 ) return;	
-	float &data = dataField[ x*dataHeight*dataDepth + y*dataDepth + z ];
+	float &data = dataField.at( x, y, z );
 	data = contain(value+data, 0.0f, dataMax);
 	dataChanged = true;
+	meshChanged = true;
 }
 
 void MarchingCubesShaded::set( int position, float value )
 {
-	if( position<0 || position>dataSize ) return;	
-	dataField[ position ] = contain(value, 0.0f, dataMax);
+	if( position<0 || position>=dataSize ) return;	
+	dataField.at( position / (dataHeight*dataDepth), (position / dataDepth) % dataHeight, position % dataDepth ) = contain(value, 0.0f, dataMax);
 	dataChanged = true;
+	meshChanged = true;
 }
 
 void MarchingCubesShaded::clear()
 {
-	memset( dataField, 0, dataSize*sizeof(float) );
+	dataField.clear();
+	splatsClamped = true;
 	dataChanged = true;
+	meshChanged = true;
 }
 
 glm::vec3 MarchingCubesShaded::getScale()
@@ -190,38 +571,97 @@ void MarchingCubesShaded::setTreshold( float t )
 
 void MarchingCubesShaded::putSphere( float x, float y, float z, float r )
 {
-	float value;
-	glm::vec3 start( x-r, y-r, z-r );
-	start -= vPosition;
-	start /= deltaSpan;
+	glm::vec3 center = (glm::vec3( x,y,z ) - vPosition) / deltaSpan;
+	// Border voxels are never set, same as in set()
+	splatter.splat( dataField, center, r, glm::ivec3( 1, 1, 1 ), glm::ivec3( dataWidth-2, dataHeight-2, dataDepth-2 ) );
 
-	glm::vec3 end( x+r, y+r, z+r );
-	end -= vPosition;
-	end /= deltaSpan;
+	splatsClamped = false;
+	dataChanged = true;
+	meshChanged = true;
+}
 
-	glm::vec3 center = (glm::vec3( x,y,z ) - vPosition) / deltaSpan;
-	r /= glm::length( deltaSpan );
+void MarchingCubesShaded::putSpheres( const std::vector<glm::vec3>& centers, float r )
+{
+	splatCenters.resize( centers.size() );
+	for( size_t i=0; i<centers.size(); i++ )
+	{
+		splatCenters[i] = (centers[i] - vPosition) / deltaSpan;
+	}
+	if( splatCenters.empty() ) return;
+	splatter.splatAll( dataField, &splatCenters[0], (int)splatCenters.size(), r, glm::ivec3( 1, 1, 1 ), glm::ivec3( dataWidth-2, dataHeight-2, dataDepth-2 ) );
 
-	glm::ivec3 iStart( start.x, start.y, start.z );
-	glm::ivec3 iEnd( end.x+1, end.y+1, end.z+1 );
-	for(int i= iStart.x; i<iEnd.x; i++)
+	splatsClamped = false;
+	dataChanged = true;
+	meshChanged = true;
+}
+
+void MarchingCubesShaded::putParticles( const std::vector<glm::vec3>& positions, const std::vector<float>& weights, float smoothingLength )
+{
+	if( positions.empty() ) return;
+	fieldSampler.setSmoothingLength( smoothingLength );
+	fieldSampler.sample( dataField, &positions[0], &weights[0], (int)positions.size(), vPosition, deltaSpan, fieldScale,
+						 glm::ivec3( 1, 1, 1 ), glm::ivec3( dataWidth-2, dataHeight-2, dataDepth-2 ) );
+
+	splatsClamped = false;
+	dataChanged = true;
+	meshChanged = true;
+}
+
+int MarchingCubesShaded::getMesh( std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<int>& indices )
+{
+	updateMesh();
+
+	int count = (int)cpuMesh.vertices.size();
+	vertices.resize( count );
+	normals.resize( count );
+	for( int i=0; i<count; i++ )
 	{
-		for(int j= iStart.y; j<iEnd.y; j++)
-		{
-			for(int k= iStart.z; k<iEnd.z; k++)
-			{
-				value = r-glm::length(center-glm::vec3(i,j,k))+1;
-				if (value > 0)
-				{
-					set(i, j, k, value);
-				}
-			}
-		}
+		vertices[i] = vPosition + cpuMesh.vertices[i]*deltaSpan;
+		// Gradients transform with the inverse scale
+		glm::vec3 normal = cpuMesh.normals[i] / deltaSpan;
+		float length = glm::length( normal );
+		normals[i] = length > 0 ? normal / length : normal;
 	}
+	indices = cpuMesh.indices;
+	return cpuMesh.getTriangleCount();
+}
+
+void MarchingCubesShaded::setMesher( Mesher value )
+{
+	mesher = value;
+}
+
+MarchingCubesShaded::Mesher MarchingCubesShaded::getMesher()
+{
+	return mesher;
+}
+
+void MarchingCubesShaded::setAnisotropicField( bool value )
+{
+	fieldSampler.setAnisotropic( value );
+}
+
+bool MarchingCubesShaded::getAnisotropicField()
+{
+	return fieldSampler.isAnisotropic();
 }
 
 void MarchingCubesShaded::draw(const Camera& camera)
 {
+	if( mesher == CPU_MESHER )
+	{
+		drawCpuMesh( camera );
+	}
+	else
+	{
+		drawGpuMesh( camera );
+	}
+}
+
+void MarchingCubesShaded::drawGpuMesh(const Camera& camera)
+{
+	if( !gpuMesherReady ) initGpuMesher();
+
 	glm::mat4 mvp = camera.getViewProjection() * transform.getTransformMatrix();
 	glm::vec3 eye = camera.getPosition();
 		
@@ -238,8 +678,17 @@ void MarchingCubesShaded::draw(const Camera& camera)
 		glBindTexture( GL_TEXTURE_3D, dataTexID );
 		if (dataChanged)
 		{
-			glTexImage3D(GL_TEXTURE_3D, 0, GL_ALPHA32F_ARB, dataWidth, dataHeight, dataDepth, 0, GL_ALPHA, GL_FLOAT, dataField);
+			clampSplats();
+			uploadDataField();
 			dataChanged = false;
+			activeCellsChanged = true;
+		}
+		if (activeCellsChanged || activeCellsTreshold != treshold)
+		{
+			findActiveCells();
+			glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, activeCellHandle );
+			glBufferData( GL_ELEMENT_ARRAY_BUFFER, activeCells.size()*sizeof(GLuint), activeCells.empty() ? NULL : &activeCells[0], GL_STREAM_DRAW );
+			glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
 		}
 
 		// !
@@ -248,7 +697,7 @@ void MarchingCubesShaded::draw(const Camera& camera)
 		glBlendFunc(GL_ONE, GL_ONE);
 		glDepthMask(GL_FALSE);
 			glBindVertexArray(gridVao);
-			glDrawArrays(GL_POINTS, 0, gridElementCount );
+			glDrawElements(GL_POINTS, (GLsizei)activeCells.size(), GL_UNSIGNED_INT, (GLubyte *)NULL );
 			glBindVertexArray(0);
 		glDepthMask(GL_TRUE);
 		if (!blendEnabled) { 
@@ -263,3 +712,34 @@ void MarchingCubesShaded::draw(const Camera& camera)
 	mcShader->turnOff();
 	glEnable( GL_CULL_FACE );
 }
+
+// Same blending as the GPU mesher, so both look alike
+void MarchingCubesShaded::drawCpuMesh(const Camera& camera)
+{
+	if( !cpuMesherReady ) initCpuMesher();
+
+	updateMesh();
+	if( !meshUploaded ) uploadMesh();
+
+	glm::mat4 mvp = camera.getViewProjection() * transform.getTransformMatrix();
+	glm::vec3 eye = camera.getPosition();
+
+	glDisable( GL_CULL_FACE );
+	meshShader->turnOn();
+		meshShader->setUniformV3( "Eye", eye.x, eye.y, eye.z );
+		meshShader->setUniformM4( "MVP", glm::value_ptr(mvp) );
+
+		GLboolean blendEnabled = glIsEnabled( GL_BLEND );
+		glEnable( GL_BLEND );
+		glBlendFunc(GL_ONE, GL_ONE);
+		glDepthMask(GL_FALSE);
+			glBindVertexArray(meshVao);
+			glDrawElements(GL_TRIANGLES, meshIndexCount, GL_UNSIGNED_INT, (GLubyte *)NULL);
+			glBindVertexArray(0);
+		glDepthMask(GL_TRUE);
+		if (!blendEnabled) { 
+			glDisable(GL_BLEND); 
+		}
+	meshShader->turnOff();
+	glEnable( GL_CULL_FACE );
+}
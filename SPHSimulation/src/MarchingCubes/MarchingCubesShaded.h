@@ -4,19 +4,39 @@
 
 #include "GlmVec.h"
 #include "Transform.h"
+#include "BrickField.h"
+#include "SphereSplatter.h"
+#include "SurfaceFieldSampler.h"
+#include "MarchingCubesMesh.h"
 #include <GL\glew.h>
+#include <vector>
+#include <string>
 
 class ShaderProgram;
 class Camera;
 
 // Draws a mesh dynamically from a grid of discrete weights.
-// Utilizes the power of the geometry shader.
-// Far from optimal, but usable.
+// The GPU mesher utilizes the power of the geometry shader, far from optimal, but usable.
+// The CPU mesher builds an indexed mesh (MarchingCubesMesh) and draws it as plain triangles,
+// the same mesh can be read back with getMesh. OpenGL objects are created on the first draw,
+// so the CPU mesher also works without a GL context.
 class MarchingCubesShaded{
+public:
+	enum Mesher { GPU_MESHER, CPU_MESHER };
+
+	// "gpu" or "cpu", anything else gives the fallback.
+	static Mesher parseMesher( const std::string& name, Mesher fallback = GPU_MESHER );
+
 private:
 	static const int DATA_MIN = 8;
+	static const int MAX_UPLOAD_BUFFERS = 4;
 	
-	float* dataField;
+	BrickField dataField;		// Sparse, only bricks touched since the last clear are allocated
+	SphereSplatter splatter;
+	bool splatsClamped;			// putSphere only adds, values are clamped once before the data is used
+	std::vector<glm::vec3> splatCenters;	// putSpheres centers in voxel coordinates
+	SurfaceFieldSampler fieldSampler;
+	float fieldScale;			// Data value per unit of the putParticles field, puts the field's iso value at the treshold
 	float treshold;
 	float dataMax;
 	int dataWidth;
@@ -26,26 +46,83 @@ private:
 
 	GLuint dataTexID;
 	bool dataChanged;
+	bool textureAllocated;
+	std::vector<int> uploadedBricks;	// Bricks holding data in the texture
+	std::vector<int> clearedBricks;		// Bricks uploaded before which are no longer active
+
+	// Brick uploads are staged in pixel buffers used in turn, so filling one does not wait for the
+	// transfer from the previous frame. A zero brick comes first, then the active bricks in order.
+	bool halfFloatData;			// 16 bit texture, staging converts the values
+	int uploadBufferCount;		// 0 uploads from client memory
+	GLuint uploadBuffers[MAX_UPLOAD_BUFFERS];
+	GLsizeiptr uploadBufferSizes[MAX_UPLOAD_BUFFERS];
+	int uploadBufferIndex;
+	std::vector<unsigned short> halfData;	// Staging of half floats without pixel buffers
 	
 	glm::vec3 vPosition;	// Origin of the virtual space where MarchingCubes are generated.
 	glm::vec3 vSpan;		// Dimensions of the virtual space where MarchingCubes are generated.
 	glm::vec3 deltaSpan;	// Per data virtual grid size.
 	
+	Mesher mesher;
+	std::string shaderFiles[3];		// Geometry shader mesher: vertex, geometry, fragment
+	std::string meshShaderFiles[2];	// CPU mesher: vertex, fragment
+	bool gpuMesherReady;
+	bool cpuMesherReady;
+
+	void init( const char* filePath, const Mesher* mesherOverride );
 	void initGridBuffer();
 	void initDataField();
+	void initGpuMesher();
+	void initCpuMesher();
+	void clampSplats();
+	// Uploads the active bricks and zeroes bricks which were uploaded before but are no longer active.
+	void uploadDataField();
+	// Writes the zero brick and the active bricks into the staging memory, on the thread pool.
+	void stageBricks( char* staging );
+	// Rebuilds the CPU mesh if the data or the treshold changed since the last build.
+	void updateMesh();
+	void uploadMesh();
+	void drawGpuMesh( const Camera& camera );
+	void drawCpuMesh( const Camera& camera );
 	
 	ShaderProgram* mcShader;
+	ShaderProgram* meshShader;
+
+	MarchingCubesMesh cpuMesh;
+	bool meshChanged;			// Data changed since the CPU mesh was built
+	bool meshUploaded;
+	float meshTreshold;
+	GLuint meshVao;
+	GLuint meshVertexBuffer;	// Positions and normals, interleaved
+	GLuint meshIndexBuffer;
+	GLsizei meshIndexCount;
+	std::vector<glm::vec3> meshVertexData;
 
 	GLuint gridVao;
 	GLuint gridHandle;
 	glm::vec3 gridStep;
 	GLint gridElementCount;
 
+	// Grid points whose cube can cross the treshold, only these are sent to the geometry shader.
+	GLuint activeCellHandle;
+	std::vector<GLuint> activeCells;
+	std::vector<GLuint> visitedCells;
+	std::vector<char> cellMarks;
+	std::vector<int> cellVoxels[3];		// Per axis and grid point: first and last voxel its cube samples
+	bool activeCellsChanged;
+	float activeCellsTreshold;
+
+	void initCellVoxels();
+	// Collects the grid cubes around allocated bricks whose sampled voxels lie on both sides of the treshold.
+	void findActiveCells();
+
 		
 	void setUnchecked( int x, int y, int z, float value );
 
 public:
+	// The mesher is read from the file ([base] mesher), the second constructor overrides it.
 	MarchingCubesShaded( const char* filePath );
+	MarchingCubesShaded( const char* filePath, Mesher mesher );
 	~MarchingCubesShaded( );
 
 	Transform transform;
@@ -58,6 +135,23 @@ public:
 	void draw(const Camera& frustum, GLuint tex);
 
 	void putSphere( float x, float y, float z, float r );
+	// Splats all spheres at once on the thread pool, the result equals calling putSphere for each.
+	void putSpheres( const std::vector<glm::vec3>& centers, float r );
+
+	// Adds the smoothed particle field sum_j weights[j] * poly6( x - positions[j] ) with the given
+	// smoothing length (see SurfaceFieldSampler), positions in world space. Like putSpheres this
+	// only adds, so both can be mixed.
+	void putParticles( const std::vector<glm::vec3>& positions, const std::vector<float>& weights, float smoothingLength );
+
+	// Indexed mesh of the current data in world space (same mapping as putSphere), 3 indices per
+	// triangle. Uses the CPU mesher whichever mesher draws. Returns the triangle count.
+	int getMesh( std::vector<glm::vec3>& vertices, std::vector<glm::vec3>& normals, std::vector<int>& indices );
+
+	void setMesher( Mesher value );
+	Mesher getMesher();
+
+	void setAnisotropicField( bool value );
+	bool getAnisotropicField();
 
 	glm::vec3 getScale();
 	glm::vec3 getPosition();	
@@ -0,0 +1,284 @@
+#include "SphereSplatter.h"
+#include "BrickField.h"
+#include "ThreadPool.h"
+#include <glm\geometric.hpp>
+#include <glm\common.hpp>
+#include <cmath>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) || defined(__SSE__)
+#define SPLATTER_SSE
+#include <xmmintrin.h>
+#endif
+
+SphereSplatter::SphereSplatter( glm::vec3 voxelSize )
+{
+	setVoxelSize( voxelSize );
+}
+
+void SphereSplatter::setVoxelSize( glm::vec3 size )
+{
+	voxelSize = size;
+	voxelDiagonal = glm::length( size );
+	stencils.clear();
+	lastRadiusKey = -1;
+	lastSet = nullptr;
+}
+
+const SphereSplatter::Stencil& SphereSplatter::getStencil( int radiusKey, int qx, int qy, int qz )
+{
+	if( radiusKey != lastRadiusKey )
+	{
+		lastSet = &stencils[ radiusKey ];
+		lastRadiusKey = radiusKey;
+	}
+	std::vector<Stencil>& set = *lastSet;
+	if( set.empty() )
+	{
+		set.resize( SUBVOXEL_STEPS*SUBVOXEL_STEPS*SUBVOXEL_STEPS );
+	}
+
+	Stencil& stencil = set[ (qx*SUBVOXEL_STEPS + qy)*SUBVOXEL_STEPS + qz ];
+	if( !stencil.built )
+	{
+		buildStencil( stencil, radiusKey, qx, qy, qz );
+	}
+	return stencil;
+}
+
+void SphereSplatter::buildStencil( Stencil& stencil, int radiusKey, int qx, int qy, int qz )
+{
+	float r = radiusKey / (float)RADIUS_STEPS;					// In voxel diagonals, as the falloff uses it
+	glm::vec3 box = glm::vec3( r*voxelDiagonal ) / voxelSize;	// Half size of the box in voxels
+	glm::vec3 q = glm::vec3( qx, qy, qz ) / (float)SUBVOXEL_STEPS;
+	// The box of the exact center is applied in splat(), the stencil covers it for every center
+	// that quantises to q.
+	box += 0.5f / SUBVOXEL_STEPS;
+	glm::ivec3 lo( (int)floor( q.x - box.x ), (int)floor( q.y - box.y ), (int)floor( q.z - box.z ) );
+	glm::ivec3 hi( (int)floor( q.x + box.x ), (int)floor( q.y + box.y ), (int)floor( q.z + box.z ) );
+
+	stencil.rows.clear();
+	stencil.values.clear();
+	float value;
+	for( int i=lo.x; i<=hi.x; i++ )
+	{
+		for( int j=lo.y; j<=hi.y; j++ )
+		{
+			Row row = { i, j, 0, 0, (int)stencil.values.size() };
+			for( int k=lo.z; k<=hi.z; k++ )
+			{
+				value = r - glm::length( q - glm::vec3( i, j, k ) ) + 1;
+				if( value <= 0 ) continue;
+				if( row.length == 0 )
+				{
+					row.z = k;
+				}
+				// The positive part of a row is contiguous, so gaps never need to be filled
+				stencil.values.push_back( value );
+				row.length++;
+			}
+			if( row.length > 0 )
+			{
+				stencil.rows.push_back( row );
+			}
+		}
+	}
+	stencil.built = true;
+}
+
+int SphereSplatter::getRadiusKey( float r ) const
+{
+	return (int)( r / voxelDiagonal * RADIUS_STEPS + 0.5f );
+}
+
+void SphereSplatter::quantiseCenter( glm::vec3 center, glm::ivec3& base, glm::ivec3& q ) const
+{
+	glm::vec3 cell = glm::floor( center );
+	base = glm::ivec3( (int)cell.x, (int)cell.y, (int)cell.z );
+	glm::vec3 sub = ( center - cell ) * (float)SUBVOXEL_STEPS;
+	q = glm::ivec3( (int)( sub.x + 0.5f ), (int)( sub.y + 0.5f ), (int)( sub.z + 0.5f ) );
+	for( int a=0; a<3; a++ )
+	{
+		if( q[a] == SUBVOXEL_STEPS )
+		{
+			q[a] = 0;
+			base[a]++;
+		}
+	}
+}
+
+// Limits to the box of the exact center, like the per voxel loop did
+bool SphereSplatter::getBox( glm::vec3 center, float r, glm::ivec3& lo, glm::ivec3& hi ) const
+{
+	glm::vec3 box = glm::vec3( r ) / voxelSize;
+	glm::vec3 start = center - box;
+	glm::vec3 end = center + box;
+	lo = glm::max( lo, glm::ivec3( (int)start.x, (int)start.y, (int)start.z ) );
+	hi = glm::min( hi, glm::ivec3( (int)floor( end.x ), (int)floor( end.y ), (int)floor( end.z ) ) );
+	return lo.x <= hi.x && lo.y <= hi.y && lo.z <= hi.z;
+}
+
+void SphereSplatter::splat( BrickField& field, glm::vec3 center, float r, glm::ivec3 lo, glm::ivec3 hi )
+{
+	if( !getBox( center, r, lo, hi ) ) return;
+
+	glm::ivec3 base, q;
+	quantiseCenter( center, base, q );
+	addStencil( field, getStencil( getRadiusKey( r ), q.x, q.y, q.z ), base, lo, hi );
+}
+
+void SphereSplatter::addStencil( BrickField& field, const Stencil& stencil, glm::ivec3 base, glm::ivec3 lo, glm::ivec3 hi ) const
+{
+	int x, y, z, zEnd, count, lz;
+	const float* values;
+	for( size_t n=0, nLen = stencil.rows.size(); n<nLen; n++ )
+	{
+		const Row& row = stencil.rows[n];
+		x = base.x + row.x;
+		y = base.y + row.y;
+		if( x<lo.x || x>hi.x || y<lo.y || y>hi.y ) continue;
+
+		z = base.z + row.z;
+		zEnd = z + row.length;
+		values = &stencil.values[ row.offset ];
+		if( z < lo.z )
+		{
+			values += lo.z - z;
+			z = lo.z;
+		}
+		if( zEnd > hi.z+1 ) zEnd = hi.z+1;
+
+		// Split the row where it crosses into the next brick
+		while( z < zEnd )
+		{
+			lz = z & BrickField::BRICK_MASK;
+			count = BrickField::BRICK_SIZE - lz;
+			count = count < zEnd - z ? count : zEnd - z;
+			float* brick = field.getBrick( field.brickIndex( x >> BrickField::BRICK_BITS, y >> BrickField::BRICK_BITS, z >> BrickField::BRICK_BITS ) );
+			addRow( brick + BrickField::localIndex( x & BrickField::BRICK_MASK, y & BrickField::BRICK_MASK, lz ), values, count );
+			values += count;
+			z += count;
+		}
+	}
+}
+
+void SphereSplatter::splatAll( BrickField& field, const glm::vec3* centers, int count, float r, glm::ivec3 lo, glm::ivec3 hi )
+{
+	const int BITS = BrickField::BRICK_BITS;
+	int radiusKey = getRadiusKey( r );
+	int tilesX = ( field.getWidth() + TILE_SIZE - 1 ) >> TILE_BITS;
+	int tilesY = ( field.getHeight() + TILE_SIZE - 1 ) >> TILE_BITS;
+	int tileCount = tilesX * tilesY;
+	glm::ivec3 sLo, sHi, base, q;
+
+	// Serial pass: build every stencil that will be used, allocate the touched bricks and
+	// count the spheres per tile. After this the parallel pass only reads shared state.
+	tileStarts.assign( tileCount+1, 0 );
+	sphereTiles.resize( count );
+	for( int i=0; i<count; i++ )
+	{
+		sLo = lo;
+		sHi = hi;
+		glm::ivec4& tiles = sphereTiles[i];
+		if( !getBox( centers[i], r, sLo, sHi ) )
+		{
+			tiles = glm::ivec4( 0, -1, 0, -1 );
+			continue;
+		}
+		quantiseCenter( centers[i], base, q );
+		getStencil( radiusKey, q.x, q.y, q.z );
+
+		for( int bx = sLo.x >> BITS; bx <= sHi.x >> BITS; bx++ )
+		{
+			for( int by = sLo.y >> BITS; by <= sHi.y >> BITS; by++ )
+			{
+				for( int bz = sLo.z >> BITS; bz <= sHi.z >> BITS; bz++ )
+				{
+					field.getBrick( field.brickIndex( bx, by, bz ) );
+				}
+			}
+		}
+
+		tiles = glm::ivec4( sLo.x >> TILE_BITS, sHi.x >> TILE_BITS, sLo.y >> TILE_BITS, sHi.y >> TILE_BITS );
+		for( int tx = tiles.x; tx <= tiles.y; tx++ )
+		{
+			for( int ty = tiles.z; ty <= tiles.w; ty++ )
+			{
+				tileStarts[ tx*tilesY + ty + 1 ]++;
+			}
+		}
+	}
+
+	for( int t=0; t<tileCount; t++ )
+	{
+		tileStarts[t+1] += tileStarts[t];
+	}
+	tileSpheres.resize( tileStarts[tileCount] );
+	tileFill.assign( tileStarts.begin(), tileStarts.end()-1 );
+	for( int i=0; i<count; i++ )
+	{
+		const glm::ivec4& tiles = sphereTiles[i];
+		for( int tx = tiles.x; tx <= tiles.y; tx++ )
+		{
+			for( int ty = tiles.z; ty <= tiles.w; ty++ )
+			{
+				tileSpheres[ tileFill[ tx*tilesY + ty ]++ ] = i;
+			}
+		}
+	}
+
+	const std::vector<Stencil>& set = stencils[ radiusKey ];
+	ThreadPool::getInstance().parallelFor( tileCount, [&]( int tile )
+	{
+		int tx = tile / tilesY;
+		int ty = tile % tilesY;
+		glm::ivec3 tLo( glm::max( lo.x, tx << TILE_BITS ), glm::max( lo.y, ty << TILE_BITS ), lo.z );
+		glm::ivec3 tHi( glm::min( hi.x, ((tx+1) << TILE_BITS) - 1 ), glm::min( hi.y, ((ty+1) << TILE_BITS) - 1 ), hi.z );
+		glm::ivec3 tileLo, tileHi, base, q;
+		for( int n = tileStarts[tile]; n < tileStarts[tile+1]; n++ )
+		{
+			const glm::vec3& center = centers[ tileSpheres[n] ];
+			tileLo = tLo;
+			tileHi = tHi;
+			if( !getBox( center, r, tileLo, tileHi ) ) continue;
+			quantiseCenter( center, base, q );
+			addStencil( field, set[ (q.x*SUBVOXEL_STEPS + q.y)*SUBVOXEL_STEPS + q.z ], base, tileLo, tileHi );
+		}
+	});
+}
+
+void SphereSplatter::addRow( float* destination, const float* source, int count )
+{
+	int i = 0;
+#ifdef SPLATTER_SSE
+	for( ; i+4<=count; i+=4 )
+	{
+		_mm_storeu_ps( destination+i, _mm_add_ps( _mm_loadu_ps( destination+i ), _mm_loadu_ps( source+i ) ) );
+	}
+#endif
+	for( ; i<count; i++ )
+	{
+		destination[i] += source[i];
+	}
+}
+
+void SphereSplatter::clampField( BrickField& field, float maxValue )
+{
+	const std::vector<int>& active = field.getActiveBricks();
+	for( size_t n=0; n<active.size(); n++ )
+	{
+		float* data = field.findBrick( active[n] );
+		int i = 0;
+#ifdef SPLATTER_SSE
+		__m128 low = _mm_setzero_ps();
+		__m128 high = _mm_set1_ps( maxValue );
+		for( ; i+4<=BrickField::BRICK_VOLUME; i+=4 )
+		{
+			_mm_storeu_ps( data+i, _mm_min_ps( _mm_max_ps( _mm_loadu_ps( data+i ), low ), high ) );
+		}
+#endif
+		for( ; i<BrickField::BRICK_VOLUME; i++ )
+		{
+			data[i] = data[i] < 0 ? 0 : data[i] > maxValue ? maxValue : data[i];
+		}
+	}
+}
@@ -0,0 +1,100 @@
+#pragma once
+#ifndef SPHERE_SPLATTER_H
+#define SPHERE_SPLATTER_H
+
+#include "GlmVec.h"
+#include <glm\vec4.hpp>
+#include <vector>
+#include <map>
+
+class BrickField;
+
+/*
+	Adds spheres into a BrickField using precomputed stencils, used by the putSphere methods
+	of the marching cubes grids.
+
+	The falloff of a sphere around a voxel is r' - |center - voxel| + 1 (r' being the radius in
+	voxel diagonals), limited to a box of r / voxel size around the center. It only depends on
+	the radius and on the position of the center inside its voxel, so for each radius the
+	falloffs are tabulated for SUBVOXEL_STEPS^3 sub voxel offsets. A stencil is built the first
+	time it is needed and stored as rows along z, which are added to the bricks with SIMD adds.
+
+	Values are only added, clampField has to be called once after all spheres are in. Because
+	all added values are positive, this gives the same result as clamping after every add.
+
+	splatAll splats many spheres on the ThreadPool. The spheres are binned into columns of
+	TILE_SIZE^2 voxels (halos included, a sphere goes into every tile it overlaps) and every
+	tile is written by one thread only, clipped to its column. Touched bricks are allocated
+	before the parallel part. Within a tile spheres are added
+	in their original order, so every voxel sums the same values in the same order as a serial
+	splat would and the result does not depend on the thread count.
+*/
+class SphereSplatter
+{
+public:
+	static const int SUBVOXEL_STEPS = 8;	// Sub voxel positions per axis
+	static const int RADIUS_STEPS = 64;		// Radius quantisation, steps per voxel
+	static const int TILE_BITS = 4;
+	static const int TILE_SIZE = 1 << TILE_BITS;	// Tile width for splatAll, in voxels
+
+private:
+	// Consecutive non zero values along z, offsets are relative to the voxel holding the center.
+	struct Row
+	{
+		int x, y, z;
+		int length;
+		int offset;
+	};
+
+	struct Stencil
+	{
+		Stencil() : built(false) {}
+
+		bool built;
+		std::vector<Row> rows;
+		std::vector<float> values;
+	};
+
+	glm::vec3 voxelSize;
+	float voxelDiagonal;
+	std::map< int, std::vector<Stencil> > stencils;	// Per quantised radius
+	int lastRadiusKey;								// Spheres usually share the radius, skips the map lookup
+	std::vector<Stencil>* lastSet;
+
+	std::vector<int> tileStarts;		// Binning for splatAll, kept between calls
+	std::vector<int> tileFill;
+	std::vector<int> tileSpheres;
+	std::vector<glm::ivec4> sphereTiles;	// Tile range of each sphere: x from, x to, y from, y to
+
+	const Stencil& getStencil( int radiusKey, int qx, int qy, int qz );
+	void buildStencil( Stencil& stencil, int radiusKey, int qx, int qy, int qz );
+
+	int getRadiusKey( float r ) const;
+	// Voxel with the center and the sub voxel offset of the center, quantised.
+	void quantiseCenter( glm::vec3 center, glm::ivec3& base, glm::ivec3& q ) const;
+	// Voxel box touched by the sphere, from the voxel of center - r to the voxel of center + r
+	// (both inclusive), limited to lo - hi. Returns false if it is empty.
+	bool getBox( glm::vec3 center, float r, glm::ivec3& lo, glm::ivec3& hi ) const;
+	// Adds the stencil rows. Bricks are allocated when missing, which is not thread safe.
+	void addStencil( BrickField& field, const Stencil& stencil, glm::ivec3 base, glm::ivec3 lo, glm::ivec3 hi ) const;
+
+public:
+	SphereSplatter( glm::vec3 voxelSize = glm::vec3(1,1,1) );
+
+	void setVoxelSize( glm::vec3 size );
+
+	// Adds a sphere with the center in voxel coordinates and the radius in world units. Only
+	// voxels between lo and hi (inclusive) are written.
+	void splat( BrickField& field, glm::vec3 center, float r, glm::ivec3 lo, glm::ivec3 hi );
+
+	// Splats count spheres of the same radius in parallel, centers are in voxel coordinates.
+	void splatAll( BrickField& field, const glm::vec3* centers, int count, float r, glm::ivec3 lo, glm::ivec3 hi );
+
+	// Clamps all allocated values into 0 - maxValue.
+	static void clampField( BrickField& field, float maxValue );
+
+	// Adds count values of source to destination.
+	static void addRow( float* destination, const float* source, int count );
+};
+
+#endif
@@ -0,0 +1,325 @@
+#include "SurfaceFieldSampler.h"
+#include "BrickField.h"
+#include "ThreadPool.h"
+#include <glm\geometric.hpp>
+#include <glm\common.hpp>
+#include <cmath>
+
+const float SurfaceFieldSampler::MAX_STRETCH = 4.0f;
+
+namespace
+{
+	const float PI_F = 3.14159265f;
+
+	// Eigenvalues and eigenvectors (columns of v, v[row][column]) of a symmetric matrix, Jacobi rotations.
+	void symmetricEigen( float a[3][3], float values[3], float v[3][3] )
+	{
+		for(int i=0; i<3; i++)
+		{
+			for(int j=0; j<3; j++) v[i][j] = i==j ? 1.0f : 0.0f;
+		}
+
+		for(int sweep=0; sweep<16; sweep++)
+		{
+			float off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+			float diagonal = a[0][0]*a[0][0] + a[1][1]*a[1][1] + a[2][2]*a[2][2];
+			if( off <= 1e-12f * diagonal ) break;
+
+			for(int p=0; p<2; p++)
+			{
+				for(int q=p+1; q<3; q++)
+				{
+					if( a[p][q] == 0.0f ) continue;
+					float theta = ( a[q][q] - a[p][p] ) / ( 2.0f*a[p][q] );
+					float t = ( theta >= 0.0f ? 1.0f : -1.0f ) / ( fabs(theta) + sqrt( theta*theta + 1.0f ) );
+					float c = 1.0f / sqrt( t*t + 1.0f );
+					float s = t*c;
+
+					a[p][p] -= t*a[p][q];
+					a[q][q] += t*a[p][q];
+					a[p][q] = a[q][p] = 0.0f;
+					int r = 3 - p - q;
+					float arp = a[r][p], arq = a[r][q];
+					a[r][p] = a[p][r] = c*arp - s*arq;
+					a[r][q] = a[q][r] = s*arp + c*arq;
+					for(int k=0; k<3; k++)
+					{
+						float vkp = v[k][p], vkq = v[k][q];
+						v[k][p] = c*vkp - s*vkq;
+						v[k][q] = s*vkp + c*vkq;
+					}
+				}
+			}
+		}
+		for(int i=0; i<3; i++) values[i] = a[i][i];
+	}
+}
+
+SurfaceFieldSampler::SurfaceFieldSampler() :
+	smoothingLength(1.0f), anisotropic(false), centerSmoothing(0.5f), supportRadius(1.0f)
+{
+}
+
+void SurfaceFieldSampler::setSmoothingLength( float h )
+{
+	smoothingLength = h;
+}
+
+float SurfaceFieldSampler::getSmoothingLength() const
+{
+	return smoothingLength;
+}
+
+void SurfaceFieldSampler::setAnisotropic( bool value )
+{
+	anisotropic = value;
+}
+
+bool SurfaceFieldSampler::isAnisotropic() const
+{
+	return anisotropic;
+}
+
+void SurfaceFieldSampler::setCenterSmoothing( float value )
+{
+	centerSmoothing = glm::clamp( value, 0.0f, 1.0f );
+}
+
+glm::ivec3 SurfaceFieldSampler::getCell( glm::vec3 position ) const
+{
+	glm::ivec3 cell( glm::floor( ( position - cellOrigin ) / smoothingLength ) );
+	return glm::clamp( cell, glm::ivec3( 0, 0, 0 ), cellCount - 1 );
+}
+
+void SurfaceFieldSampler::binParticles( const glm::vec3* positions, int count )
+{
+	glm::vec3 low = positions[0], high = positions[0];
+	for(int i=1; i<count; i++)
+	{
+		low = glm::min( low, positions[i] );
+		high = glm::max( high, positions[i] );
+	}
+	cellOrigin = low;
+	cellCount = glm::ivec3( glm::floor( ( high - low ) / smoothingLength ) ) + 1;
+
+	// Counting sort, particles keep their order within a cell
+	int cells = cellCount.x*cellCount.y*cellCount.z;
+	cellStarts.assign( cells+1, 0 );
+	cellParticles.resize( count );
+	glm::ivec3 c;
+	for(int i=0; i<count; i++)
+	{
+		c = getCell( positions[i] );
+		cellStarts[ (c.x*cellCount.y + c.y)*cellCount.z + c.z + 1 ]++;
+	}
+	for(int i=0; i<cells; i++)
+	{
+		cellStarts[i+1] += cellStarts[i];
+	}
+	std::vector<int> fill( cellStarts.begin(), cellStarts.end()-1 );
+	for(int i=0; i<count; i++)
+	{
+		c = getCell( positions[i] );
+		cellParticles[ fill[ (c.x*cellCount.y + c.y)*cellCount.z + c.z ]++ ] = i;
+	}
+}
+
+void SurfaceFieldSampler::buildAnisotropy( const glm::vec3* positions, int count )
+{
+	centers.resize( count );
+	transforms.resize( count );
+	stretches.assign( count, 1.0f );
+
+	const float neighbourRadius = 2.0f*smoothingLength;
+	ThreadPool::getInstance().parallelFor( count, [&]( int i )
+	{
+		float a[3][3], v[3][3], values[3];
+		const glm::vec3& position = positions[i];
+		glm::ivec3 c = getCell( position );
+		glm::ivec3 from = glm::max( c - 2, glm::ivec3( 0, 0, 0 ) );
+		glm::ivec3 to = glm::min( c + 2, cellCount - 1 );
+
+		// Weighted mean of the neighbourhood
+		float weightSum = 0.0f;
+		int neighbours = 0;
+		glm::vec3 mean( 0, 0, 0 );
+		for(int x=from.x; x<=to.x; x++)
+		{
+			for(int y=from.y; y<=to.y; y++)
+			{
+				for(int z=from.z; z<=to.z; z++)
+				{
+					int cell = (x*cellCount.y + y)*cellCount.z + z;
+					for(int n=cellStarts[cell]; n<cellStarts[cell+1]; n++)
+					{
+						int j = cellParticles[n];
+						float r = glm::length( positions[j] - position ) / neighbourRadius;
+						if( r >= 1.0f ) continue;
+						float w = 1.0f - r*r*r;
+						weightSum += w;
+						mean += w*positions[j];
+						if( j != i ) neighbours++;
+					}
+				}
+			}
+		}
+		mean /= weightSum;
+		centers[i] = glm::mix( position, mean, centerSmoothing );
+		transforms[i] = glm::mat3( 1.0f );
+		if( neighbours < MIN_NEIGHBOURS ) return;
+
+		// Weighted covariance around the mean
+		for(int r=0; r<3; r++)
+		{
+			for(int s=0; s<3; s++) a[r][s] = 0.0f;
+		}
+		for(int x=from.x; x<=to.x; x++)
+		{
+			for(int y=from.y; y<=to.y; y++)
+			{
+				for(int z=from.z; z<=to.z; z++)
+				{
+					int cell = (x*cellCount.y + y)*cellCount.z + z;
+					for(int n=cellStarts[cell]; n<cellStarts[cell+1]; n++)
+					{
+						int j = cellParticles[n];
+						float r = glm::length( positions[j] - position ) / neighbourRadius;
+						if( r >= 1.0f ) continue;
+						float w = 1.0f - r*r*r;
+						glm::vec3 d = positions[j] - mean;
+						for(int p=0; p<3; p++)
+						{
+							for(int q=0; q<3; q++) a[p][q] += w*d[p]*d[q];
+						}
+					}
+				}
+			}
+		}
+
+		symmetricEigen( a, values, v );
+		// Axis lengths follow the standard deviations, limited to MAX_STRETCH and scaled to a volume of 1
+		float axes[3];
+		float longest = 0.0f;
+		for(int k=0; k<3; k++)
+		{
+			axes[k] = sqrt( glm::max( values[k], 0.0f ) );
+			longest = glm::max( longest, axes[k] );
+		}
+		if( longest <= 0.0f ) return;
+		for(int k=0; k<3; k++) axes[k] = glm::max( axes[k], longest / MAX_STRETCH );
+		float volume = cbrt( axes[0]*axes[1]*axes[2] );
+		for(int k=0; k<3; k++)
+		{
+			axes[k] /= volume;
+			stretches[i] = glm::max( stretches[i], axes[k] );
+		}
+
+		// R diag(1/axes) R^T, glm matrices are indexed [column][row]
+		glm::mat3& g = transforms[i];
+		for(int col=0; col<3; col++)
+		{
+			for(int row=0; row<3; row++)
+			{
+				g[col][row] = v[row][0]*v[col][0]/axes[0] + v[row][1]*v[col][1]/axes[1] + v[row][2]*v[col][2]/axes[2];
+			}
+		}
+	});
+
+	supportRadius = smoothingLength;
+	for(int i=0; i<count; i++) supportRadius = glm::max( supportRadius, smoothingLength*stretches[i] );
+}
+
+void SurfaceFieldSampler::sample( BrickField& field, const glm::vec3* positions, const float* weights, int count,
+								  glm::vec3 origin, glm::vec3 voxelSize, float scale, glm::ivec3 lo, glm::ivec3 hi )
+{
+	if( count <= 0 ) return;
+
+	const int BITS = BrickField::BRICK_BITS;
+	const int B = BrickField::BRICK_SIZE;
+	binParticles( positions, count );
+	if( anisotropic )
+	{
+		buildAnisotropy( positions, count );
+		binParticles( &centers[0], count );
+	}
+	else
+	{
+		centers.assign( positions, positions + count );
+		supportRadius = smoothingLength;
+	}
+
+	// Serial pass: allocate the bricks within the support of any kernel
+	bricks.clear();
+	brickMarks.assign( field.getBrickCount(), 0 );
+	glm::vec3 extent( supportRadius, supportRadius, supportRadius );
+	for(int i=0; i<count; i++)
+	{
+		glm::ivec3 from = glm::max( glm::ivec3( glm::floor( ( centers[i] - extent - origin ) / voxelSize ) ), lo );
+		glm::ivec3 to = glm::min( glm::ivec3( glm::ceil( ( centers[i] + extent - origin ) / voxelSize ) ), hi );
+		if( from.x > to.x || from.y > to.y || from.z > to.z ) continue;
+		for(int bx = from.x >> BITS; bx <= to.x >> BITS; bx++)
+		{
+			for(int by = from.y >> BITS; by <= to.y >> BITS; by++)
+			{
+				for(int bz = from.z >> BITS; bz <= to.z >> BITS; bz++)
+				{
+					int brick = field.brickIndex( bx, by, bz );
+					if( brickMarks[brick] ) continue;
+					brickMarks[brick] = 1;
+					bricks.push_back( brick );
+					field.getBrick( brick );
+				}
+			}
+		}
+	}
+
+	const float hSquared = smoothingLength*smoothingLength;
+	const float factor = scale * 315.0f / ( 64.0f*PI_F*pow( smoothingLength, 9.0f ) );
+	const int range = (int)ceil( supportRadius / smoothingLength );
+	const bool stretched = anisotropic;
+	ThreadPool::getInstance().parallelFor( (int)bricks.size(), [&]( int n )
+	{
+		int bx, by, bz;
+		field.getBrickCoords( bricks[n], bx, by, bz );
+		float* data = field.findBrick( bricks[n] );
+		glm::ivec3 from = glm::max( glm::ivec3( bx*B, by*B, bz*B ), lo );
+		glm::ivec3 to = glm::min( glm::ivec3( bx*B+B-1, by*B+B-1, bz*B+B-1 ), hi );
+
+		for(int x=from.x; x<=to.x; x++)
+		{
+			for(int y=from.y; y<=to.y; y++)
+			{
+				for(int z=from.z; z<=to.z; z++)
+				{
+					glm::vec3 voxel = origin + glm::vec3( (float)x, (float)y, (float)z )*voxelSize;
+					glm::ivec3 c( glm::floor( ( voxel - cellOrigin ) / smoothingLength ) );
+					glm::ivec3 cFrom = glm::max( c - range, glm::ivec3( 0, 0, 0 ) );
+					glm::ivec3 cTo = glm::min( c + range, cellCount - 1 );
+
+					float sum = 0.0f;
+					for(int cx=cFrom.x; cx<=cTo.x; cx++)
+					{
+						for(int cy=cFrom.y; cy<=cTo.y; cy++)
+						{
+							for(int cz=cFrom.z; cz<=cTo.z; cz++)
+							{
+								int cell = (cx*cellCount.y + cy)*cellCount.z + cz;
+								for(int k=cellStarts[cell]; k<cellStarts[cell+1]; k++)
+								{
+									int j = cellParticles[k];
+									glm::vec3 d = voxel - centers[j];
+									if( stretched ) d = transforms[j] * d;
+									float rSq = glm::dot( d, d );
+									if( rSq >= hSquared ) continue;
+									float q = hSquared - rSq;
+									sum += weights[j] * q*q*q;
+								}
+							}
+						}
+					}
+					data[ BrickField::localIndex( x&BrickField::BRICK_MASK, y&BrickField::BRICK_MASK, z&BrickField::BRICK_MASK ) ] += factor*sum;
+				}
+			}
+		}
+	});
+}
@@ -0,0 +1,80 @@
+#pragma once
+#ifndef SURFACE_FIELD_SAMPLER_H
+#define SURFACE_FIELD_SAMPLER_H
+
+#include "GlmVec.h"
+#include <glm\mat3x3.hpp>
+#include <vector>
+
+class BrickField;
+
+/*
+	Evaluates a smoothed particle field at the voxels of a BrickField, an alternative to
+	splatting spheres with SphereSplatter. Every voxel gathers from the particles around it:
+
+		f(x) = sum_j w_j W(x - c_j)
+
+	with the poly6 kernel W of the simulation's smoothing length and per particle weights w_j.
+	With w_j = m_j / density_j this is the SPH color field (about 1 inside the fluid), with
+	w_j = m_j / restDensity it is the normalised density. The field is smooth on the scale of
+	the smoothing length, so a coarse grid gives a surface as smooth as a fine splat grid.
+
+	Particles are binned into cells of the smoothing length, each voxel visits the cells around
+	it. Only bricks within the kernel support of a particle are allocated (serially), after that
+	every brick is evaluated by one task on the ThreadPool and only reads shared data.
+
+	The anisotropic variant follows Yu and Turk (Reconstructing surfaces of particle-based
+	fluids using anisotropic kernels): the kernel of a particle is stretched along the principal
+	axes of its neighbourhood (weighted covariance within twice the smoothing length), which
+	flattens the surface along thin sheets and planar regions. Axes are limited to a ratio of
+	MAX_STRETCH and normalised to a determinant of 1, so every kernel keeps its volume and mass.
+	Particles with fewer than MIN_NEIGHBOURS neighbours keep a spherical kernel. Kernel centers
+	are moved towards the neighbourhood mean by centerSmoothing (0 keeps the positions).
+*/
+class SurfaceFieldSampler
+{
+public:
+	static const int MIN_NEIGHBOURS = 8;
+	static const float MAX_STRETCH;		// Largest ratio of the longest to the shortest kernel axis
+
+private:
+	float smoothingLength;
+	bool anisotropic;
+	float centerSmoothing;
+
+	// Kernels of the current sample call
+	std::vector<glm::vec3> centers;
+	std::vector<glm::mat3> transforms;	// Anisotropic only, maps offsets into the spherical kernel
+	std::vector<float> stretches;		// Anisotropic only, longest axis of each kernel
+	float supportRadius;				// Largest kernel extent
+
+	// Cells of smoothingLength over the particle bounds, particles sorted by cell
+	glm::vec3 cellOrigin;
+	glm::ivec3 cellCount;
+	std::vector<int> cellStarts;
+	std::vector<int> cellParticles;
+
+	std::vector<int> bricks;
+	std::vector<char> brickMarks;
+
+	void binParticles( const glm::vec3* positions, int count );
+	void buildAnisotropy( const glm::vec3* positions, int count );
+	// Cell holding the given position, clamped into the grid.
+	glm::ivec3 getCell( glm::vec3 position ) const;
+
+public:
+	SurfaceFieldSampler();
+
+	void setSmoothingLength( float h );
+	float getSmoothingLength() const;
+	void setAnisotropic( bool value );
+	bool isAnisotropic() const;
+	void setCenterSmoothing( float value );
+
+	// Adds scale * f at the voxels between lo and hi (inclusive). Particle positions are in world
+	// units, voxel (x,y,z) lies at origin + (x,y,z)*voxelSize. Values are not clamped.
+	void sample( BrickField& field, const glm::vec3* positions, const float* weights, int count,
+				 glm::vec3 origin, glm::vec3 voxelSize, float scale, glm::ivec3 lo, glm::ivec3 hi );
+};
+
+#endif
@@ -3,11 +3,26 @@
 
 #include "WindowManager.h"
 #include "LearningWindowManager.h"
+#include "SPHPreview.h"
+#include "ThreadPool.h"
+#include <string>
 
 using namespace std;
 
 int main(const int argv, const char* argc[]) {
 
+	// Workers of the parallel loops, joined when main returns
+	ThreadPool threadPool;
+	ThreadPool::setInstance( &threadPool );
+
+	// Headless preview images of a recording, no window or GL context: -preview <recording>
+	if( argv >= 3 && string( argc[1] ) == "-preview" )
+	{
+		SPHPreview preview( "data/sph3d.txt" );
+		preview.renderRecording( argc[2] );
+		return 0;
+	}
+
 	LearningWindowManager::open();
 
 	return 0;
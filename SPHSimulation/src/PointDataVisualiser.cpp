@@ -4,30 +4,28 @@
 #include "Camera.h"
 #include "Utility.h"
 #include <iostream>
+#include <cstring>
 #include <glm\gtc\type_ptr.hpp>
 #include <glm\gtc\matrix_transform.hpp>
+#include <glm\common.hpp>
+#include <glm\geometric.hpp>
 
 #define BUFFER_SIZE_INC 64
 
 PointDataVisualiser::PointDataVisualiser( const char* texturePath, bool useShader ) :
-	bufferSize(BUFFER_SIZE_INC), buffer(new glm::vec3[BUFFER_SIZE_INC]), bufferElements(0),
+	bufferSize(BUFFER_SIZE_INC), buffer(new glm::vec3[BUFFER_SIZE_INC]), bufferElements(0), pushedPoints(false),
 	textureID(0), bufferID(0), color({1.f,1.f,1.f}),
 	shader(nullptr), useShader(useShader && GLEW_ARB_geometry_shader4 == GL_TRUE),
-	pointSize(5.0f)
+	pointSize(5.0f),
+	vbo(0), ringCapacity(0), ringSegment(0), persistentRing(false), ringData(nullptr),
+	writePoints(nullptr), writeCount(0), drawFirst(0), drawCount(0),
+	culling(false), cullCellSize(1.0f), lodDistance(0.0f), lodMinPoints(0), viewSet(false), submittedPoints(0)
 {
 	setImage( texturePath );
 
-	// Setup vao and vbo connections
-	glGenBuffers(1, &vbo);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	// NULL => do not copy the buffer
-	glBufferData(GL_ARRAY_BUFFER, bufferSize * sizeof(float) * 3, NULL, GL_DYNAMIC_DRAW);
-
+	for( int i=0; i<RING_SEGMENTS; i++ ) segmentFences[i] = 0;
 	glGenVertexArrays(1, &vao);
-	glBindVertexArray(vao);
-	glEnableVertexAttribArray(0);
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLubyte *)NULL);
+	createRing( BUFFER_SIZE_INC );
 		
 	if( useShader )
 	{
@@ -42,10 +40,63 @@ PointDataVisualiser::PointDataVisualiser( const char* texturePath, bool useShade
 PointDataVisualiser::~PointDataVisualiser()
 {
 	delete [] buffer;
-	glDeleteBuffers(1, &vbo);
+	releaseRing();
 	glDeleteVertexArrays(1, &vao);
 }
 
+void PointDataVisualiser::createRing( int count )
+{
+	releaseRing();
+	ringCapacity = count;
+	GLsizeiptr size = (GLsizeiptr)ringCapacity * RING_SEGMENTS * sizeof(glm::vec3);
+
+	glGenBuffers(1, &vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	persistentRing = GLEW_ARB_buffer_storage == GL_TRUE;
+	if( persistentRing )
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+		ringData = (glm::vec3*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+		// Without the mapping the segments are mapped one by one like a mutable buffer
+		persistentRing = ringData != nullptr;
+	}
+	else
+	{
+		// NULL => do not copy the buffer
+		glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+	}
+
+	glBindVertexArray(vao);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (GLubyte *)NULL);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	ringSegment = RING_SEGMENTS-1;
+	drawFirst = 0;
+	drawCount = 0;
+}
+
+void PointDataVisualiser::releaseRing()
+{
+	for( int i=0; i<RING_SEGMENTS; i++ )
+	{
+		if( segmentFences[i] ) glDeleteSync( segmentFences[i] );
+		segmentFences[i] = 0;
+	}
+	if( !vbo ) return;
+	if( ringData )
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		ringData = nullptr;
+	}
+	glDeleteBuffers(1, &vbo);
+	vbo = 0;
+}
+
 void PointDataVisualiser::setImage( const char* texturePath )
 {
 	if( texturePath == nullptr )
@@ -64,6 +115,7 @@ void PointDataVisualiser::setColor( float r, float g, float b )
 void PointDataVisualiser::clearBuffer()
 {
 	bufferElements = 0;
+	pushedPoints = true;
 }
 
 void PointDataVisualiser::pushPoint( glm::vec3 point )
@@ -73,34 +125,240 @@ void PointDataVisualiser::pushPoint( glm::vec3 point )
 
 void PointDataVisualiser::pushPoint( float x, float y, float z )
 {
-	bool resize = bufferElements+1 > bufferSize;
-	if( resize )
+	if( bufferElements+1 > bufferSize )
 	{
-		int newSize = bufferSize + BUFFER_SIZE_INC;
+		int newSize = bufferSize*2;
 		glm::vec3 *newBuffer = new glm::vec3[ newSize ];
-		memcpy_s( newBuffer, newSize*sizeof(glm::vec3), buffer, bufferElements*sizeof(glm::vec3) );
+		memcpy( newBuffer, buffer, bufferElements*sizeof(glm::vec3) );
 		delete [] buffer;
 		buffer = newBuffer;
 		bufferSize = newSize;
+	}
+	buffer[ bufferElements ] = glm::vec3( x, y, z );
+	bufferElements++;
+	pushedPoints = true;
+}
 
+glm::vec3* PointDataVisualiser::beginPoints( int count )
+{
+	if( count > ringCapacity ) createRing( count + count/2 );
+	ringSegment = (ringSegment+1) % RING_SEGMENTS;
+	writeCount = count;
+	pushedPoints = false;
+
+	// The segment was last drawn RING_SEGMENTS writes ago, this only waits if the GPU is that far behind
+	GLsync& fence = segmentFences[ ringSegment ];
+	if( fence )
+	{
+		while( glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000 ) == GL_TIMEOUT_EXPIRED );
+		glDeleteSync( fence );
+		fence = 0;
+	}
+
+	if( persistentRing )
+	{
+		writePoints = ringData + ringSegment*ringCapacity;
+		return writePoints;
+	}
+
+	writePoints = nullptr;
+	if( count > 0 )
+	{
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
-		// NULL => do not copy the buffer
-		glBufferData(GL_ARRAY_BUFFER, bufferSize * sizeof(float) * 3, NULL, GL_DYNAMIC_DRAW);
+		writePoints = (glm::vec3*)glMapBufferRange(GL_ARRAY_BUFFER, ringSegment*ringCapacity*sizeof(glm::vec3), count*sizeof(glm::vec3),
+												   GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
-	buffer[ bufferElements ] = glm::vec3( x, y, z );
-	bufferElements++;
+	if( !writePoints )
+	{
+		// Nothing to map or mapping failed, the points go through the push buffer
+		if( count > bufferSize )
+		{
+			delete [] buffer;
+			bufferSize = count;
+			buffer = new glm::vec3[ bufferSize ];
+		}
+		bufferElements = 0;
+		writePoints = buffer;
+	}
+	return writePoints;
+}
+
+void PointDataVisualiser::endPoints()
+{
+	if( writePoints == buffer )
+	{
+		if( writeCount > 0 )
+		{
+			glBindBuffer(GL_ARRAY_BUFFER, vbo);
+			glBufferSubData(GL_ARRAY_BUFFER, ringSegment*ringCapacity*sizeof(glm::vec3), writeCount*sizeof(glm::vec3), buffer);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+	}
+	else if( !persistentRing )
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	writePoints = nullptr;
+	drawFirst = ringSegment*ringCapacity;
+	drawCount = writeCount;
+	submittedPoints = writeCount;
+}
+
+void PointDataVisualiser::setPoints( const glm::vec3* points, int count )
+{
+	// Pushed points may share memory with the fallback of beginPoints, they are not culled
+	if( culling && viewSet && count > 0 && points != buffer )
+	{
+		setCulledPoints( points, count );
+		return;
+	}
+	glm::vec3* target = beginPoints( count );
+	if( count > 0 && target != points ) memcpy( target, points, count*sizeof(glm::vec3) );
+	endPoints();
+}
+
+void PointDataVisualiser::setCulling( bool enabled, float cellSize, float lodDistance, int lodMinPoints )
+{
+	culling = enabled;
+	cullCellSize = cellSize > 0.0f ? cellSize : 1.0f;
+	this->lodDistance = lodDistance;
+	this->lodMinPoints = lodMinPoints;
+}
+
+void PointDataVisualiser::setCulling( bool enabled )
+{
+	culling = enabled;
+}
+
+bool PointDataVisualiser::isCulling()
+{
+	return culling;
+}
+
+void PointDataVisualiser::setView( const Camera& camera )
+{
+	modelMatrix = transform.getTransformMatrix();
+	eyePosition = camera.getPosition();
+
+	// Planes from the rows of the model view projection matrix (Gribb, Hartmann), glm is [column][row]
+	glm::mat4 mvp = camera.getViewProjection() * modelMatrix;
+	glm::vec4 rows[4];
+	for( int i=0; i<4; i++ )
+	{
+		rows[i] = glm::vec4( mvp[0][i], mvp[1][i], mvp[2][i], mvp[3][i] );
+	}
+	for( int i=0; i<3; i++ )
+	{
+		frustumPlanes[i*2] = rows[3] + rows[i];
+		frustumPlanes[i*2+1] = rows[3] - rows[i];
+	}
+	viewSet = true;
+}
+
+int PointDataVisualiser::getSubmittedCount()
+{
+	return submittedPoints;
+}
+
+bool PointDataVisualiser::boxInFrustum( glm::vec3 low, glm::vec3 high ) const
+{
+	for( int i=0; i<6; i++ )
+	{
+		const glm::vec4& plane = frustumPlanes[i];
+		// Corner furthest along the plane normal
+		glm::vec3 corner( plane.x > 0 ? high.x : low.x, plane.y > 0 ? high.y : low.y, plane.z > 0 ? high.z : low.z );
+		if( plane.x*corner.x + plane.y*corner.y + plane.z*corner.z + plane.w < 0 ) return false;
+	}
+	return true;
+}
+
+void PointDataVisualiser::setCulledPoints( const glm::vec3* points, int count )
+{
+	glm::vec3 low = points[0], high = points[0];
+	for( int i=1; i<count; i++ )
+	{
+		low = glm::min( low, points[i] );
+		high = glm::max( high, points[i] );
+	}
+	cellOrigin = low;
+	cellCount = glm::ivec3( glm::floor( ( high - low ) / cullCellSize ) ) + 1;
+	int cells = cellCount.x*cellCount.y*cellCount.z;
+
+	// Counting sort keeps the point order within a cell, so the LOD stride picks the same points every frame
+	cellStarts.assign( cells+1, 0 );
+	cellPoints.resize( count );
+	glm::ivec3 c;
+	for( int i=0; i<count; i++ )
+	{
+		c = glm::min( glm::ivec3( ( points[i] - cellOrigin ) / cullCellSize ), cellCount - 1 );
+		cellStarts[ (c.x*cellCount.y + c.y)*cellCount.z + c.z + 1 ]++;
+	}
+	for( int i=0; i<cells; i++ )
+	{
+		cellStarts[i+1] += cellStarts[i];
+	}
+	cellStrides.assign( cellStarts.begin(), cellStarts.end()-1 );	// Fill positions until the strides are known
+	for( int i=0; i<count; i++ )
+	{
+		c = glm::min( glm::ivec3( ( points[i] - cellOrigin ) / cullCellSize ), cellCount - 1 );
+		cellPoints[ cellStrides[ (c.x*cellCount.y + c.y)*cellCount.z + c.z ]++ ] = i;
+	}
+
+	int total = 0;
+	int cell = 0;
+	for( int x=0; x<cellCount.x; x++ )
+	{
+		for( int y=0; y<cellCount.y; y++ )
+		{
+			for( int z=0; z<cellCount.z; z++, cell++ )
+			{
+				int inCell = cellStarts[cell+1] - cellStarts[cell];
+				cellStrides[cell] = 0;
+				if( inCell == 0 ) continue;
+				glm::vec3 cellLow = cellOrigin + glm::vec3( (float)x, (float)y, (float)z )*cullCellSize;
+				glm::vec3 cellHigh = cellLow + cullCellSize;
+				if( !boxInFrustum( cellLow, cellHigh ) ) continue;
+
+				int stride = 1;
+				if( lodDistance > 0.0f && inCell > lodMinPoints )
+				{
+					glm::vec3 center = glm::vec3( modelMatrix * glm::vec4( (cellLow + cellHigh)*0.5f, 1.0f ) );
+					stride = 1 + (int)( glm::length( center - eyePosition ) / lodDistance );
+				}
+				cellStrides[cell] = stride;
+				total += ( inCell + stride - 1 ) / stride;
+			}
+		}
+	}
+
+	glm::vec3* target = beginPoints( total );
+	int written = 0;
+	for( cell=0; cell<cells; cell++ )
+	{
+		int stride = cellStrides[cell];
+		if( stride == 0 ) continue;
+		for( int n=cellStarts[cell]; n<cellStarts[cell+1]; n+=stride )
+		{
+			target[ written++ ] = points[ cellPoints[n] ];
+		}
+	}
+	endPoints();
 }
 
 void PointDataVisualiser::drawArray()
 {	
-	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferSubData(GL_ARRAY_BUFFER, 0, bufferSize * sizeof(float) * 3, buffer );
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if( pushedPoints ) setPoints( buffer, bufferElements );
 
 	glBindVertexArray(vao);
-	glDrawArrays(GL_POINTS, 0, bufferElements );/**/
+	glDrawArrays(GL_POINTS, drawFirst, drawCount );/**/
 	glBindVertexArray(0);
+
+	GLsync& fence = segmentFences[ ringSegment ];
+	if( fence ) glDeleteSync( fence );
+	fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
 }
 
 void PointDataVisualiser::drawShaded(const Camera& camera)
@@ -5,15 +5,35 @@
 #include "GlmVec.h"
 #include "Transform.h"
 #include <GL\glew.h>
+#include <glm\mat4x4.hpp>
+#include <vector>
 
 class ShaderProgram;
 class Camera;
 
+/*
+	Draws a point cloud as sprites. Points are either pushed one by one (copied into the vertex
+	buffer on the next draw) or written directly into the vertex buffer between beginPoints and
+	endPoints, setPoints copies a whole array.
+
+	The vertex buffer is a ring of RING_SEGMENTS segments, every write goes to the next segment
+	and each segment is fenced after it was drawn, so writing never waits for the draw of the
+	previous frame. With ARB_buffer_storage the ring stays mapped, otherwise each write maps its
+	segment unsynchronized. Only the points that were written are drawn.
+
+	setPoints can cull whole cells of points against the camera frustum and thin out distant
+	dense cells. Thinning takes a fixed stride within the cell, so the same points are kept
+	from frame to frame.
+*/
 class PointDataVisualiser
 {
+	static const int RING_SEGMENTS = 3;
+
+	// pushPoint storage, moved into the vertex buffer when drawn
 	glm::vec3* buffer;
 	int bufferElements;
 	int bufferSize;
+	bool pushedPoints;
 
 	ShaderProgram* shader;
 	GLuint bufferID;
@@ -21,6 +41,38 @@ class PointDataVisualiser
 
 	GLuint vbo;
 	GLuint vao;
+	int ringCapacity;			// Points per segment
+	int ringSegment;			// Segment of the last write
+	bool persistentRing;
+	glm::vec3* ringData;		// Whole ring when mapped persistently
+	glm::vec3* writePoints;		// Between beginPoints and endPoints
+	int writeCount;
+	GLsync segmentFences[RING_SEGMENTS];
+	int drawFirst;
+	int drawCount;
+
+	// setPoints culling, see setCulling
+	bool culling;
+	float cullCellSize;
+	float lodDistance;
+	int lodMinPoints;
+	bool viewSet;
+	glm::vec4 frustumPlanes[6];	// In model space, inside where dot( plane, (p,1) ) >= 0
+	glm::mat4 modelMatrix;
+	glm::vec3 eyePosition;
+	glm::vec3 cellOrigin;
+	glm::ivec3 cellCount;
+	std::vector<int> cellStarts;
+	std::vector<int> cellPoints;	// Point indices sorted by cell, in order within a cell
+	std::vector<int> cellStrides;	// 0 for culled cells
+	int submittedPoints;
+
+	void setCulledPoints( const glm::vec3* points, int count );
+	bool boxInFrustum( glm::vec3 low, glm::vec3 high ) const;
+
+	// Recreates the vertex buffer for at least count points per segment.
+	void createRing( int count );
+	void releaseRing();
 
 	GLuint textureID;
 
@@ -41,6 +93,23 @@ public:
 	void pushPoint( glm::vec3 point );
 	void pushPoint( float x, float y, float z );
 
+	// Returns memory for count points in the vertex buffer, valid until endPoints. The points
+	// replace everything pushed or written before.
+	glm::vec3* beginPoints( int count );
+	void endPoints();
+	void setPoints( const glm::vec3* points, int count );
+
+	// With culling on, setPoints bins the points into cells of cellSize (model space) and skips the
+	// cells outside the view given to setView. Visible cells with more than lodMinPoints points
+	// only submit every n-th point, n = 1 + distance to the eye / lodDistance (0 keeps all).
+	void setCulling( bool enabled, float cellSize, float lodDistance = 0.0f, int lodMinPoints = 0 );
+	void setCulling( bool enabled );
+	bool isCulling();
+	// View used by the following setPoints calls.
+	void setView( const Camera& camera );
+	// Points submitted by the last write.
+	int getSubmittedCount();
+
 	void draw( const Camera& camera );
 	void drawPoints();	
 	void drawArray();
@@ -0,0 +1,93 @@
+#pragma once
+#ifndef KERNEL_TABLE_H
+#define KERNEL_TABLE_H
+
+#include <vector>
+#include <glm\common.hpp>
+#include <cmath>
+
+/*
+	A smoothing kernel function f(r^2) sampled at size+1 evenly spaced points of q = r^2/h^2
+	over [0, 1] and read back with linear interpolation. Indexing by r^2 means the density
+	pass never needs a square root, and a lookup costs one multiply, one conversion and one
+	lerp instead of pow() calls.
+
+	build() checks the table against the sampled function between the samples (where linear
+	interpolation is worst) and keeps the largest deviation relative to the largest magnitude
+	of the function, see getMaxError(). Polynomials in r^2 (poly6 W) are nearly exact. Functions
+	of r carry a sqrt(q) term which the first interval can not follow, with 4096 samples the
+	error is about 0.8% for the spiky |gradient W| and 0.4% for the viscosity laplacian, almost
+	all of it for r < h/64. That error falls with 1/sqrt(size), build() fails if a table strays
+	further than getErrorBound( size ).
+*/
+class KernelTable
+{
+	std::vector<float> values;	// values[i] = f( i * h^2 / size )
+	float scale;				// size / h^2
+	int size;
+	float maxError;
+
+public:
+	static const int DEFAULT_SIZE = 4096;
+
+	KernelTable() :
+		scale(0), size(0), maxError(0)
+	{}
+
+	// Largest accepted relative error: 1% at DEFAULT_SIZE samples, scaled with 1/sqrt(size).
+	static float getErrorBound( int sampleCount )
+	{
+		return 0.01f * sqrtf( (float)DEFAULT_SIZE / glm::max( sampleCount, 2 ) );
+	}
+
+	// Samples function( rSq ) over [0, hSquared]. Returns false if the interpolation strays
+	// further from the function than getErrorBound allows.
+	template<class Function>
+	bool build( Function function, float hSquared, int sampleCount = DEFAULT_SIZE )
+	{
+		size = sampleCount < 2 ? 2 : sampleCount;
+		scale = size / hSquared;
+		values.resize( size + 1 );
+		for(int i=0; i<=size; i++)
+		{
+			values[i] = function( i / scale );
+		}
+
+		float peak = 0.0f;
+		float error = 0.0f;
+		for(int i=0; i<size; i++)
+		{
+			for(int k=1; k<4; k++)
+			{
+				float rSq = ( i + k*0.25f ) / scale;
+				float exact = function( rSq );
+				peak = glm::max( peak, glm::abs( exact ) );
+				error = glm::max( error, glm::abs( get( rSq ) - exact ) );
+			}
+		}
+		maxError = peak > 0.0f ? error / peak : 0.0f;
+		return maxError <= getErrorBound( size );
+	}
+
+	// rSq has to be in [0, h^2], larger values give f(h^2).
+	inline float get( float rSq ) const
+	{
+		float x = rSq * scale;
+		int i = (int)x;
+		if( i >= size ) return values[size];
+		return values[i] + ( x - i ) * ( values[i+1] - values[i] );
+	}
+
+	// Largest deviation from the function found by build(), relative to its largest magnitude.
+	float getMaxError() const
+	{
+		return maxError;
+	}
+
+	int getSize() const
+	{
+		return size;
+	}
+};
+
+#endif
@@ -0,0 +1,375 @@
+#include "SPHExporter.h"
+#include "MappedData.h"
+#include "MarchingCubesBasic.h"
+#include "Utility.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+
+// Single array of point data for the appended section of a .vtu file.
+struct VTUArray
+{
+	const char* name;
+	int components;
+	const float* data;
+};
+
+// Writes an unstructured grid with count points (positions plus the given point data arrays)
+// and cells of verticesPerCell points each. The cells use the given connectivity (point indices)
+// or consecutive points if it is NULL. Everything is stored raw in the appended section with
+// UInt32 block headers.
+static bool writeUnstructuredGrid( const char* path, const glm::vec3* points, int count,
+									const vector<VTUArray>& arrays, int verticesPerCell, unsigned char cellType,
+									const vector<int>* connectivity = nullptr )
+{
+	ofstream file( path, ios::binary | ios::trunc );
+	if( !file.is_open() ) return false;
+
+	int cellCount = ( connectivity ? (int)connectivity->size() : count ) / verticesPerCell;
+	int vertexCount = cellCount * verticesPerCell;
+
+	unsigned int offset = 0;
+	ostringstream header;
+	header << "<?xml version=\"1.0\"?>\n";
+	header << "<VTKFile type=\"UnstructuredGrid\" version=\"0.1\" byte_order=\"LittleEndian\" header_type=\"UInt32\">\n";
+	header << "  <UnstructuredGrid>\n";
+	header << "    <Piece NumberOfPoints=\"" << count << "\" NumberOfCells=\"" << cellCount << "\">\n";
+	header << "      <PointData>\n";
+	for( size_t i=0; i<arrays.size(); i++ )
+	{
+		header << "        <DataArray type=\"Float32\" Name=\"" << arrays[i].name << "\" NumberOfComponents=\"" << arrays[i].components
+			   << "\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+		offset += sizeof(unsigned int) + count*arrays[i].components*sizeof(float);
+	}
+	header << "      </PointData>\n";
+	header << "      <Points>\n";
+	header << "        <DataArray type=\"Float32\" NumberOfComponents=\"3\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+	offset += sizeof(unsigned int) + count*sizeof(glm::vec3);
+	header << "      </Points>\n";
+	header << "      <Cells>\n";
+	header << "        <DataArray type=\"Int32\" Name=\"connectivity\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+	offset += sizeof(unsigned int) + vertexCount*sizeof(int);
+	header << "        <DataArray type=\"Int32\" Name=\"offsets\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+	offset += sizeof(unsigned int) + cellCount*sizeof(int);
+	header << "        <DataArray type=\"UInt8\" Name=\"types\" format=\"appended\" offset=\"" << offset << "\"/>\n";
+	header << "      </Cells>\n";
+	header << "    </Piece>\n";
+	header << "  </UnstructuredGrid>\n";
+	header << "  <AppendedData encoding=\"raw\">\n   _";
+	file << header.str();
+
+	unsigned int blockSize;
+	for( size_t i=0; i<arrays.size(); i++ )
+	{
+		blockSize = count*arrays[i].components*sizeof(float);
+		file.write( (const char*)&blockSize, sizeof(unsigned int) );
+		file.write( (const char*)arrays[i].data, blockSize );
+	}
+
+	blockSize = count*sizeof(glm::vec3);
+	file.write( (const char*)&blockSize, sizeof(unsigned int) );
+	file.write( (const char*)points, blockSize );
+
+	vector<int> cells( vertexCount > cellCount ? vertexCount : cellCount );
+	for( int i=0; i<vertexCount; i++ ) cells[i] = connectivity ? (*connectivity)[i] : i;
+	blockSize = vertexCount*sizeof(int);
+	file.write( (const char*)&blockSize, sizeof(unsigned int) );
+	file.write( (const char*)cells.data(), blockSize );
+
+	for( int i=0; i<cellCount; i++ ) cells[i] = (i+1)*verticesPerCell;
+	blockSize = cellCount*sizeof(int);
+	file.write( (const char*)&blockSize, sizeof(unsigned int) );
+	file.write( (const char*)cells.data(), blockSize );
+
+	vector<unsigned char> types( cellCount, cellType );
+	blockSize = cellCount;
+	file.write( (const char*)&blockSize, sizeof(unsigned int) );
+	file.write( (const char*)types.data(), blockSize );
+
+	file << "\n  </AppendedData>\n</VTKFile>\n";
+	return file.good();
+}
+
+SPHExporter::SPHExporter( const char* file ) :
+	step(0), mesher(nullptr), stopWriter(false), exportedCount(0), droppedCount(0)
+{
+	MappedData settings( file );
+
+	enabled = settings.getData("export", "enabled").get<int>( 0 ) != 0;
+	format = settings.getData("export", "format").getStringData( "vtu" ) == "ply" ? PLY : VTU;
+	exportEvery = settings.getData("export", "every").get<int>( 10 );
+	exportEvery = exportEvery < 1 ? 1 : exportEvery;
+	prefix = settings.getData("export", "prefix").getStringData( "sph" );
+	queueCapacity = settings.getData("export", "queue").get<int>( 8 );
+	queueCapacity = queueCapacity < 1 ? 1 : queueCapacity;
+
+	string policyName = settings.getData("export", "policy").getStringData( "block" );
+	policy = policyName == "dropOldest" ? DROP_OLDEST : policyName == "dropNewest" ? DROP_NEWEST : BLOCK;
+
+	exportMesh = settings.getData("export", "mesh").get<int>( 0 ) != 0;
+	if( exportMesh )
+	{
+		string meshSettings = settings.getData("export", "meshSettings").getStringData( "data/mCubesShaded.txt" );
+		mesher = new MarchingCubesBasic( meshSettings.c_str() );
+	}
+
+	writer = thread( &SPHExporter::writerLoop, this );
+}
+
+SPHExporter::~SPHExporter()
+{
+	{
+		lock_guard<mutex> guard( queueLock );
+		stopWriter = true;
+	}
+	queueNotEmpty.notify_all();
+	if( writer.joinable() )
+	{
+		writer.join();
+	}
+	safeDelete( &mesher );
+}
+
+bool SPHExporter::shouldExport()
+{
+	if( !enabled ) return false;
+	return ( step++ % exportEvery ) == 0;
+}
+
+void SPHExporter::submit( SPHFrame& frame )
+{
+	frame.index = step - 1;
+
+	unique_lock<mutex> guard( queueLock );
+	if( (int)queue.size() >= queueCapacity )
+	{
+		switch( policy )
+		{
+		case BLOCK:
+			queueNotFull.wait( guard, [this]{ return (int)queue.size() < queueCapacity; } );
+			break;
+
+		case DROP_OLDEST:
+			spareFrames.push_back( std::move( queue.front() ) );
+			queue.pop_front();
+			droppedCount++;
+			break;
+
+		case DROP_NEWEST:
+			droppedCount++;
+			return;
+		}
+	}
+
+	queue.push_back( SPHFrame() );
+	swap( queue.back(), frame );
+	if( !spareFrames.empty() )
+	{
+		swap( frame, spareFrames.back() );
+		spareFrames.pop_back();
+	}
+	queueNotEmpty.notify_one();
+}
+
+// Drains the queue before stopping, so every accepted snapshot ends up on disk.
+void SPHExporter::writerLoop()
+{
+	unique_lock<mutex> guard( queueLock );
+	while( true )
+	{
+		queueNotEmpty.wait( guard, [this]{ return stopWriter || !queue.empty(); } );
+		if( queue.empty() ) break;
+
+		SPHFrame frame;
+		swap( frame, queue.front() );
+		queue.pop_front();
+		queueNotFull.notify_all();
+
+		guard.unlock();
+		writeFrame( frame );
+		guard.lock();
+
+		exportedCount++;
+		if( (int)spareFrames.size() < queueCapacity )
+		{
+			spareFrames.push_back( std::move( frame ) );
+		}
+	}
+}
+
+void SPHExporter::writeFrame( const SPHFrame& frame )
+{
+	string path = getFileName( "", frame.index );
+	bool written = format == PLY ? writeParticlesPLY( path.c_str(), frame ) : writeParticlesVTU( path.c_str(), frame );
+	if( !written )
+	{
+		cout << "Unable to export frame: " << path << endl;
+	}
+
+	if( mesher )
+	{
+		writeMesh( frame );
+	}
+}
+
+void SPHExporter::writeMesh( const SPHFrame& frame )
+{
+	mesher->clear();
+	splatPositions.clear();
+	for( int i=0, iLen = (int)frame.positions.size(); i<iLen; i++ )
+	{
+		if( i == frame.interactorIndex ) continue;
+		splatPositions.push_back( frame.positions[i] );
+	}
+	mesher->putSpheres( splatPositions, frame.splatRadius );
+	mesher->getIndexedMesh( meshVertices, meshNormals, meshIndices );
+
+	string path = getFileName( "_surface", frame.index );
+	bool written = format == PLY ? writeMeshPLY( path.c_str() ) : writeMeshVTU( path.c_str() );
+	if( !written )
+	{
+		cout << "Unable to export mesh: " << path << endl;
+	}
+}
+
+string SPHExporter::getFileName( const char* suffix, int index )
+{
+	ostringstream name;
+	name << prefix << suffix << "_" << setw(6) << setfill('0') << index << ( format == PLY ? ".ply" : ".vtu" );
+	return name.str();
+}
+
+bool SPHExporter::writeParticlesVTU( const char* path, const SPHFrame& frame )
+{
+	int count = (int)frame.positions.size();
+	vector<VTUArray> arrays;
+	if( (int)frame.velocities.size() == count && (int)frame.densities.size() == count && (int)frame.pressures.size() == count )
+	{
+		VTUArray velocity = { "velocity", 3, (const float*)frame.velocities.data() };
+		VTUArray density = { "density", 1, frame.densities.data() };
+		VTUArray pressure = { "pressure", 1, frame.pressures.data() };
+		arrays.push_back( velocity );
+		arrays.push_back( density );
+		arrays.push_back( pressure );
+	}
+
+	// VTK_VERTEX cells so the particles render without extra filters
+	return writeUnstructuredGrid( path, frame.positions.data(), count, arrays, 1, 1 );
+}
+
+bool SPHExporter::writeParticlesPLY( const char* path, const SPHFrame& frame )
+{
+	ofstream file( path, ios::binary | ios::trunc );
+	if( !file.is_open() ) return false;
+
+	int count = (int)frame.positions.size();
+	bool fields = (int)frame.velocities.size() == count && (int)frame.densities.size() == count && (int)frame.pressures.size() == count;
+
+	file << "ply\nformat binary_little_endian 1.0\n";
+	file << "comment SPH step " << frame.index << "\n";
+	file << "element vertex " << count << "\n";
+	file << "property float x\nproperty float y\nproperty float z\n";
+	if( fields )
+	{
+		file << "property float vx\nproperty float vy\nproperty float vz\n";
+		file << "property float density\nproperty float pressure\n";
+	}
+	file << "end_header\n";
+
+	int stride = fields ? 8 : 3;
+	vector<float> vertices( count*stride );
+	for( int i=0; i<count; i++ )
+	{
+		float* v = &vertices[i*stride];
+		v[0] = frame.positions[i].x;
+		v[1] = frame.positions[i].y;
+		v[2] = frame.positions[i].z;
+		if( fields )
+		{
+			v[3] = frame.velocities[i].x;
+			v[4] = frame.velocities[i].y;
+			v[5] = frame.velocities[i].z;
+			v[6] = frame.densities[i];
+			v[7] = frame.pressures[i];
+		}
+	}
+	file.write( (const char*)vertices.data(), vertices.size()*sizeof(float) );
+	return file.good();
+}
+
+bool SPHExporter::writeMeshVTU( const char* path )
+{
+	vector<VTUArray> arrays;
+	VTUArray normal = { "normal", 3, (const float*)meshNormals.data() };
+	arrays.push_back( normal );
+
+	// VTK_TRIANGLE cells over the shared vertices
+	return writeUnstructuredGrid( path, meshVertices.data(), (int)meshVertices.size(), arrays, 3, 5, &meshIndices );
+}
+
+bool SPHExporter::writeMeshPLY( const char* path )
+{
+	ofstream file( path, ios::binary | ios::trunc );
+	if( !file.is_open() ) return false;
+
+	int count = (int)meshVertices.size();
+	int faceCount = (int)meshIndices.size() / 3;
+
+	file << "ply\nformat binary_little_endian 1.0\n";
+	file << "element vertex " << count << "\n";
+	file << "property float x\nproperty float y\nproperty float z\n";
+	file << "property float nx\nproperty float ny\nproperty float nz\n";
+	file << "element face " << faceCount << "\n";
+	file << "property list uchar int vertex_indices\n";
+	file << "end_header\n";
+
+	for( int i=0; i<count; i++ )
+	{
+		file.write( (const char*)&meshVertices[i], sizeof(glm::vec3) );
+		file.write( (const char*)&meshNormals[i], sizeof(glm::vec3) );
+	}
+
+	const int faceBytes = 1 + 3*sizeof(int);
+	vector<char> faces( faceCount*faceBytes );
+	for( int i=0; i<faceCount; i++ )
+	{
+		char* face = &faces[i*faceBytes];
+		const int* indices = &meshIndices[i*3];
+		face[0] = 3;
+		memcpy( face+1, indices, 3*sizeof(int) );
+	}
+	file.write( faces.data(), faces.size() );
+	return file.good();
+}
+
+void SPHExporter::setEnabled( bool value )
+{
+	enabled = value;
+}
+
+bool SPHExporter::isEnabled()
+{
+	return enabled;
+}
+
+int SPHExporter::getExportedCount()
+{
+	lock_guard<mutex> guard( queueLock );
+	return exportedCount;
+}
+
+int SPHExporter::getDroppedCount()
+{
+	lock_guard<mutex> guard( queueLock );
+	return droppedCount;
+}
+
+int SPHExporter::getQueueLength()
+{
+	lock_guard<mutex> guard( queueLock );
+	return (int)queue.size();
+}
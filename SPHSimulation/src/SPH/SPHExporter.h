@@ -0,0 +1,90 @@
+#pragma once
+#ifndef SPHEXPORTER_H
+#define SPHEXPORTER_H
+
+#include "SPHFrame.h"
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class MarchingCubesBasic;
+
+/*
+	Writes particle snapshots (position, velocity, density, pressure) for post-processing in
+	ParaView, either as binary VTK unstructured grid (.vtu) or binary PLY. Optionally the fluid
+	surface is splatted into a MarchingCubesBasic grid and written as an indexed triangle mesh
+	with smooth normals next to the particles.
+
+	Snapshots are copied on the simulation thread and handed to a writer thread through a bounded
+	queue, so serialisation and file I/O never run inside animate(). When the queue is full the
+	configured policy either blocks the simulation (block), discards the oldest queued snapshot
+	(dropOldest) or discards the incoming one (dropNewest).
+
+	Settings are read from the [export] group:
+		enabled 0/1, format vtu/ply, every (steps), prefix (file path prefix), queue (snapshots),
+		policy block/dropOldest/dropNewest, mesh 0/1, meshSettings (marching cubes file)
+*/
+class SPHExporter
+{
+public:
+	enum Format { VTU, PLY };
+	enum QueuePolicy { BLOCK, DROP_OLDEST, DROP_NEWEST };
+
+private:
+	Format format;
+	QueuePolicy policy;
+	std::string prefix;
+	int exportEvery;
+	int queueCapacity;
+	bool enabled;
+	bool exportMesh;
+	int step;
+
+	MarchingCubesBasic* mesher;		// Used only by the writer thread
+	std::vector<glm::vec3> meshVertices;
+	std::vector<glm::vec3> meshNormals;
+	std::vector<int> meshIndices;
+	std::vector<glm::vec3> splatPositions;
+
+	std::thread writer;
+	std::mutex queueLock;
+	std::condition_variable queueNotEmpty;
+	std::condition_variable queueNotFull;
+	std::deque<SPHFrame> queue;
+	std::vector<SPHFrame> spareFrames;	// Written frames kept for their allocated buffers
+	bool stopWriter;
+	int exportedCount;
+	int droppedCount;
+
+	void writerLoop();
+	void writeFrame( const SPHFrame& frame );
+	void writeMesh( const SPHFrame& frame );
+
+	std::string getFileName( const char* suffix, int index );
+	bool writeParticlesVTU( const char* path, const SPHFrame& frame );
+	bool writeParticlesPLY( const char* path, const SPHFrame& frame );
+	bool writeMeshVTU( const char* path );
+	bool writeMeshPLY( const char* path );
+
+public:
+	SPHExporter( const char* file );
+	~SPHExporter();
+
+	// Counts simulation steps and returns true on every exportEvery-th step while enabled.
+	bool shouldExport();
+	// Queues the snapshot for writing. The frame contents are swapped out, frame receives
+	// the buffers of an already written snapshot so they can be reused.
+	void submit( SPHFrame& frame );
+
+	void setEnabled( bool value );
+	bool isEnabled();
+
+	int getExportedCount();
+	int getDroppedCount();
+	int getQueueLength();
+};
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+#ifndef SPHFRAME_H
+#define SPHFRAME_H
+
+#include "GlmVec.h"
+#include <vector>
+
+// Everything needed to draw a single simulation step without the solver.
+// Filled by SPHSystem3d::getFrame, written by SPHFrameRecorder and read back by SPHPlayback.
+// The per particle fields are only filled on request, they are used by SPHExporter.
+struct SPHFrame
+{
+	SPHFrame() :
+		index(0), interactorIndex(-1), splatRadius(0), pointSize(0)
+	{}
+
+	int index;				// Frame number within the recording
+	int interactorIndex;	// Particle index of the interactor, -1 if there is none
+	float splatRadius;		// Radius used for marching cubes spheres
+	float pointSize;		// Size used by the point cloud
+
+	std::vector<glm::vec3> positions;
+
+	std::vector<glm::vec3> velocities;
+	std::vector<float> densities;
+	std::vector<float> pressures;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "SPHFrameRecorder.h"
+#include <iostream>
+
+using namespace std;
+
+const char SPHFrameRecorder::MAGIC[4] = { 'S', 'P', 'H', 'R' };
+
+SPHFrameRecorder::SPHFrameRecorder() :
+	framesWritten(0)
+{
+}
+
+SPHFrameRecorder::~SPHFrameRecorder()
+{
+	close();
+}
+
+bool SPHFrameRecorder::open( const char* path, float frameInterval )
+{
+	close();
+
+	file.open( path, ios::binary | ios::trunc );
+	if( !file.is_open() )
+	{
+		cout << "Unable to open recording file: " << path << endl;
+		return false;
+	}
+
+	int version = VERSION;
+	file.write( MAGIC, sizeof(MAGIC) );
+	file.write( (const char*)&version, sizeof(int) );
+	file.write( (const char*)&frameInterval, sizeof(float) );
+
+	filePath = path;
+	framesWritten = 0;
+	cout << "Recording to: " << filePath << endl;
+	return true;
+}
+
+void SPHFrameRecorder::close()
+{
+	if( file.is_open() )
+	{
+		file.close();
+		cout << "Recorded " << framesWritten << " frames to: " << filePath << endl;
+	}
+}
+
+bool SPHFrameRecorder::isRecording()
+{
+	return file.is_open();
+}
+
+void SPHFrameRecorder::record( const SPHFrame& frame )
+{
+	if( !file.is_open() ) return;
+
+	int count = (int)frame.positions.size();
+	file.write( (const char*)&count, sizeof(int) );
+	file.write( (const char*)&frame.interactorIndex, sizeof(int) );
+	file.write( (const char*)&frame.splatRadius, sizeof(float) );
+	file.write( (const char*)&frame.pointSize, sizeof(float) );
+	if( count > 0 )
+	{
+		file.write( (const char*)&frame.positions[0], count*sizeof(glm::vec3) );
+	}
+	framesWritten++;
+}
+
+int SPHFrameRecorder::getFrameCount()
+{
+	return framesWritten;
+}
+
+const std::string& SPHFrameRecorder::getFilePath()
+{
+	return filePath;
+}
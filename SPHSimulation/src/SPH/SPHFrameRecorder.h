@@ -0,0 +1,42 @@
+#pragma once
+#ifndef SPHFRAME_RECORDER_H
+#define SPHFRAME_RECORDER_H
+
+#include "SPHFrame.h"
+#include <fstream>
+#include <string>
+
+/*
+	Writes simulation frames into a binary file that can be replayed with SPHPlayback.
+
+	File layout (native endianness):
+	 - header: magic "SPHR", version (int), frame interval in seconds (float)
+	 - frames: particle count (int), interactor index (int), splat radius (float),
+			   point size (float), followed by particle count positions (3 floats each)
+*/
+class SPHFrameRecorder
+{
+	std::ofstream file;
+	std::string filePath;
+	int framesWritten;
+
+public:
+	static const char MAGIC[4];
+	static const int VERSION = 1;
+	static const int FRAME_HEADER_SIZE = 2*sizeof(int) + 2*sizeof(float);
+
+	SPHFrameRecorder();
+	~SPHFrameRecorder();
+
+	// Starts a new recording, an existing file is overwritten.
+	bool open( const char* path, float frameInterval );
+	void close();
+	bool isRecording();
+
+	void record( const SPHFrame& frame );
+
+	int getFrameCount();
+	const std::string& getFilePath();
+};
+
+#endif
@@ -0,0 +1,351 @@
+#pragma once
+#ifndef SPHGRID_H
+#define SPHGRID_H
+
+#include "SPHPrecision.h"
+#include "AlignedAllocator.h"
+#include <glm\common.hpp>
+#include <vector>
+#include <algorithm>
+
+/*
+	Uniform grid over the domain [0, domain] used for the neighbour search of the SPH systems, the
+	same code serves SPHSystem2d (Dim 2) and the 3d systems (Dim 3). Cells hold particle indices,
+	cell (x, y, z) is stored at (z*height + y)*width + x.
+
+	The particles of all cells are kept in one array ordered by cell, so consecutive cells are one
+	range of it. insert() only records the particle, sort() puts the recorded particles into their
+	cells (a stable counting sort) and has to be called before the cells are read. The arrays keep
+	their capacity, refilling the grid with the same number of particles does not allocate. They
+	are AlignedMemory blocks, large grids may sit in large pages.
+
+	forEachPair visits every pair of particles in the same or in adjacent cells exactly once. Every
+	cell is matched against half of its neighbours (the stencil), those stored after it: the ones
+	whose offset is positive along the last (most significant) non zero axis, 4 cells in 2d (the
+	cell to the right and the row above) and 13 in 3d. All pairs of a particle are therefore done
+	when its cell is, cells stored before it were visited already. Pairs which are further apart
+	than a cell size are visited as well, callers check the distance.
+	forEachNeighbourCell gives all cells around one cell instead, for searches of one particle.
+	getBlock splits the grid into blocks of cells for passes which visit it block by block.
+
+	Cells are never smaller than the cell size passed to create(), so neighbours within that
+	distance are always in the same or in an adjacent cell.
+*/
+template<int Dim, class Scalar = float>
+class SPHGrid
+{
+public:
+	typedef typename SPHSpace<Dim, Scalar>::vec vec;
+	typedef typename SPHSpace<Dim, Scalar>::ivec ivec;
+
+	static const int STENCIL_SIZE = Dim == 2 ? 4 : 13;
+
+	// Particle indices of one or more consecutive cells.
+	struct Cell
+	{
+		const int* particles;
+		int count;
+
+		int size() const
+		{
+			return count;
+		}
+
+		bool empty() const
+		{
+			return count == 0;
+		}
+
+		int operator[]( int i ) const
+		{
+			return particles[i];
+		}
+	};
+
+private:
+	AlignedVector<int> cellStarts;		// Per cell and one past the end, valid after sort()
+	AlignedVector<int> cellParticles;	// Particle indices ordered by cell
+	AlignedVector<int> cellFill;
+	AlignedVector<int> insertedParticles;	// Since the last clear, in insertion order
+	AlignedVector<int> insertedCells;
+	ivec dims;
+	vec cellsPerUnit;				// dims / domain
+	int offsets[STENCIL_SIZE];		// Index offsets of the stencil cells
+	ivec steps[STENCIL_SIZE];		// Cell offsets of the stencil cells
+
+	// Advances cell to the next cell in storage order.
+	void nextCell( ivec& cell ) const
+	{
+		for(int a=0; a<Dim; a++)
+		{
+			if( ++cell[a] < dims[a] ) return;
+			cell[a] = 0;
+		}
+	}
+
+	bool contains( const ivec& cell ) const
+	{
+		for(int a=0; a<Dim; a++)
+		{
+			if( cell[a] < 0 || cell[a] >= dims[a] ) return false;
+		}
+		return true;
+	}
+
+public:
+	SPHGrid() :
+		dims(-1), cellsPerUnit(0)
+	{}
+
+	// Splits the domain into newDims cells. Cell arrays are rebuilt only if the dimensions change,
+	// the grid is empty afterwards. Returns true if the dimensions changed.
+	bool resize( vec domain, ivec newDims )
+	{
+		newDims = glm::max( newDims, ivec(1) );
+		cellsPerUnit = vec( newDims ) / domain;
+		if( newDims == dims )
+		{
+			clear();
+			return false;
+		}
+
+		dims = newDims;
+		cellStarts.assign( getCellCount() + 1, 0 );
+		cellFill.resize( getCellCount() );
+		clear();
+
+		int stencilIndex = 0;
+		int neighbourhood = Dim == 2 ? 9 : 27;
+		for(int n=0; n<neighbourhood; n++)
+		{
+			ivec step;
+			for(int a=0, digits=n; a<Dim; a++, digits/=3)
+			{
+				step[a] = digits % 3 - 1;
+			}
+
+			// Positive storage offset, z (y in 2d) is the most significant axis
+			int first = 0;
+			for(int a=Dim-1; a>=0 && first==0; a--)
+			{
+				first = step[a];
+			}
+			if( first <= 0 ) continue;
+
+			int offset = 0;
+			for(int a=Dim-1; a>=0; a--)
+			{
+				offset = offset*dims[a] + step[a];
+			}
+			steps[stencilIndex] = step;
+			offsets[stencilIndex] = offset;
+			stencilIndex++;
+		}
+		return true;
+	}
+
+	// Cells of at least cellSize (larger if the domain is not a multiple of it), at least one per
+	// dimension.
+	bool create( vec domain, Scalar cellSize )
+	{
+		return resize( domain, ivec( glm::floor( domain / cellSize ) ) );
+	}
+
+	void clear()
+	{
+		insertedParticles.clear();
+		insertedCells.clear();
+		cellParticles.clear();
+		std::fill( cellStarts.begin(), cellStarts.end(), 0 );
+	}
+
+	ivec getDims() const
+	{
+		return dims;
+	}
+
+	int getCellCount() const
+	{
+		int count = 1;
+		for(int a=0; a<Dim; a++)
+		{
+			count *= dims[a];
+		}
+		return count;
+	}
+
+	// Cell of the position, may lie outside of the grid.
+	ivec cellOf( const vec& position ) const
+	{
+		return ivec( position * cellsPerUnit );
+	}
+
+	ivec clampCell( const ivec& cell ) const
+	{
+		return glm::clamp( cell, ivec(0), dims - 1 );
+	}
+
+	int indexOf( const ivec& cell ) const
+	{
+		int index = 0;
+		for(int a=Dim-1; a>=0; a--)
+		{
+			index = index*dims[a] + cell[a];
+		}
+		return index;
+	}
+
+	// Puts the particle into the given cell, which has to be inside of the grid.
+	void insert( int particleIndex, const ivec& cell )
+	{
+		insertedParticles.push_back( particleIndex );
+		insertedCells.push_back( indexOf( cell ) );
+	}
+
+	// Puts the particle into the cell of the position, positions outside of the domain go to the
+	// closest border cell.
+	void insert( int particleIndex, const vec& position )
+	{
+		insert( particleIndex, clampCell( cellOf( position ) ) );
+	}
+
+	// Sorts the particles inserted since the last clear into their cells, in insertion order
+	// within a cell.
+	void sort()
+	{
+		int cellCount = getCellCount();
+		std::fill( cellStarts.begin(), cellStarts.end(), 0 );
+		for(size_t i=0, iLen=insertedCells.size(); i<iLen; i++)
+		{
+			cellStarts[ insertedCells[i] + 1 ]++;
+		}
+		for(int c=0; c<cellCount; c++)
+		{
+			cellStarts[c+1] += cellStarts[c];
+			cellFill[c] = cellStarts[c];
+		}
+		cellParticles.resize( insertedParticles.size() );
+		for(size_t i=0, iLen=insertedCells.size(); i<iLen; i++)
+		{
+			cellParticles[ cellFill[ insertedCells[i] ]++ ] = insertedParticles[i];
+		}
+	}
+
+	// Replaces every particle index i in the cells by newIndices[i], used when particles are reordered.
+	void remap( const std::vector<int>& newIndices )
+	{
+		for(size_t i=0, iLen=insertedParticles.size(); i<iLen; i++)
+		{
+			insertedParticles[i] = newIndices[ insertedParticles[i] ];
+		}
+		for(size_t i=0, iLen=cellParticles.size(); i<iLen; i++)
+		{
+			cellParticles[i] = newIndices[ cellParticles[i] ];
+		}
+	}
+
+	// Particles of the cells first to last (storage indices, inclusive).
+	Cell getCells( int first, int last ) const
+	{
+		Cell cell;
+		cell.particles = cellParticles.data() + cellStarts[first];
+		cell.count = cellStarts[last+1] - cellStarts[first];
+		return cell;
+	}
+
+	Cell getCell( int index ) const
+	{
+		return getCells( index, index );
+	}
+
+	// Number of blocks of blockSize^Dim cells covering the grid, blocks at the far borders may be
+	// smaller.
+	int getBlockCount( int blockSize ) const
+	{
+		int count = 1;
+		for(int a=0; a<Dim; a++)
+		{
+			count *= ( dims[a] + blockSize - 1 ) / blockSize;
+		}
+		return count;
+	}
+
+	// First and last cell (inclusive) of block n, blocks are numbered in storage order.
+	void getBlock( int blockSize, int n, ivec& low, ivec& high ) const
+	{
+		for(int a=0; a<Dim; a++)
+		{
+			int blocks = ( dims[a] + blockSize - 1 ) / blockSize;
+			low[a] = ( n % blocks ) * blockSize;
+			high[a] = glm::min( low[a] + blockSize, dims[a] ) - 1;
+			n /= blocks;
+		}
+	}
+
+	// Calls cellFunction( cell ) for the cell and each of its existing neighbours (3^Dim cells
+	// inside of the grid), in storage order. The neighbours along the first dimension are passed
+	// as one Cell.
+	template<class CellFunction>
+	void forEachNeighbourCell( const ivec& cell, CellFunction cellFunction ) const
+	{
+		ivec low = glm::max( cell - 1, ivec(0) );
+		ivec high = glm::min( cell + 1, dims - 1 );
+		ivec neighbour = low;
+		while( true )
+		{
+			int rowStart = indexOf( neighbour );
+			cellFunction( getCells( rowStart, rowStart + high[0] - low[0] ) );
+
+			int a = 1;
+			for(; a<Dim; a++)
+			{
+				if( ++neighbour[a] <= high[a] ) break;
+				neighbour[a] = low[a];
+			}
+			if( a == Dim ) return;
+		}
+	}
+
+	// Calls pairFunction( first, second ) for every particle pair of neighbouring cells and
+	// particleFunction( particle ) once all pairs of the particle are done.
+	template<class PairFunction, class ParticleFunction>
+	void forEachPair( PairFunction pairFunction, ParticleFunction particleFunction ) const
+	{
+		Cell neighbours[STENCIL_SIZE];
+		ivec cell( 0 );
+		for(int index=0, count=getCellCount(); index<count; index++, nextCell( cell ))
+		{
+			Cell thisCell = getCell( index );
+			if( thisCell.empty() ) continue;
+
+			int neighbourCount = 0;
+			for(int s=0; s<STENCIL_SIZE; s++)
+			{
+				if( contains( cell + steps[s] ) && !getCell( index + offsets[s] ).empty() )
+				{
+					neighbours[neighbourCount++] = getCell( index + offsets[s] );
+				}
+			}
+
+			for(int i=0, iLen=thisCell.size(); i<iLen; i++)
+			{
+				int particle = thisCell[i];
+				for(int j=i+1; j<iLen; j++)
+				{
+					pairFunction( particle, thisCell[j] );
+				}
+				for(int n=0; n<neighbourCount; n++)
+				{
+					const Cell& other = neighbours[n];
+					for(int k=0, kLen=other.size(); k<kLen; k++)
+					{
+						pairFunction( particle, other[k] );
+					}
+				}
+				particleFunction( particle );
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,126 @@
+#pragma once
+#ifndef SPHGRIDBLOCK_H
+#define SPHGRIDBLOCK_H
+
+#include "SPHGrid.h"
+#include "AlignedAllocator.h"
+#include <vector>
+
+/*
+	Copy of one block of SPHGrid cells and their halo (the adjacent cells) in contiguous arrays:
+	the particle indices and positions of every cell, cell after cell in storage order. The
+	neighbour search of the particles in the block then reads a few compact arrays which stay in
+	the cache for the whole block, instead of the grid arrays and the particles themselves.
+
+	forEachNeighbour visits the same particles in the same order as SPHGrid::forEachNeighbourCell.
+	The arrays keep their capacity, staging blocks of at most the same size does not allocate.
+*/
+template<int Dim, class Vec>
+class SPHGridBlock
+{
+public:
+	typedef typename SPHSpace<Dim>::ivec ivec;
+
+private:
+	ivec low;						// First staged cell
+	ivec dims;						// Staged cells per dimension
+	AlignedVector<int> cellStarts;	// Per staged cell and one past the end
+	AlignedVector<int> indices;
+	AlignedVector<Vec> positions;
+
+public:
+	SPHGridBlock() :
+		low(0), dims(0)
+	{}
+
+	// Stages the cells [blockLow, blockHigh] and their halo, position( index ) gives the position
+	// of a particle.
+	template<class Scalar, class PositionFunction>
+	void stage( const SPHGrid<Dim, Scalar>& grid, const ivec& blockLow, const ivec& blockHigh, PositionFunction position )
+	{
+		low = glm::max( blockLow - 1, ivec(0) );
+		dims = glm::min( blockHigh + 1, grid.getDims() - 1 ) - low + 1;
+
+		int count = 1;
+		for(int a=0; a<Dim; a++)
+		{
+			count *= dims[a];
+		}
+		int rowCount = count / dims[0];
+		cellStarts.resize( count + 1 );
+
+		// Rows along the first dimension are consecutive in the grid, the first pass sets the
+		// cell starts, the second one copies the rows
+		int total = 0;
+		for(int pass=0; pass<2; pass++)
+		{
+			ivec local( 0 );
+			for(int r=0; r<rowCount; r++)
+			{
+				int rowStart = grid.indexOf( low + local );
+				if( pass == 0 )
+				{
+					for(int x=0; x<dims[0]; x++)
+					{
+						cellStarts[ r*dims[0] + x ] = total;
+						total += grid.getCell( rowStart + x ).size();
+					}
+				}
+				else
+				{
+					typename SPHGrid<Dim, Scalar>::Cell row = grid.getCells( rowStart, rowStart + dims[0] - 1 );
+					for(int i=0, start=cellStarts[ r*dims[0] ]; i<row.size(); i++)
+					{
+						indices[ start + i ] = row[i];
+						positions[ start + i ] = position( row[i] );
+					}
+				}
+
+				for(int a=1; a<Dim; a++)
+				{
+					if( ++local[a] < dims[a] ) break;
+					local[a] = 0;
+				}
+			}
+			if( pass == 0 )
+			{
+				cellStarts[count] = total;
+				indices.resize( total );
+				positions.resize( total );
+			}
+		}
+	}
+
+	// Calls particleFunction( index, position ) for the particles of the cell and its neighbours,
+	// the cell has to be one of the block (not of the halo).
+	template<class ParticleFunction>
+	void forEachNeighbour( const ivec& cell, ParticleFunction particleFunction ) const
+	{
+		ivec localLow = glm::max( cell - low - 1, ivec(0) );
+		ivec localHigh = glm::min( cell - low + 1, dims - 1 );
+		ivec local = localLow;
+		while( true )
+		{
+			// Cells along the first dimension are consecutive
+			int rowStart = 0;
+			for(int a=Dim-1; a>=0; a--)
+			{
+				rowStart = rowStart*dims[a] + local[a];
+			}
+			for(int i=cellStarts[ rowStart ], iEnd=cellStarts[ rowStart + localHigh[0] - localLow[0] + 1 ]; i<iEnd; i++)
+			{
+				particleFunction( indices[i], positions[i] );
+			}
+
+			int a = 1;
+			for(; a<Dim; a++)
+			{
+				if( ++local[a] <= localHigh[a] ) break;
+				local[a] = localLow[a];
+			}
+			if( a == Dim ) return;
+		}
+	}
+};
+
+#endif
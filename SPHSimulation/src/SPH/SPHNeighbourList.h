@@ -0,0 +1,162 @@
+#pragma once
+#ifndef SPHNEIGHBOURLIST_H
+#define SPHNEIGHBOURLIST_H
+
+#include "ThreadPool.h"
+#include "AlignedAllocator.h"
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+/*
+	Neighbour lists of all particles in compressed sparse row form: the neighbours of particle i
+	are indices[ offsets[i] ] up to indices[ offsets[i+1] ], optionally with their distance at the
+	same position of distances. Every pair appears in the lists of both of its particles, so a
+	pass which only writes to particle i can walk its list without synchronisation.
+
+	A build takes two passes over the particles, which may run in parallel and in any order. The
+	first one counts the neighbours (setCount), allocate() sizes the arrays exactly and the second
+	pass writes the neighbours (getNeighbours, getDistances). Both passes have to find the same
+	neighbours for a particle. The arrays are AlignedMemory blocks and keep their capacity, a build
+	of the same size does not allocate.
+*/
+class SPHNeighbourList
+{
+	AlignedVector<int> offsets;		// particleCount + 1 entries
+	AlignedVector<int> indices;
+	AlignedVector<float> distances;	// Empty unless distances are cached
+	bool cacheDistances;
+
+public:
+	// Particles handed to one task of the ThreadPool.
+	static const int CHUNK_SIZE = 256;
+
+	SPHNeighbourList() :
+		cacheDistances(false)
+	{}
+
+	// Calls body( i ) for every particle index in [0, count) on the ThreadPool.
+	template<class Body>
+	static void parallelForParticles( int count, Body body )
+	{
+		int chunks = ( count + CHUNK_SIZE - 1 ) / CHUNK_SIZE;
+		auto chunkTask = [&]( int chunk )
+		{
+			int end = std::min( (chunk+1)*CHUNK_SIZE, count );
+			for(int i=chunk*CHUNK_SIZE; i<end; i++)
+			{
+				body( i );
+			}
+		};
+		// Wrapped in std::ref so std::function does not allocate a copy of the task
+		ThreadPool::getInstance().parallelFor( chunks, std::ref( chunkTask ) );
+	}
+
+	// Starts a build for particleCount particles.
+	void beginBuild( int particleCount )
+	{
+		offsets.resize( particleCount + 1 );
+		offsets[0] = 0;
+	}
+
+	void setCount( int i, int count )
+	{
+		offsets[i+1] = count;
+	}
+
+	// Sizes the arrays after all counts were set.
+	void allocate()
+	{
+		int particleCount = getParticleCount();
+		for(int i=0; i<particleCount; i++)
+		{
+			offsets[i+1] += offsets[i];
+		}
+		indices.resize( offsets[particleCount] );
+		distances.resize( cacheDistances ? indices.size() : 0 );
+	}
+
+	// Where the neighbours of particle i are written to.
+	int* getNeighbours( int i )
+	{
+		return indices.data() + offsets[i];
+	}
+
+	// Null unless distances are cached.
+	float* getDistances( int i )
+	{
+		return cacheDistances ? distances.data() + offsets[i] : 0;
+	}
+
+	void clear()
+	{
+		offsets.clear();
+		indices.clear();
+		distances.clear();
+	}
+
+	// Clears the lists and frees their memory.
+	void release()
+	{
+		AlignedVector<int>().swap( offsets );
+		AlignedVector<int>().swap( indices );
+		AlignedVector<float>().swap( distances );
+	}
+
+	// Takes effect with the next build.
+	void setCacheDistances( bool value )
+	{
+		cacheDistances = value;
+	}
+
+	bool cachesDistances() const
+	{
+		return cacheDistances;
+	}
+
+	bool empty() const
+	{
+		return indices.empty();
+	}
+
+	int getParticleCount() const
+	{
+		return offsets.empty() ? 0 : (int)offsets.size() - 1;
+	}
+
+	// Number of list entries, twice the number of pairs.
+	int getEntryCount() const
+	{
+		return (int)indices.size();
+	}
+
+	// Entries of particle i are [begin( i ), end( i ) ).
+	int begin( int i ) const
+	{
+		return offsets[i];
+	}
+
+	int end( int i ) const
+	{
+		return offsets[i+1];
+	}
+
+	int getNeighbour( int entry ) const
+	{
+		return indices[entry];
+	}
+
+	// Only valid if distances are cached.
+	float getDistance( int entry ) const
+	{
+		return distances[entry];
+	}
+
+	// Bytes held by the lists.
+	size_t getMemoryUsage() const
+	{
+		return offsets.capacity()*sizeof(int) + indices.capacity()*sizeof(int) + distances.capacity()*sizeof(float);
+	}
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include "SPHPlayback.h"
+#include "SPHFrameRecorder.h"
+#include "PointDataVisualiser.h"
+#include "MarchingCubesShaded.h"
+#include "Utility.h"
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+using namespace std;
+
+SPHPlayback::SPHPlayback( const char* path, int prefetch ) :
+	filePath(path), frameInterval(0.0125f), prefetchCount(prefetch < 1 ? 1 : prefetch),
+	playPosition(0), playRate(1.0f), paused(false), current(nullptr),
+	requested(0), direction(1), stopWorker(false)
+{
+	file.open( path, ios::binary );
+	if( !file.is_open() )
+	{
+		cout << "Unable to open recording: " << path << endl;
+		return;
+	}
+
+	char magic[4];
+	int version = 0;
+	file.read( magic, sizeof(magic) );
+	file.read( (char*)&version, sizeof(int) );
+	file.read( (char*)&frameInterval, sizeof(float) );
+	if( !file || memcmp( magic, SPHFrameRecorder::MAGIC, sizeof(magic) ) != 0 || version != SPHFrameRecorder::VERSION )
+	{
+		cout << "Invalid recording: " << path << endl;
+		file.close();
+		return;
+	}
+
+	indexFrames();
+	cout << "Playback of " << frameOffsets.size() << " frames from: " << path << endl;
+
+	worker = thread( &SPHPlayback::prefetchLoop, this );
+}
+
+SPHPlayback::~SPHPlayback()
+{
+	{
+		lock_guard<mutex> guard( cacheLock );
+		stopWorker = true;
+	}
+	workerWake.notify_all();
+	if( worker.joinable() )
+	{
+		worker.join();
+	}
+}
+
+// Walks the frame headers once so any frame can be sought to directly. A truncated
+// last frame (recording interrupted mid write) is ignored.
+void SPHPlayback::indexFrames()
+{
+	frameOffsets.clear();
+	streamoff offset = file.tellg();
+	file.seekg( 0, ios::end );
+	streamoff fileEnd = file.tellg();
+
+	int count;
+	while( offset + SPHFrameRecorder::FRAME_HEADER_SIZE <= fileEnd )
+	{
+		file.seekg( offset );
+		file.read( (char*)&count, sizeof(int) );
+		streamoff next = offset + SPHFrameRecorder::FRAME_HEADER_SIZE + (streamoff)count*sizeof(glm::vec3);
+		if( !file || count < 0 || next > fileEnd ) break;
+
+		frameOffsets.push_back( offset );
+		offset = next;
+	}
+	file.clear();
+}
+
+bool SPHPlayback::readFrame( int index, SPHFrame& frame )
+{
+	int count;
+	file.seekg( frameOffsets[index] );
+	file.read( (char*)&count, sizeof(int) );
+	file.read( (char*)&frame.interactorIndex, sizeof(int) );
+	file.read( (char*)&frame.splatRadius, sizeof(float) );
+	file.read( (char*)&frame.pointSize, sizeof(float) );
+	frame.positions.resize( count );
+	if( count > 0 )
+	{
+		file.read( (char*)&frame.positions[0], count*sizeof(glm::vec3) );
+	}
+	frame.index = index;
+
+	if( !file )
+	{
+		file.clear();
+		return false;
+	}
+	return true;
+}
+
+void SPHPlayback::prefetchLoop()
+{
+	int frameCount = (int)frameOffsets.size();
+	unique_lock<mutex> guard( cacheLock );
+	while( !stopWorker )
+	{
+		// Drop frames that fell out of the prefetch window
+		for( auto it = cache.begin(); it != cache.end(); )
+		{
+			int ahead = (it->first - requested) * direction;
+			if( ahead < 0 || ahead >= prefetchCount )
+			{
+				it = cache.erase( it );
+			}else
+			{
+				it++;
+			}
+		}
+
+		// Closest frame within the window that is not decoded yet
+		int target = -1;
+		for( int i=0; i<prefetchCount; i++ )
+		{
+			int index = requested + i*direction;
+			if( index < 0 || index >= frameCount ) break;
+			if( cache.find( index ) == cache.end() )
+			{
+				target = index;
+				break;
+			}
+		}
+
+		if( target == -1 )
+		{
+			workerWake.wait( guard );
+			continue;
+		}
+
+		guard.unlock();
+		SPHFrame frame;
+		bool valid = readFrame( target, frame );
+		guard.lock();
+
+		if( !valid )
+		{
+			// Keep the slot filled so the main thread does not wait forever
+			frame.positions.clear();
+		}
+		cache[target] = std::move( frame );
+		frameReady.notify_all();
+	}
+}
+
+const SPHFrame& SPHPlayback::acquire( int index )
+{
+	// The worker never decodes frames outside the file, waiting for them would not return
+	if( index < 0 || index >= getFrameCount() )
+	{
+		return emptyFrame;
+	}
+	if( current && current->index == index )
+	{
+		return *current;
+	}
+
+	unique_lock<mutex> guard( cacheLock );
+	requested = index;
+	workerWake.notify_one();
+
+	frameReady.wait( guard, [this, index]{ return cache.find( index ) != cache.end() || stopWorker; } );
+	// Entries stay in place while other frames are inserted or erased, and the requested one is
+	// always inside the prefetch window, so the reference stays valid until the next request
+	auto found = cache.find( index );
+	current = found != cache.end() ? &found->second : nullptr;
+	return current ? *current : emptyFrame;
+}
+
+bool SPHPlayback::isOpen()
+{
+	return !frameOffsets.empty();
+}
+
+int SPHPlayback::getFrameCount()
+{
+	return (int)frameOffsets.size();
+}
+
+int SPHPlayback::getFrameIndex()
+{
+	return (int)playPosition;
+}
+
+const SPHFrame& SPHPlayback::getFrame( int index )
+{
+	return acquire( index );
+}
+
+float SPHPlayback::getFrameInterval()
+{
+	return frameInterval;
+}
+
+void SPHPlayback::update( float dt )
+{
+	if( paused || !isOpen() ) return;
+
+	playPosition += dt / frameInterval * playRate;
+	double last = (double)(frameOffsets.size() - 1);
+	if( playPosition < 0 || playPosition > last )
+	{
+		playPosition = contain<double>( playPosition, 0, last );
+		paused = true;
+	}
+}
+
+void SPHPlayback::seek( int frame )
+{
+	if( !isOpen() ) return;
+	playPosition = contain<int>( frame, 0, (int)frameOffsets.size() - 1 );
+}
+
+void SPHPlayback::seekTime( float seconds )
+{
+	seek( (int)( seconds / frameInterval ) );
+}
+
+void SPHPlayback::setPlayRate( float rate )
+{
+	playRate = rate;
+	lock_guard<mutex> guard( cacheLock );
+	direction = rate < 0 ? -1 : 1;
+}
+
+float SPHPlayback::getPlayRate()
+{
+	return playRate;
+}
+
+void SPHPlayback::setPaused( bool value )
+{
+	paused = value;
+}
+
+bool SPHPlayback::isPaused()
+{
+	return paused;
+}
+
+void SPHPlayback::draw( PointDataVisualiser* pdv )
+{
+	if( !isOpen() ) return;
+	const SPHFrame& frame = acquire( getFrameIndex() );
+
+	pdv->setPointSize( frame.pointSize );
+	pdv->setPoints( frame.positions.data(), (int)frame.positions.size() );
+}
+
+void SPHPlayback::draw( MarchingCubesShaded* ms )
+{
+	if( !isOpen() ) return;
+	const SPHFrame& frame = acquire( getFrameIndex() );
+
+	splatPositions.clear();
+	for( int i=0, iLen = (int)frame.positions.size(); i<iLen; i++ )
+	{
+		if( i == frame.interactorIndex ) continue;
+		splatPositions.push_back( frame.positions[i] );
+	}
+	ms->putSpheres( splatPositions, frame.splatRadius );
+}
@@ -0,0 +1,85 @@
+#pragma once
+#ifndef SPHPLAYBACK_H
+#define SPHPLAYBACK_H
+
+#include "SPHFrame.h"
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class PointDataVisualiser;
+class MarchingCubesShaded;
+
+/*
+	Replays frames written by SPHFrameRecorder without running the solver. Offers the same
+	draw adapters as SPHSystem3d so a scene can switch between the two sources.
+
+	Frames are decoded on a background thread which keeps up to prefetchCount frames ahead
+	of the play position (behind it when playing backwards). Seeking to a frame that is not
+	prefetched blocks until the worker decodes it.
+*/
+class SPHPlayback
+{
+	std::string filePath;
+	std::ifstream file;			// Used only by the prefetch thread once running
+	std::vector<std::streamoff> frameOffsets;
+	float frameInterval;
+	int prefetchCount;
+
+	double playPosition;		// In frames
+	float playRate;
+	bool paused;
+
+	const SPHFrame* current;	// Cache entry of the requested frame, null before the first one
+	SPHFrame emptyFrame;		// Returned for indices outside the file or if the worker stopped first
+	std::vector<glm::vec3> splatPositions;	// Marching cubes drawing, interactor excluded
+
+	std::thread worker;
+	std::mutex cacheLock;
+	std::condition_variable workerWake;
+	std::condition_variable frameReady;
+	std::map<int, SPHFrame> cache;
+	int requested;
+	int direction;
+	bool stopWorker;
+
+	void indexFrames();
+	bool readFrame( int index, SPHFrame& frame );
+	void prefetchLoop();
+	// Returns the frame with the given index, waits for the worker if it is not decoded yet. The
+	// frame is not copied out of the cache, the worker never drops the requested frame.
+	const SPHFrame& acquire( int index );
+
+public:
+	SPHPlayback( const char* path, int prefetch = 32 );
+	~SPHPlayback();
+
+	bool isOpen();
+	int getFrameCount();
+	int getFrameIndex();
+	// Returns the frame with the given index for random access, e.g. offline rendering, or an
+	// empty frame if the index is outside 0 to getFrameCount()-1. The reference stays valid until
+	// the next getFrame or draw call.
+	const SPHFrame& getFrame( int index );
+	float getFrameInterval();
+
+	// Advances the play position by dt seconds scaled by the play rate, pauses at either end.
+	void update( float dt );
+	void seek( int frame );
+	void seekTime( float seconds );
+
+	void setPlayRate( float rate );
+	float getPlayRate();
+
+	void setPaused( bool value );
+	bool isPaused();
+
+	void draw( PointDataVisualiser* pdv );
+	void draw( MarchingCubesShaded* ms );
+};
+
+#endif
@@ -0,0 +1,63 @@
+#pragma once
+#ifndef SPHPRECISION_H
+#define SPHPRECISION_H
+
+#include <glm\vec2.hpp>
+#include <glm\vec3.hpp>
+
+/*
+	Numeric precision of SPHSystem3d, chosen at build time with SPH_PRECISION (add it to the
+	preprocessor definitions of the project):
+
+	SPH_PRECISION_SINGLE	Everything is float, the default.
+	SPH_PRECISION_MIXED		Positions and velocities are integrated in double (in domain
+							coordinates) and density sums are accumulated in double. Pair
+							separations are taken between the double positions and rounded
+							afterwards, kernels and forces are evaluated in float. SPHParticle3d
+							keeps float copies of position and velocity for the interactors,
+							recording and drawing.
+
+	Mixed precision stops the drift of long runs, where float positions lose the small
+	increments of a step and density sums of many small terms round off.
+*/
+#define SPH_PRECISION_SINGLE 0
+#define SPH_PRECISION_MIXED 1
+
+#ifndef SPH_PRECISION
+#define SPH_PRECISION SPH_PRECISION_SINGLE
+#endif
+
+// Vector types of a Dim dimensional simulation with Scalar components.
+template<int Dim, class Scalar = float>
+struct SPHSpace;
+
+template<class Scalar>
+struct SPHSpace<2, Scalar>
+{
+	typedef glm::detail::tvec2<Scalar, glm::highp> vec;
+	typedef glm::ivec2 ivec;
+};
+
+template<class Scalar>
+struct SPHSpace<3, Scalar>
+{
+	typedef glm::detail::tvec3<Scalar, glm::highp> vec;
+	typedef glm::ivec3 ivec;
+};
+
+#if SPH_PRECISION == SPH_PRECISION_MIXED
+typedef double sphReal;		// Integrated state and accumulated sums
+const bool SPH_PRECISE_STATE = true;
+#else
+typedef float sphReal;
+const bool SPH_PRECISE_STATE = false;
+#endif
+
+typedef SPHSpace<3, sphReal>::vec sphVec3;
+
+inline const char* getPrecisionName()
+{
+	return SPH_PRECISE_STATE ? "mixed" : "single";
+}
+
+#endif
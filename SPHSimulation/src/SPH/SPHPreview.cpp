@@ -0,0 +1,161 @@
+#include "SPHPreview.h"
+#include "SPHPlayback.h"
+#include "SpriteRasteriser.h"
+#include "MappedData.h"
+#include "Utility.h"
+#include "lodepng.h"
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+
+SPHPreview::SPHPreview( const char* file ) :
+	rasteriser(nullptr),
+	camera( { 1920.0f, 1080.0f }, Camera::ProjectionType::PERSPECTIVE, { 1.0f, 1000.0f } ),
+	transform( { 0.0f, 0.5f, 0.0f }, { 1.0f, 1.0f, -1.0f }, { 0.0f, 90.0f, 0.0f } ),
+	stopEncoders(false), busyEncoders(0), writtenCount(0)
+{
+	MappedData settings( file );
+
+	string sprite = settings.getData("preview", "sprite").getStringData( "data/images/point.png" );
+	rasteriser = new SpriteRasteriser( sprite.c_str() );
+
+	int width = settings.getData("preview", "width").get<int>( 1920 );
+	int height = settings.getData("preview", "height").get<int>( 1080 );
+	rasteriser->setResolution( width, height );
+	camera.windowDidResize( (float)rasteriser->getWidth(), (float)rasteriser->getHeight() );
+
+	vector<float> position = settings.getData("preview", "camera").getVector<float>();
+	if( position.size() >= 3 )
+	{
+		camera.applyOffset( glm::vec3( position[0], position[1], position[2] ) - camera.getPosition() );
+	}
+
+	prefix = settings.getData("preview", "prefix").getStringData( "preview" );
+	renderEvery = settings.getData("preview", "every").get<int>( 1 );
+	renderEvery = renderEvery < 1 ? 1 : renderEvery;
+	queueCapacity = settings.getData("preview", "queue").get<int>( 8 );
+	queueCapacity = queueCapacity < 1 ? 1 : queueCapacity;
+
+	int encoderCount = settings.getData("preview", "encoders").get<int>( 2 );
+	encoderCount = encoderCount < 1 ? 1 : encoderCount;
+	for(int i=0; i<encoderCount; i++)
+	{
+		encoders.push_back( thread( &SPHPreview::encoderLoop, this ) );
+	}
+}
+
+SPHPreview::~SPHPreview()
+{
+	{
+		lock_guard<mutex> guard( queueLock );
+		stopEncoders = true;
+	}
+	queueNotEmpty.notify_all();
+	for(size_t i=0; i<encoders.size(); i++)
+	{
+		if( encoders[i].joinable() )
+		{
+			encoders[i].join();
+		}
+	}
+	safeDelete( &rasteriser );
+}
+
+void SPHPreview::submit( const SPHFrame& frame )
+{
+	Image image;
+	{
+		lock_guard<mutex> guard( queueLock );
+		if( !spareImages.empty() )
+		{
+			swap( image, spareImages.back() );
+			spareImages.pop_back();
+		}
+	}
+
+	image.index = frame.index;
+	glm::mat4 modelView = camera.getView() * transform.getTransformMatrix();
+	rasteriser->render( frame.positions.data(), (int)frame.positions.size(), modelView, camera.getProjection(), frame.pointSize, image.rgba );
+
+	unique_lock<mutex> guard( queueLock );
+	queueNotFull.wait( guard, [this]{ return (int)queue.size() < queueCapacity; } );
+	queue.push_back( Image() );
+	swap( queue.back(), image );
+	queueNotEmpty.notify_one();
+}
+
+int SPHPreview::renderRecording( const char* path )
+{
+	SPHPlayback playback( path );
+	if( !playback.isOpen() )
+	{
+		return 0;
+	}
+
+	int submitted = 0;
+	for(int i=0; i<playback.getFrameCount(); i+=renderEvery)
+	{
+		const SPHFrame& frame = playback.getFrame( i );
+		if( frame.positions.empty() ) continue;
+		submit( frame );
+		submitted++;
+	}
+	flush();
+	cout << "Preview: " << submitted << " images written to " << prefix << "_*.png" << endl;
+	return submitted;
+}
+
+void SPHPreview::flush()
+{
+	unique_lock<mutex> guard( queueLock );
+	queueNotFull.wait( guard, [this]{ return queue.empty() && busyEncoders == 0; } );
+}
+
+// Every encoder drains the queue before stopping, so every submitted image ends up on disk.
+void SPHPreview::encoderLoop()
+{
+	unique_lock<mutex> guard( queueLock );
+	while( true )
+	{
+		queueNotEmpty.wait( guard, [this]{ return stopEncoders || !queue.empty(); } );
+		if( queue.empty() ) break;
+
+		Image image;
+		swap( image, queue.front() );
+		queue.pop_front();
+		busyEncoders++;
+		queueNotFull.notify_all();
+
+		guard.unlock();
+		string path = getFileName( image.index );
+		unsigned error = lodepng::encode( path, image.rgba, rasteriser->getWidth(), rasteriser->getHeight() );
+		if( error != 0 )
+		{
+			cout << "Unable to write preview: " << path << ": " << lodepng_error_text( error ) << endl;
+		}
+		guard.lock();
+
+		busyEncoders--;
+		writtenCount++;
+		if( (int)spareImages.size() < queueCapacity )
+		{
+			spareImages.push_back( std::move( image ) );
+		}
+		queueNotFull.notify_all();
+	}
+}
+
+string SPHPreview::getFileName( int index )
+{
+	ostringstream name;
+	name << prefix << "_" << setw(6) << setfill('0') << index << ".png";
+	return name.str();
+}
+
+int SPHPreview::getWrittenCount()
+{
+	lock_guard<mutex> guard( queueLock );
+	return writtenCount;
+}
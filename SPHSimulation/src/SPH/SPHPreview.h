@@ -0,0 +1,73 @@
+#pragma once
+#ifndef SPHPREVIEW_H
+#define SPHPREVIEW_H
+
+#include "SPHFrame.h"
+#include "Camera.h"
+#include "Transform.h"
+#include <string>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class SpriteRasteriser;
+
+/*
+	Renders preview images of recorded frames without a GL context, for batch runs on machines
+	without a GPU. Particles are drawn by SpriteRasteriser with the same camera and point cloud
+	transform as SPHScene, the images are PNG encoded by a pool of encoder threads.
+
+	Rendering runs on the calling thread (and the ThreadPool), finished images are handed to the
+	encoders through a bounded queue which blocks the caller when it is full. Image buffers are
+	recycled like the snapshots of SPHExporter. The queue is drained before destruction.
+
+	Settings are read from the [preview] group:
+		width, height (pixels), prefix (file path prefix), every (frames), encoders (threads),
+		queue (images), sprite (image file), camera (position, looking at the origin)
+*/
+class SPHPreview
+{
+	struct Image
+	{
+		int index;
+		std::vector<unsigned char> rgba;
+	};
+
+	SpriteRasteriser* rasteriser;
+	Camera camera;
+	Transform transform;		// Same as the point cloud of SPHScene
+	std::string prefix;
+	int renderEvery;
+	int queueCapacity;
+
+	std::vector<std::thread> encoders;
+	std::mutex queueLock;
+	std::condition_variable queueNotEmpty;
+	std::condition_variable queueNotFull;
+	std::deque<Image> queue;
+	std::vector<Image> spareImages;
+	bool stopEncoders;
+	int busyEncoders;
+	int writtenCount;
+
+	void encoderLoop();
+	std::string getFileName( int index );
+
+public:
+	SPHPreview( const char* file );
+	~SPHPreview();
+
+	// Renders the frame and queues the image for encoding as prefix_<frame.index>.png.
+	void submit( const SPHFrame& frame );
+	// Renders every n-th frame of a recording written by SPHFrameRecorder, returns the number of
+	// submitted images. Waits until all of them are written.
+	int renderRecording( const char* path );
+	// Blocks until every queued image is written.
+	void flush();
+
+	int getWrittenCount();
+};
+
+#endif
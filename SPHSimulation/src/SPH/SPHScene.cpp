@@ -8,6 +8,8 @@
 #include "Camera.h"
 #include "LineGrid.h"
 #include "Interactor.h"
+#include "SPHPlayback.h"
+#include "SPHExporter.h"
 #include <glm\gtc\matrix_transform.hpp>
 
 using namespace std;
@@ -17,9 +19,14 @@ SPHScene::SPHScene(void) : Scene(),
 	sphTimer(3), marchingTimer(3),
 	drawWithMC(false),
 	fpsTimer(1.0),
-	interactored(false)
+	interactored(false),
+	playback(nullptr), playbackMode(false)
 {
 	sph3 = new SPHSystem3d("data/sph3d.txt");
+	MappedData sphSettings("data/sph3d.txt");
+	recordingPath = sphSettings.getData("recording", "file").getStringData("recording.sphr");
+	prefetchFrames = sphSettings.getData("recording", "prefetch").get<int>(32);
+	exporter = new SPHExporter("data/sph3d.txt");
 	cout << "SPH particle size: " << sizeof(SPHParticle3d) << endl;
 
 	grid = new LineGrid(10, 5.0f, 5.0f, 10, 5.0f, 5.0f);
@@ -28,7 +35,13 @@ SPHScene::SPHScene(void) : Scene(),
 
 	coords = new LineGrid(25.0f, 3.0f);
 
-	marchingCubes = new MarchingCubesShaded("data/mCubesShaded.txt");
+	string surfaceSettings = sphSettings.getData("surface", "settings").getStringData("data/mCubesShaded.txt");
+	string surfaceMesher = sphSettings.getData("surface", "mesher").getStringData();
+	if (surfaceMesher.empty())
+		marchingCubes = new MarchingCubesShaded(surfaceSettings.c_str());
+	else
+		marchingCubes = new MarchingCubesShaded(surfaceSettings.c_str(), MarchingCubesShaded::parseMesher(surfaceMesher));
+	sph3->setSurfaceField(SPHSystem3d::parseSurfaceField(sphSettings.getData("surface", "field").getStringData("splat")));
 	marchingCubes->transform.setPosition({ 0.0f,0.0f,0.0f });
 	marchingCubes->transform.setScale(marchingCubes->getScale());
 	
@@ -37,6 +50,8 @@ SPHScene::SPHScene(void) : Scene(),
 	pointVisualizer->transform.setScale({ 1.0f, 1.0f, -1.0f });
 	pointVisualizer->transform.setAngles({ 0.0, 90.0f, 0.0f });
 	pointVisualizer->setColor(0.03f, 0.2f, 0.5f);
+	pointVisualizer->setCulling(sphSettings.getData("points", "culling").get<int>(1) != 0, sph3->getSmoothingLength(),
+								sphSettings.getData("points", "lodDistance").get<float>(0.0f), sphSettings.getData("points", "lodMinPoints").get<int>(16));
 
 	fontLoaded = anonPro.loadFromFile("data/fonts/anonymous-pro/AnonymousPro-Regular.ttf");
 	if (fontLoaded)
@@ -58,9 +73,43 @@ SPHScene::~SPHScene(void)
 	safeDelete(&coords);
 	safeDelete(&marchingCubes);
 	safeDelete(&pointVisualizer);
+	safeDelete(&playback);
+	safeDelete(&exporter);
 	safeDelete(&sph3);
 }
 
+void SPHScene::toggleRecording()
+{
+	if (recorder.isRecording())
+	{
+		recorder.close();
+	}
+	else if (!playbackMode)
+	{
+		recorder.open(recordingPath.c_str(), 0.0125f);
+	}
+}
+
+void SPHScene::togglePlayback()
+{
+	playbackMode = !playbackMode;
+	safeDelete(&playback);
+	if (playbackMode)
+	{
+		recorder.close();
+		playback = new SPHPlayback(recordingPath.c_str(), prefetchFrames);
+		if (!playback->isOpen())
+		{
+			safeDelete(&playback);
+			playbackMode = false;
+		}
+		else
+		{
+			playback->setPaused(paused);
+		}
+	}
+}
+
 void SPHScene::eventKeyboardUp(sf::Keyboard::Key keyPressed)
 {
 	switch (keyPressed)
@@ -85,6 +134,61 @@ void SPHScene::eventKeyboardUp(sf::Keyboard::Key keyPressed)
 
 		case sf::Keyboard::P:
 					paused = !paused;
+					if (playback) playback->setPaused(paused);
+					break;
+
+		/* Recording and playback */
+		case sf::Keyboard::F5:
+					toggleRecording();
+					break;
+
+		case sf::Keyboard::F6:
+					togglePlayback();
+					break;
+
+		case sf::Keyboard::F7:
+					exporter->setEnabled(!exporter->isEnabled());
+					break;
+
+		case sf::Keyboard::F8:
+					marchingCubes->setMesher(marchingCubes->getMesher() == MarchingCubesShaded::CPU_MESHER ?
+											 MarchingCubesShaded::GPU_MESHER : MarchingCubesShaded::CPU_MESHER);
+					break;
+
+		case sf::Keyboard::F9:
+					sph3->setSurfaceField((SPHSystem3d::SurfaceField)((sph3->getSurfaceField() + 1) % 3));
+					break;
+
+		case sf::Keyboard::F10:
+					pointVisualizer->setCulling(!pointVisualizer->isCulling());
+					break;
+
+		case sf::Keyboard::PageUp:
+					if (playback) playback->setPlayRate(playback->getPlayRate() * 2.0f);
+					break;
+
+		case sf::Keyboard::PageDown:
+					if (playback) playback->setPlayRate(playback->getPlayRate() * 0.5f);
+					break;
+
+		case sf::Keyboard::BackSpace:
+					if (playback) playback->setPlayRate(-playback->getPlayRate());
+					break;
+
+		case sf::Keyboard::Home:
+					if (playback) playback->seek(0);
+					break;
+
+		case sf::Keyboard::End:
+					if (playback) playback->seek(playback->getFrameCount() - 1);
+					break;
+
+		case sf::Keyboard::Comma:
+					if (playback) playback->seekTime((playback->getFrameIndex() * playback->getFrameInterval()) - 1.0f);
+					break;
+
+		case sf::Keyboard::Period:
+					if (playback) playback->seekTime((playback->getFrameIndex() * playback->getFrameInterval()) + 1.0f);
 					break;
 
 		case sf::Keyboard::O:
@@ -179,11 +283,29 @@ void SPHScene::update(float dt)
 {
 	fpsTimer.tick();
 
-	if (!paused)
+	if (playbackMode)
+	{
+		playback->update(dt);
+		// Playback pauses itself at either end of the recording
+		paused = playback->isPaused();
+	}
+	else if (!paused)
 	{
 		sphTimer.resume();
 		sph3->animate(0.0125f);
 		sphTimer.pause();
+
+		if (recorder.isRecording())
+		{
+			sph3->getFrame(recordedFrame);
+			recorder.record(recordedFrame);
+		}
+
+		if (exporter->shouldExport())
+		{
+			sph3->getFrame(exportFrame, true);
+			exporter->submit(exportFrame);
+		}
 	}
 
 	stringstream infoText;
@@ -206,13 +328,33 @@ void SPHScene::update(float dt)
 	infoText << "  Color Field treshold (U/J): " << sph3->getColorFieldTreshold() << endl;
 	infoText << "  Surface Tension (I/K): " << sph3->getSurfaceTension() << endl;
 	infoText << "  Gravity (1): " << (sph3->usesGravity() ? "ON" : "OFF") << endl;
+	if (playbackMode)
+	{
+		infoText << "[Playback (F6)]" << endl;
+		infoText << "  Frame (Home/End/,/.): " << playback->getFrameIndex() << " / " << playback->getFrameCount() << endl;
+		infoText << "  Rate (PgUp/PgDn/Backspace): " << playback->getPlayRate() << (playback->isPaused() ? " paused" : "") << endl;
+	}
+	else if (recorder.isRecording())
+	{
+		infoText << "[Recording (F5)]" << endl << "  Frames: " << recorder.getFrameCount() << endl;
+	}
+	if (exporter->isEnabled())
+	{
+		infoText << "[Export (F7)]" << endl;
+		infoText << "  Written: " << exporter->getExportedCount() << ", Queued: " << exporter->getQueueLength()
+				 << ", Dropped: " << exporter->getDroppedCount() << endl;
+	}
 	if (drawWithMC)
 	{
 		infoText << "[MarchingCubes (M)]" << endl << "  Treshold (+/-): " << marchingCubes->getTreshold() << endl;
+		infoText << "  Mesher (F8): " << (marchingCubes->getMesher() == MarchingCubesShaded::CPU_MESHER ? "CPU" : "GPU") << endl;
+		infoText << "  Field (F9): " << SPHSystem3d::getSurfaceFieldName(sph3->getSurfaceField())
+				 << (sph3->getSurfaceField() != SPHSystem3d::SPLAT_FIELD && marchingCubes->getAnisotropicField() ? " (anisotropic)" : "") << endl;
 	}
 	else
 	{ 
 		infoText << "[PointCloud (M)]" << endl;
+		infoText << "  Culling (F10): " << (pointVisualizer->isCulling() ? "ON" : "OFF") << ", Points: " << pointVisualizer->getSubmittedCount() << endl;
 	}
 	
 	status.setString( infoText.str() );	
@@ -228,7 +370,7 @@ void SPHScene::draw(const Camera & camera)
 			
 	marchingTimer.resume();	
 
-	if (interactored)
+	if (interactored && !playbackMode)
 	{
 		sph3->draw(interactor);
 		interactor->draw(camera);
@@ -237,12 +379,19 @@ void SPHScene::draw(const Camera & camera)
 	if(drawWithMC)
 	{
 		marchingCubes->clear();
-		sph3->draw( marchingCubes );		
+		if (playbackMode)
+			playback->draw( marchingCubes );
+		else
+			sph3->draw( marchingCubes );		
 		marchingCubes->draw( camera );		
 
 	}else
 	{	
-		sph3->draw( pointVisualizer );			
+		pointVisualizer->setView( camera );
+		if (playbackMode)
+			playback->draw( pointVisualizer );
+		else
+			sph3->draw( pointVisualizer );			
 		pointVisualizer->draw( camera );	
 	}
 
@@ -2,13 +2,18 @@
 #include "Scene.h"
 #include "IntervalAverageTimer.h"
 #include "Timer.h"
+#include "SPHFrame.h"
+#include "SPHFrameRecorder.h"
 #include <gl\glew.h>
+#include <string>
 
 class SPHSystem3d;
 class PointDataVisualiser;
 class MarchingCubesShaded;
 class LineGrid;
 class Interactor;
+class SPHPlayback;
+class SPHExporter;
 
 class SPHScene :
 	public Scene
@@ -44,6 +49,21 @@ private:
 
 	bool paused;
 
+	// Recording and playback
+	SPHFrameRecorder recorder;
+	SPHFrame recordedFrame;
+	SPHPlayback* playback;
+	bool playbackMode;
+	std::string recordingPath;
+	int prefetchFrames;
+
+	void toggleRecording();
+	void togglePlayback();
+
+	// ParaView export
+	SPHExporter* exporter;
+	SPHFrame exportFrame;
+
 	// GUI
 	bool fontLoaded;
 	sf::Font anonPro;
@@ -43,9 +43,6 @@ SPHSystem2d::SPHSystem2d( float w, float h, float density, float constantK, floa
 	pressureKernel = KernelBuilder::getKernel( "KernelPoly6", smoothingLength );
 	viscousKernel = KernelBuilder::getKernel( "KernelPoly6", smoothingLength );
 	
-	grid = vector< vector< int > >();
-	gridWidth = -1;
-	gridHeight = -1;
 	createGrid();
 }
 
@@ -86,9 +83,6 @@ SPHSystem2d::SPHSystem2d( const char* file )
 	unitRadius = sqrt( particleMass / (restDensity*PI) );
 	useGravity = true;	
 
-	grid = vector< vector< int > >();
-	gridWidth = -1;
-	gridHeight = -1;
 	createGrid();
 }
 
@@ -100,32 +94,9 @@ SPHSystem2d::~SPHSystem2d()
 	grid.clear();*/
 }
 
-void SPHSystem2d::clearGrid()
-{
-	for(int i=0; i< gridHeight*gridWidth; i++)
-	{
-		grid[i].clear();
-	}
-}
-
 void SPHSystem2d::createGrid()
 {
-	int newGridHeight = (int)ceil( dHeight / smoothingLength );
-	int newGridWidth = (int)ceil( dWidth / smoothingLength );
-	// If the grid dimensions change, rebuild the grid vectors
-	if( gridWidth != newGridWidth || gridHeight!= newGridHeight )
-	{
-		gridWidth = newGridWidth;
-		gridHeight = newGridHeight;
-		grid.clear();
-		for(int i=0; i< gridHeight*gridWidth; i++)
-		{
-			grid.push_back( vector< int >() );
-		}
-	}else	// else just clear the existing grid vectors
-	{
-		clearGrid();
-	}
+	grid.create( glm::vec2( dWidth, dHeight ), smoothingLength );
 	fillGrid();	
 }
 
@@ -139,14 +110,7 @@ void SPHSystem2d::fillGrid( )
 
 void SPHSystem2d::putParticleIntoGrid( int particleIndex )
 {
-	// Calculate grid index
-	glm::vec2 position = (particles[ particleIndex ]).position;
-	int x = int( position.x * gridWidth / dWidth );
-	int y = int( position.y * gridHeight / dHeight );
-	if( x >= gridWidth ) x=gridWidth-1;
-	if( y >= gridHeight ) y=gridHeight-1;
-
-	grid[ y*gridWidth + x ].push_back( particleIndex );
+	grid.insert( particleIndex, particles[ particleIndex ].position );
 }
 
 
@@ -189,13 +153,14 @@ void SPHSystem2d::addSurface(std::unique_ptr<SPHInteractor2d>& surface )
 	surfaces.push_back( std::move(surface) );
 }
 
-void SPHSystem2d::applyDensity( SPHParticle2d& first, SPHParticle2d& second )
+template<class Kernels>
+void SPHSystem2d::applyDensity( const Kernels& kernels, SPHParticle2d& first, SPHParticle2d& second )
 {
 	glm::vec2 rvec = first.position - second.position;
 	float r = glm::length( rvec );
 	if( r < smoothingLength )
 	{
-		float additionalDensity = particleMass * kernel->base(r);
+		float additionalDensity = particleMass * kernels.base.base(r);
 		first.density += additionalDensity;
 		second.density += additionalDensity;
 		first.neighbours.push_back( &second );
@@ -203,7 +168,8 @@ void SPHSystem2d::applyDensity( SPHParticle2d& first, SPHParticle2d& second )
 }
 
 // NOTE: Assume this is called on neighbourhood data. No smoothing check is made.
-void SPHSystem2d::applyForces( SPHParticle2d& first, SPHParticle2d& second )
+template<class Kernels>
+void SPHSystem2d::applyForces( const Kernels& kernels, SPHParticle2d& first, SPHParticle2d& second )
 {
 	glm::vec2 rvec = (first.position - second.position);
 	float r = glm::length( rvec );
@@ -215,7 +181,7 @@ void SPHSystem2d::applyForces( SPHParticle2d& first, SPHParticle2d& second )
 	}
 	/*
 	glm::vec2 commonPressureInfluence = 
-		pressureKernel->gradient( rvec ) * 
+		kernels.pressure.gradient( rvec ) * 
 		( 
 			particleMass * 
 			(
@@ -223,7 +189,7 @@ void SPHSystem2d::applyForces( SPHParticle2d& first, SPHParticle2d& second )
 			) / 2.0
 		); /* unified */
 	glm::vec2 commonPressureInfluence = 
-		pressureKernel->gradient( rvec ) * 
+		kernels.pressure.gradient( rvec ) * 
 		( 
 			particleMass * 
 			(	
@@ -235,29 +201,30 @@ void SPHSystem2d::applyForces( SPHParticle2d& first, SPHParticle2d& second )
 	// viscosity forces
 		
 	/*glm::vec2 commonViscousInfluence = (second.velocity - first.velocity) * 
-		(viscosityConstant * particleMass * viscousKernel->laplacian( r )); /* unified */
+		(viscosityConstant * particleMass * kernels.viscous.laplacian( r )); /* unified */
 	glm::vec2 commonViscousInfluence = 
 		(second.velocity - first.velocity) * 
 		(
 			viscosityConstant * particleMass * 
-			viscousKernel->laplacian( r ) / 
+			kernels.viscous.laplacian( r ) / 
 			(second.density*first.density)
 		);/* by definition */
 
 	first.force += ( commonPressureInfluence + commonViscousInfluence) / second.density;
 	second.force += (-commonPressureInfluence - commonViscousInfluence) / first.density;
 
-	glm::vec2 commonColorGradient = kernel->gradient( rvec ) * particleMass;
+	glm::vec2 commonColorGradient = kernels.base.gradient( rvec ) * particleMass;
 	first.colorGradient += commonColorGradient / second.density;
 	second.colorGradient += commonColorGradient / first.density;
 
-	float commonColorLaplacian = kernel->laplacian( r ) * particleMass;
+	float commonColorLaplacian = kernels.base.laplacian( r ) * particleMass;
 	first.colorLaplacian += commonColorLaplacian / second.density;
 	second.colorLaplacian += commonColorLaplacian / first.density;
 		
 }
 
-void SPHSystem2d::applySurfaceDensity( SPHParticle2d& particle )
+template<class Kernels>
+void SPHSystem2d::applySurfaceDensity( const Kernels& kernels, SPHParticle2d& particle )
 {
 	glm::vec2 rvec;
 	float r;
@@ -267,12 +234,13 @@ void SPHSystem2d::applySurfaceDensity( SPHParticle2d& particle )
 		r = glm::length( rvec );
 		if( r < smoothingLength )
 		{
-			particle.density += particleMass * kernel->base(r);
+			particle.density += particleMass * kernels.base.base(r);
 		}
 	}
 }
 
-void SPHSystem2d::applySurfaceForces( SPHParticle2d& particle )
+template<class Kernels>
+void SPHSystem2d::applySurfaceForces( const Kernels& kernels, SPHParticle2d& particle )
 {
 	glm::vec2 rvec;
 	float r;
@@ -283,81 +251,34 @@ void SPHSystem2d::applySurfaceForces( SPHParticle2d& particle )
 		if( r < smoothingLength )
 		{
 			// pressure
-			particle.force -= pressureKernel->gradient( rvec ) * particleMass * particle.pressure / particle.density;
+			particle.force -= kernels.pressure.gradient( rvec ) * particleMass * particle.pressure / particle.density;
 			// viscosity
-			particle.force += ( -particle.velocity ) * (viscousKernel->laplacian( r ) * viscosityConstant * particleMass / particle.density);
+			particle.force += ( -particle.velocity ) * (kernels.viscous.laplacian( r ) * viscosityConstant * particleMass / particle.density);
 		}
 	}
 }
 
-void SPHSystem2d::gridDensityUpdate( )
+template<class Kernels>
+void SPHSystem2d::gridDensityUpdate( const Kernels& kernels )
 {
-	for( int x=0; x<gridWidth; x++)
-	{
-	for( int y=0; y<gridHeight; y++)
-	{	
-		int index = y*gridWidth+x;
-		int particlesInGrid = grid[index].size();
-		if( particlesInGrid < 1 ) continue;
-
-		int indexRight = index+1;
-		int particlesRight = x+1 == gridWidth ? -1 : grid[indexRight].size();
-
-		int indexUp = index+gridWidth;
-		int particlesUp = y+1 == gridHeight ? -1 : grid[indexUp].size();
-
-		int indexDiagonal = indexUp+1;
-		int particlesDiagonal = y+1 == gridHeight || x+1 == gridWidth ? -1 : grid[indexDiagonal].size();
-
-		int indexDown = index-gridWidth+1;
-		int particlesDown = y-1 == -1 || x+1 == gridWidth ? -1 : grid[indexDown].size();
-
-		// Go through the current grid, C current cell, V cell to visit, X ignored cell
-		// X | V | V
-		//-----------
-		// X | C | V
-		//-----------
-		// X | X | V
-		for(int j=0; j<particlesInGrid; j++)
-		{				
-			SPHParticle2d& particle = particles[ grid[index][j] ];
+	// Particles were inserted during the last step
+	grid.sort();
+	grid.forEachPair( 
+		[&]( int first, int second )
+		{
+			applyDensity( kernels, particles[first], particles[second] );
+		},
+		[&]( int index )
+		{
+			SPHParticle2d& particle = particles[index];
 			particle.density += particleMass;
-
-			// Visit rest of the current grid
-			for(int k=j+1; k<particlesInGrid; k++)
-			{
-				applyDensity( particle, particles[ grid[index][k] ] );
-			}
-			// Visit right grid, (particlesRight == -1) when there is no grid to the right
-			for(int k=0; k<particlesRight; k++)
-			{
-				applyDensity( particle, particles[ grid[indexRight][k] ] );
-			}
-			// Visit up grid, (particlesUp == -1) when there is no grid above
-			for(int k=0; k<particlesUp; k++)
-			{
-				applyDensity( particle, particles[ grid[indexUp][k] ] );
-			}
-			// Visit diagonal grid, (particlesDiagonal == -1) when there is no grid diagonaly
-			for(int k=0; k<particlesDiagonal; k++)
-			{
-				applyDensity( particle, particles[ grid[indexDiagonal][k] ] );
-			}
-			// Visit down diagonal grid, (particlesDown == -1) when there is no grid diagonaly down
-			for(int k=0; k<particlesDown; k++)
-			{
-				applyDensity( particle, particles[ grid[indexDown][k] ] );
-			}
-
-			applySurfaceDensity( particle );
-
+			applySurfaceDensity( kernels, particle );
 			particle.pressure = fluidConstantK * (particle.density - restDensity );
-		}
-	}
-	}
+		});
 }
 
-void SPHSystem2d::densityUpdate()
+template<class Kernels>
+void SPHSystem2d::densityUpdate( const Kernels& kernels )
 {
 	for(int i=0; i<particleCount; i++)
 	{		
@@ -365,19 +286,27 @@ void SPHSystem2d::densityUpdate()
 		particles[i].density = particleMass;
 		for(int j=i+1; j<particleCount; j++)
 		{
-			applyDensity( particles[i], particles[j] );
+			applyDensity( kernels, particles[i], particles[j] );
 		}
 
-		applySurfaceDensity( particles[i] );
+		applySurfaceDensity( kernels, particles[i] );
 
 		particles[i].pressure = fluidConstantK * ( particles[i].density - restDensity );
 	}
 }
 
+// Kernel types are resolved once per step, the pair loops call the kernels without virtual dispatch.
 void SPHSystem2d::animate( float dt )
 {
 	if(!particleCount) return;
 
+	AnimateStep step = { this, dt };
+	dispatchKernels( *kernel, *pressureKernel, *viscousKernel, step );
+}
+
+template<class Kernels>
+void SPHSystem2d::animateWith( float dt, const Kernels& kernels )
+{
 	for(int i=0; i<particleCount; i++)
 	{
 		particles[i].reset();
@@ -386,9 +315,9 @@ void SPHSystem2d::animate( float dt )
 	
 	// Calculating densities and pressures for all particles:
 	//  - grid walk
-	gridDensityUpdate();
+	gridDensityUpdate( kernels );
 	//  - non grid walk
-	// densityUpdate();
+	// densityUpdate( kernels );
 	
 	// calculating pressure and viscosity forces
 	for(int i=0; i<particleCount; i++)
@@ -396,10 +325,10 @@ void SPHSystem2d::animate( float dt )
 		// visit all neighbours
 		for( size_t j=0, jLen = particles[i].neighbours.size(); j<jLen; j++)
 		{
-			applyForces( particles[i], *(particles[i].neighbours[j]) );
+			applyForces( kernels, particles[i], *(particles[i].neighbours[j]) );
 		}
 		
-		applySurfaceForces( particles[i] );		
+		applySurfaceForces( kernels, particles[i] );		
 	}
 
 	// TODO: collisions and user interaction
@@ -409,7 +338,7 @@ void SPHSystem2d::animate( float dt )
 	glm::vec2 moveVector;
 
 	
-	clearGrid( );	
+	grid.clear( );	
 	for(int i=0; i<particleCount; i++)
 	{
 		SPHParticle2d& particle = particles[i];
@@ -477,7 +406,7 @@ int SPHSystem2d::getParticleCount()
 void SPHSystem2d::clearAllParticles()
 {
 	particles.clear();
-	clearGrid();
+	grid.clear();
 	particleCount = 0;
 }
 
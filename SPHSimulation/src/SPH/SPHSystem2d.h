@@ -4,6 +4,7 @@
 
 #include "SPHParticle2d.h"
 #include "SmoothingKernels.h"
+#include "SPHGrid.h"
 #include <vector>
 #include <memory>
 #include "SPHInteractor2d.h"
@@ -17,9 +18,7 @@ class SPHSystem2d
 //	glm::vec2 *positions;
 //	int positionsSize;
 	
-	std::vector< std::vector< int > > grid;
-	int gridWidth;
-	int gridHeight;
+	SPHGrid<2> grid;
 
 	std::vector< std::unique_ptr<SPHInteractor2d> > surfaces;
 	int particleCount;
@@ -47,30 +46,48 @@ class SPHSystem2d
 
 	// Updates densities for both particles and generates neighbourhood data,
 	// but only in the first particle (to avoid colisions in later calculations).
-	void applyDensity( SPHParticle2d& first, SPHParticle2d& second );
+	template<class Kernels>
+	void applyDensity( const Kernels& kernels, SPHParticle2d& first, SPHParticle2d& second );
 	// Updates the forces for a given particle pair. It is asumed that the 
 	// particles are neighbours and therefore proximity check is not made.
-	void applyForces( SPHParticle2d& first, SPHParticle2d& second );
+	template<class Kernels>
+	void applyForces( const Kernels& kernels, SPHParticle2d& first, SPHParticle2d& second );
 	// Updates the density against all surfaces (SPHInteractor).
-	void applySurfaceDensity( SPHParticle2d& particle );
+	template<class Kernels>
+	void applySurfaceDensity( const Kernels& kernels, SPHParticle2d& particle );
 	// Updates the forces against all surfaces (SPHInteractor).
-	void applySurfaceForces( SPHParticle2d& particle );
+	template<class Kernels>
+	void applySurfaceForces( const Kernels& kernels, SPHParticle2d& particle );
 
 
 	// Recalculates grid dimensions and resizes the vectors if necessary.
 	void createGrid();
 	// Reposition all existing particles. Assumes the grid is clear.
 	void fillGrid();
-	// Clears all grid vectors. Used prior to fillGrid method.
-	void clearGrid();
 	void putParticleIntoGrid( int particleIndex );
 
 	// Traversal of the grid for initial density calculation. ApplyDensity is
 	// called on valid particle pairs. This also generates neighbourhood lists!
-	void gridDensityUpdate( );
+	template<class Kernels>
+	void gridDensityUpdate( const Kernels& kernels );
 	// Matches every particle to every other particle for density and neighbourhood
 	// update.
-	void densityUpdate();
+	template<class Kernels>
+	void densityUpdate( const Kernels& kernels );
+
+	// Forwards the concrete kernel types chosen by dispatchKernels to animateWith.
+	struct AnimateStep
+	{
+		SPHSystem2d* system;
+		float dt;
+
+		template<class Kernels>
+		void operator()( const Kernels& kernels ) { system->animateWith( dt, kernels ); }
+	};
+
+	// The step of animate with the kernels resolved at compile time.
+	template<class Kernels>
+	void animateWith( float dt, const Kernels& kernels );
 
 public:
 	// Constructor with all necessary parameters and their default values. Does not include bounding surfaces.
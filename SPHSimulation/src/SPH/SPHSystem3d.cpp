@@ -7,7 +7,11 @@
 #include "PointDataVisualiser.h"
 #include "MappedData.h"
 #include "MarchingCubesShaded.h"
+#include "SPHFrame.h"
+#include "AllocationCounter.h"
 #include <iostream>
+#include <algorithm>
+#include <functional>
 #include <math.h>
 
 using namespace std;
@@ -18,30 +22,49 @@ SPHSystem3d::SPHSystem3d( float w, float h, float d, float density, float consta
 							float cfTreshold, float surfTension,  float mass, float smLen ):
 	particleCount(0),
 	dWidth(w), dHeight(h), dDepth(d),
-	gridWidth(-1), gridHeight(-1),
 	restDensity(density), fluidConstantK(constantK), viscosityConstant(constantMi),
 	colorFieldTreshold(0.075f * cfTreshold), surfaceTension(surfTension), particleMass(mass),
-	unitRadius(mass/(density*PI)), useGravity(true), gravityAcc(0.0f, 0.0f, -9.81f)
+	unitRadius(mass/(density*PI)), useGravity(true), gravityAcc(0.0f, 0.0f, -9.81f),
+	surfaceField(SPLAT_FIELD), tabulatedKernels(false), tableSize(KernelTable::DEFAULT_SIZE),
+	reorderInterval(0), reorderLocality(0), stepsSinceReorder(0), sortedLocality(0),
+	useGrid(true), useNeighbourLists(true), blockSize(4), stageBlocks(true),
+	stepAllocations(0), warmupSteps(0), warmupParticleCount(0)
 {
 	adjustSmoothingLength( smLen );
 }
 
 // Creates a SPH System 3d from a mapped data file. The file must contain the following
 // groups and fields:
-//  - grid: width (float), height (float), surfaces (surface group names)
+//  - grid: width (float), height (float), surfaces (surface group names),
+//          reorderInterval (steps, optional), reorderLocality (float, optional),
+//          useGrid (0/1, optional), neighbourLists (0/1, optional), cacheDistances (0/1, optional),
+//          blockSize (cells, optional), stageBlocks (0/1, optional), largePages (0/1, optional,
+//          applies to all AlignedMemory blocks allocated afterwards)
 //  - fluid: density, k, viscosity, colorFieldTreshold, surfaceTension, unitMass (all floats), gravity (two floats)
-//  - kernel: smoothingLength (float), base (string), pressure (string), viscous (string)
+//  - kernel: smoothingLength (float), base (string), pressure (string), viscous (string),
+//            tabulated (0/1, optional), tableSize (int, optional)
 //  - additional groups describing bounding surfaces provided by SPHInteractor3dFactory
 SPHSystem3d::SPHSystem3d( const char* file ):
 	particleCount(0),
 	useGravity(true),
-	gridWidth(-1), gridHeight(-1), gridDepth(-1)
+	surfaceField(SPLAT_FIELD), tabulatedKernels(false), tableSize(KernelTable::DEFAULT_SIZE),
+	reorderInterval(0), reorderLocality(0), stepsSinceReorder(0), sortedLocality(0),
+	useGrid(true), useNeighbourLists(true), blockSize(4), stageBlocks(true),
+	stepAllocations(0), warmupSteps(0), warmupParticleCount(0)
 {
 	MappedData map( file );
 
 	dWidth = map.getData( "grid", "width" ).get<float>();
 	dHeight = map.getData( "grid", "height" ).get<float>();
 	dDepth = map.getData( "grid", "depth" ).get<float>();
+	reorderInterval = map.getData( "grid", "reorderInterval" ).get<int>( 0 );
+	reorderLocality = map.getData( "grid", "reorderLocality" ).get<float>( 0 );
+	useGrid = map.getData( "grid", "useGrid" ).get<int>( 1 ) != 0;
+	useNeighbourLists = map.getData( "grid", "neighbourLists" ).get<int>( 1 ) != 0;
+	blockSize = map.getData( "grid", "blockSize" ).get<int>( 4 );
+	stageBlocks = map.getData( "grid", "stageBlocks" ).get<int>( 1 ) != 0;
+	AlignedMemory::setLargePages( map.getData( "grid", "largePages" ).get<int>( 0 ) != 0 );
+	neighbours.setCacheDistances( map.getData( "grid", "cacheDistances" ).get<int>( 0 ) != 0 );
 	vector<string> surfaceNames = map.getData( "grid", "surfaces" ).getVector<string>();
 	for ( string sName : surfaceNames )
 	{
@@ -58,6 +81,9 @@ SPHSystem3d::SPHSystem3d( const char* file ):
 	gravityAcc =  map.getData( "fluid", "gravity" ).getVec3();
 		
 	unitRadius = sqrt( particleMass / (restDensity*PI) );
+
+	tabulatedKernels = map.getData( "kernel", "tabulated" ).get<int>( 0 ) != 0;
+	tableSize = map.getData( "kernel", "tableSize" ).get<int>( KernelTable::DEFAULT_SIZE );
 	
 	adjustSmoothingLength( map.getData( "kernel", "smoothingLength" ).get<float>() );
 }
@@ -69,74 +95,13 @@ SPHSystem3d::~SPHSystem3d()
 	/*particles.clear();	
 	grid.clear();	
 	surfaces.clear();
-	pairs.clear();*/
-}
-
-void SPHSystem3d::clearGrid()
-{
-	for(int i=0; i< gridHeight*gridWidth*gridDepth; i++)
-	{
-		grid[i].clear();
-	}
+	neighbours.clear();*/
 }
 
 void SPHSystem3d::createGrid()
 {
-	int newGridHeight = (int)ceil( dHeight / smoothingLength );
-	int newGridWidth = (int)ceil( dWidth / smoothingLength );
-	int newGridDepth = (int)ceil( dDepth / smoothingLength );
-	// If the grid dimensions change, rebuild the grid vectors
-	if( gridWidth != newGridWidth || gridHeight!= newGridHeight || gridDepth!=newGridDepth)
-	{
-		/*gridWidth = newGridWidth;
-		gridHeight = newGridHeight;
-		gridDepth = newGridDepth;/**/
-		gridWidth = 3;
-		gridHeight = 3;
-		gridDepth = 3;/**/
-		grid.clear();
-		for(int i=0; i< gridHeight*gridWidth*gridDepth; i++)
-		{
-			grid.push_back( vector< int >() );
-		}
-	}else	// else just clear the existing grid vectors
-	{
-		clearGrid();
-	}
+	grid.create( glm::vec3( dWidth, dHeight, dDepth ), smoothingLength );
 	fillGrid();	
-		
- /* Build index offsets, C current cell, (A,R,F) cell to visit, X ignored cell
-	dx			-1				 0				 +1 
-	--------------------------------------------------------------------------
-	 dz\dy	-1   0  +1		-1   0  +1		-1   0  +1	  dy/dz
-	 +1		 X | X | X		 A | A | A		 F | F | F		+1
-			-----------		-----------		-----------
-	  0		 X | X | X		 X | C | R		 F | F | F		 0
-			-----------		-----------		-----------
-	 -1		 X | X | X		 X | X | X		 F | F | F		-1
-
-	*/
-
-	int gridOffIndex=0;
-	// F cells
-	for( int yf = -1; yf<2; yf++)
-	{	
-		for( int zf = -1; zf<2; zf++)
-		{
-			gridOffsets[gridOffIndex]= (zf*gridHeight + yf)*gridWidth+1;					
-			gridOffIndex++;
-		}
-	}
-
-	// A cells
-	for( int ya =-1; ya<2; ya++)
-	{	
-		gridOffsets[gridOffIndex]= (1*gridHeight + ya)*gridWidth;
-		gridOffIndex++;
-	}
-	// R cell
-	gridOffsets[gridOffIndex] = 1*gridWidth;
-
 }
 
 void SPHSystem3d::fillGrid( )
@@ -145,46 +110,24 @@ void SPHSystem3d::fillGrid( )
 	{
 		putParticleIntoGrid( i );
 	}
+	grid.sort();
 }
 
 void SPHSystem3d::putParticleIntoGrid( int particleIndex )
 {
-	// Calculate grid index
-	glm::vec3 position = particles[ particleIndex ].position;
-	int x = (int) (position.x * gridWidth / dWidth);
-	int y = (int) (position.y * gridHeight / dHeight);
-	int z = (int) (position.z * gridDepth / dDepth);
-	if( x >= gridWidth ){
-		x=gridWidth-1;
-		particles[ particleIndex ].position.x = dWidth;
-	}
-	if( x < 0 )
+	SPHParticle3d& particle = particles[ particleIndex ];
+	glm::ivec3 cell = grid.cellOf( particle.position );
+	glm::ivec3 dims = grid.getDims();
+	glm::vec3 domain( dWidth, dHeight, dDepth );
+	// Particles which left the grid are put back on its border
+	for(int a=0; a<3; a++)
 	{
-		x = 0;
-		particles[ particleIndex ].position.x = 0;
-	}
-	if( y >= gridHeight )
-	{
-		y=gridHeight-1;
-		particles[ particleIndex ].position.y = dHeight;
-	}
-	if( y < 0 )
-	{
-		y = 0;
-		particles[ particleIndex ].position.y = 0;
-	}
-	if( z >= gridDepth )
-	{
-		z=gridDepth-1;
-		particles[ particleIndex ].position.z = dDepth;
-	}
-	if( z < 0 )
-	{
-		z = 0;
-		particles[ particleIndex ].position.z = 0;
+		if( cell[a] >= dims[a] ) particle.position[a] = domain[a];
+		if( cell[a] < 0 ) particle.position[a] = 0;
 	}
 
-	grid[ (z*gridHeight + y)*gridWidth + x ].push_back( particleIndex );
+	grid.insert( particleIndex, grid.clampCell( cell ) );
+	if( SPH_PRECISE_STATE ) syncPreciseState( particleIndex );
 }
 
 void SPHSystem3d::addParticle( glm::vec3 position, glm::vec3 velocity )
@@ -192,6 +135,13 @@ void SPHSystem3d::addParticle( glm::vec3 position, glm::vec3 velocity )
 	position = glm::clamp( position, glm::vec3(0,0,0), glm::vec3( dWidth, dHeight, dDepth ) );
 	// density used to be restDensity, not 0
 	particles.push_back( SPHParticle3d( position, velocity, particleMass, 0 ) );
+	idToIndex.push_back( particleCount );
+	indexToId.push_back( particleCount );
+	if( SPH_PRECISE_STATE )
+	{
+		precisePositions.push_back( sphVec3( position ) );
+		preciseVelocities.push_back( sphVec3( velocity ) );
+	}
 	putParticleIntoGrid( particleCount );
 	particleCount++;	
 }
@@ -205,6 +155,13 @@ SPHParticle3d* SPHSystem3d::addInteractor(glm::vec3 position, glm::vec3 velocity
 	interactor->mass = 6.28;
 	interactor->volume = 12.56;	// r = 2
 	particles.push_back(*interactor);
+	idToIndex.push_back( particleCount );
+	indexToId.push_back( particleCount );
+	if( SPH_PRECISE_STATE )
+	{
+		precisePositions.push_back( sphVec3( position ) );
+		preciseVelocities.push_back( sphVec3( velocity ) );
+	}
 	putParticleIntoGrid(particleCount);
 	iteractorID = particleCount;
 	cout << "Iteractor ID: " << iteractorID << endl;
@@ -226,46 +183,63 @@ void SPHSystem3d::toggleSurface( int index )
 	}
 }
 
-// NOTE: compute only the kernel into density, mass is the same for all particles
-// therefore it can be multiplied into density after all density updates
-void SPHSystem3d::applyDensity( SPHParticle3d& first, SPHParticle3d& second )
+// NOTE: the kernel sum holds only the kernels, mass is the same for all particles
+// therefore it is multiplied into density afterwards
+void SPHSystem3d::applyDensity( int index, sphReal kernelSum )
 {
-	glm::vec3 rvec = first.position - second.position;
-	float rSq = glm::length2( rvec );	
-	if( rSq < hSquared )
-	{
-		float additionalDensity = kp6base(rSq);
-		first.density += additionalDensity;
-		second.density += additionalDensity;
-		//first.neighbours.push_back( &second );
-		pairs.push_back( SPHPair( first, second, rvec ) );
-	}
+	SPHParticle3d& particle = particles[index];
+	//applySurfaceDensity( particle );
+	particle.density = (float)kernelSum;
+	particle.volume = 1.0f/particle.density;
+	particle.density *= particleMass;
+	particle.pressure = fluidConstantK * ( particle.density - restDensity )/restDensity;
 }
 
-// NOTE: Assume this is called on neighbourhood data. No smoothing check is made.
-void SPHSystem3d::applyForces( SPHParticle3d& first, SPHParticle3d& second )
+// NOTE: Assume the neighbour lists are up to date. No smoothing check is made.
+void SPHSystem3d::applyForces( int index, const NeighbourBlock* block )
 {
-	glm::vec3 rvec = (first.position - second.position);
-	applyForces( first, second, rvec );		
+	SPHParticle3d& particle = particles[index];
+	glm::vec3 force( 0 );
+	glm::vec3 colorGradient( 0 );
+	float colorLaplacian = 0;
+	if( useNeighbourLists )
+	{
+		bool cachedDistances = neighbours.cachesDistances();
+		for(int k=neighbours.begin( index ), kEnd=neighbours.end( index ); k<kEnd; k++)
+		{
+			glm::vec3 rvec = separation( index, neighbours.getNeighbour( k ) );
+			float r = cachedDistances ? neighbours.getDistance( k ) : sqrtf( glm::length2( rvec ) );
+			addNeighbourForces( particle, particles[ neighbours.getNeighbour( k ) ], rvec, r, force, colorGradient, colorLaplacian );
+		}
+	}
+	else
+	{
+		forEachNeighbour( index, block, [&]( int otherIndex, const glm::vec3& rvec, float rSq )
+		{
+			addNeighbourForces( particle, particles[otherIndex], rvec, sqrtf( rSq ), force, colorGradient, colorLaplacian );
+		});
+	}
+	particle.force += force;
+	particle.colorGradient += colorGradient;
+	particle.colorLaplacian += colorLaplacian;
 }
 
-// NOTE: Assume this is called on pair data. No smoothing check is made.
-void SPHSystem3d::applyForces( SPHParticle3d& first, SPHParticle3d& second, glm::vec3 rvec )
+void SPHSystem3d::addNeighbourForces( const SPHParticle3d& particle, const SPHParticle3d& other, glm::vec3 rvec, float r,
+									  glm::vec3& force, glm::vec3& colorGradient, float& colorLaplacian )
 {
-	float r = glm::length( rvec );
-	
 	if( r <= 0.00173f ) 
 	{
 		rvec = glm::vec3( 0.001f, 0.001f, 0.001f );
-		r = 0.00173f;
+		r = glm::length( rvec );
 	}
+	float rSq = r*r;
 	
 	glm::vec3 commonPressureInfluence = 
-		ksgradient( rvec ) * 
+		pressureGradient( rvec, r, rSq ) * 
 		( 
 			//particleMass * 
 			(
-				second.pressure + first.pressure 
+				other.pressure + particle.pressure 
 			) / 2.0f
 		); /* unified */
 	/*glm::vec3 commonPressureInfluence = 
@@ -273,34 +247,26 @@ void SPHSystem3d::applyForces( SPHParticle3d& first, SPHParticle3d& second, glm:
 		( 
 			particleMass * 
 			(	
-				second.pressure / ( second.density*second.density ) +
-				first.pressure / (first.density*first.density)
+				other.pressure / ( other.density*other.density ) +
+				particle.pressure / (particle.density*particle.density)
 			)
 		);/* by definition */
 		
 	// viscosity forces
 		
-	glm::vec3 commonViscousInfluence = (second.velocity - first.velocity) * 
-		(viscosityConstant/* * particleMass/**/ * kvlaplacian( r )); /* unified */
+	glm::vec3 commonViscousInfluence = (other.velocity - particle.velocity) * 
+		(viscosityConstant/* * particleMass/**/ * viscosityLaplacian( r, rSq )); /* unified */
 	/*glm::vec3 commonViscousInfluence = 
-		(second.velocity - first.velocity) * 
+		(other.velocity - particle.velocity) * 
 		(
 			viscosityConstant * particleMass * 
 			kvlaplacian( r ) /
-			(second.density*first.density)
+			(other.density*particle.density)
 		);/* by definition */
 
-	first.force += ( -commonPressureInfluence + commonViscousInfluence) * second.volume; /// second.density;
-	second.force += ( commonPressureInfluence - commonViscousInfluence) * first.volume; /// first.density;
-	
-	glm::vec3 commonColorGradient = kp6gradient( rvec );// * particleMass;
-	first.colorGradient += commonColorGradient * second.volume; /// second.density;
-	second.colorGradient += commonColorGradient * first.volume;/// first.density;
-
-	float commonColorLaplacian = kp6laplacian( r*r );// * particleMass;
-	first.colorLaplacian += commonColorLaplacian * second.volume; /// second.density;
-	second.colorLaplacian += commonColorLaplacian * first.volume;// / first.density;
-		
+	force += ( -commonPressureInfluence + commonViscousInfluence) * other.volume; /// other.density;
+	colorGradient += kp6gradient( rvec ) * other.volume; /// other.density;
+	colorLaplacian += kp6laplacian( rSq ) * other.volume; /// other.density;
 }
 
 // NOTE: compute only the kernel into density, mass is the same for all particles
@@ -315,7 +281,7 @@ void SPHSystem3d::applySurfaceDensity( SPHParticle3d& particle )
 		rSq = glm::length2( rvec );
 		if( rSq < hSquared )
 		{
-			particle.density += kp6base(rSq);
+			particle.density += densityKernel(rSq);
 		}
 	}
 }
@@ -354,15 +320,16 @@ void SPHSystem3d::applySurfaceForces( SPHParticle3d& particle )
 				// pressure
 				//particle.force += ksgradient( rvec ) * particleMass * particle.pressure / particle.density;
 				float pressure = particle.pressure;
+				float r = sqrtf( rSq );
 				//float pressure = particle.pressure < 0 ? -particle.pressure : particle.pressure;
-				particle.force += (ksgradient( rvec ) * pressure * particle.volume)*0.5f;
+				particle.force += (pressureGradient( rvec, r, rSq ) * pressure * particle.volume)*0.5f;
 				if( _isnan(particle.force.x) == 1 ) 	
 				{
 					//cout << "2";
 				}
 				// viscosity
 				//particle.force -= ( particle.velocity ) * (kvlaplacian( sqrtf(rSq) ) * viscosityConstant * particleMass / particle.density);
-				particle.force += ( particle.velocity ) * (kvlaplacian( sqrtf(rSq) ) * viscosityConstant * particle.volume);
+				particle.force += ( particle.velocity ) * (viscosityLaplacian( r, rSq ) * viscosityConstant * particle.volume);
 				if( _isnan(particle.force.x) == 1 ) 	
 				{
 					//cout << "3";
@@ -435,107 +402,163 @@ void SPHSystem3d::applyInteractorForces(SPHParticle3d& particle)
 	}
 }
 
-// ALMOST DONE!!
-void SPHSystem3d::gridDensityUpdate( )
-{	
-	vector<int>* neighbourCell;
-	vector<int>* thisCell;
-	int cellIndex;
-	int particlesInCell;
-	
-	for( int x=0; x<gridWidth; x++)
+template<class NeighbourFunction>
+void SPHSystem3d::forEachNeighbour( int index, const NeighbourBlock* block, NeighbourFunction neighbourFunction )
+{
+	if( block )
 	{
-	for( int y=0; y<gridHeight; y++)
-	{	
-	for(int z=0; z<gridDepth; z++)
+		sphVec3 position = statePosition( index );
+		block->forEachNeighbour( grid.clampCell( grid.cellOf( particles[index].position ) ),
+			[&]( int otherIndex, const sphVec3& otherPosition )
+			{
+				if( otherIndex == index ) return;
+				glm::vec3 rvec( position - otherPosition );
+				float rSq = glm::length2( rvec );
+				if( rSq < hSquared )
+				{
+					neighbourFunction( otherIndex, rvec, rSq );
+				}
+			});
+		return;
+	}
+
+	auto visit = [&]( int otherIndex )
 	{
-		cellIndex = (z*gridHeight + y)*gridWidth+x;
-		thisCell = &grid[cellIndex];
-		particlesInCell = thisCell->size();
-		if( particlesInCell < 1 ) continue;
-		
-		int mask = 0x1fff;
-		if( x+1 == gridWidth )
+		if( otherIndex == index ) return;
+		glm::vec3 rvec = separation( index, otherIndex );
+		float rSq = glm::length2( rvec );
+		if( rSq < hSquared )
 		{
-			mask &= 0xf;
+			neighbourFunction( otherIndex, rvec, rSq );
 		}
-		if( y == 0 )
+	};
+
+	if( useGrid )
+	{
+		glm::ivec3 cell = grid.clampCell( grid.cellOf( particles[index].position ) );
+		grid.forEachNeighbourCell( cell, [&]( const SPHGrid<3>::Cell& particlesInCells )
 		{
-			mask &= 0x3f7;
-		}
-		if( y+1 == gridHeight )
+			for(int c=0, cLen=particlesInCells.size(); c<cLen; c++)
+			{
+				visit( particlesInCells[c] );
+			}
+		});
+	}
+	else
+	{
+		for(int j=0; j<particleCount; j++)
 		{
-			mask &= 0x1f8c;
+			visit( j );
 		}
-		if( z == 0 )
+	}
+}
+
+template<class ParticleFunction>
+void SPHSystem3d::forEachParticle( bool stage, ParticleFunction particleFunction )
+{
+	if( !useGrid || blockSize <= 0 )
+	{
+		SPHNeighbourList::parallelForParticles( particleCount, [&]( int i )
 		{
-			mask &= 0xdbf;
-		}
-		if( z+1 == gridDepth )
+			particleFunction( i, (const NeighbourBlock*)0 );
+		});
+		return;
+	}
+
+	auto blockTask = [&]( int n )
+	{
+		glm::ivec3 low, high;
+		grid.getBlock( blockSize, n, low, high );
+		// One staging buffer per thread, kept for the following blocks and steps
+		static thread_local NeighbourBlock block;
+		if( stage )
 		{
-			mask &= 0x1b61;
-		}		
-				
-		for(int particleInd=0; particleInd < particlesInCell; particleInd++)	// particle index
-		{				
-			SPHParticle3d& particle = particles[ (*thisCell)[particleInd] ];
-			//particle.density += particleMass;
+			block.stage( grid, low, high, [this]( int i ){ return statePosition( i ); } );
+		}
 
-			for( int otherInd=particleInd+1; otherInd < particlesInCell; otherInd++ )
-			{
-				applyDensity( particle, particles[ (*thisCell)[otherInd] ] );
-			}
-			
-			for(int gi=12; gi>=0; gi--)
+		for(int z=low.z; z<=high.z; z++)
+		{
+			for(int y=low.y; y<=high.y; y++)
 			{
-				if( mask & 0x1 ) // last bit is set
+				SPHGrid<3>::Cell row = grid.getCells( grid.indexOf( glm::ivec3( low.x, y, z ) ), grid.indexOf( glm::ivec3( high.x, y, z ) ) );
+				for(int c=0, cLen=row.size(); c<cLen; c++)
 				{
-					neighbourCell = &grid[ gridOffsets[gi]+cellIndex ];
-					for( size_t k=0, kLen = neighbourCell->size(); k<kLen; k++ )
-					{
-						applyDensity( particle, particles[ (*neighbourCell)[k] ] );
-					}
+					particleFunction( row[c], stage ? &block : (const NeighbourBlock*)0 );
 				}
-				mask >>= 1;
 			}
-			
-			applySurfaceDensity( particle );
-
-			particle.density *= particleMass;
-			particle.pressure = fluidConstantK * (particle.density - restDensity );
 		}
+	};
+	// Wrapped in std::ref so std::function does not allocate a copy of the task
+	ThreadPool::getInstance().parallelFor( grid.getBlockCount( blockSize ), std::ref( blockTask ) );
+}
+
+void SPHSystem3d::neighbourUpdate()
+{
+	if( useGrid )
+	{
+		grid.clear();
+		fillGrid();
 	}
+
+	if( !useNeighbourLists )
+	{
+		forEachParticle( stageBlocks, [this]( int i, const NeighbourBlock* block )
+		{
+			sphReal kernelSum = 1;//*restDensity;
+			forEachNeighbour( i, block, [&]( int, const glm::vec3&, float rSq )
+			{
+				kernelSum += densityKernel( rSq );
+			});
+			// The interactor keeps its density and volume
+			if( !particles[i].isInteractor ) applyDensity( i, kernelSum );
+		});
+		return;
 	}
-	}
+
+	neighbours.beginBuild( particleCount );
+	forEachParticle( stageBlocks, [this]( int i, const NeighbourBlock* block )
+	{
+		int count = 0;
+		forEachNeighbour( i, block, [&count]( int, const glm::vec3&, float ){ count++; } );
+		neighbours.setCount( i, count );
+	});
+	neighbours.allocate();
+	forEachParticle( stageBlocks, [this]( int i, const NeighbourBlock* block )
+	{
+		sphReal kernelSum = 1;//*restDensity;
+		int* indices = neighbours.getNeighbours( i );
+		float* distances = neighbours.getDistances( i );
+		int n = 0;
+		forEachNeighbour( i, block, [&]( int otherIndex, const glm::vec3&, float rSq )
+		{
+			kernelSum += densityKernel( rSq );
+			indices[n] = otherIndex;
+			if( distances ) distances[n] = sqrtf( rSq );
+			n++;
+		});
+		// The interactor keeps its density and volume
+		if( !particles[i].isInteractor ) applyDensity( i, kernelSum );
+	});
 }
 
-void SPHSystem3d::densityUpdate()
-{	
-	for(int i=0; i<particleCount; i++)
-	{		
-		SPHParticle3d& particle = particles[i];
-		if (particle.isInteractor)
-			continue;
-			
-		// particle - particle 
-		//particles[i].density = particleMass;	// this creates problems, without it it is even worse
-		particle.density += 1;//*restDensity;
-		for(int j=i+1; j<particleCount; j++)
-		{
-			applyDensity( particle, particles[j] );
-		}
+// Leapfrog step with velocity damping, Vec is the vector type the state is integrated in.
+template<class Vec>
+static void leapfrog( Vec& position, Vec& velocity, const glm::vec3& oldAcceleration, const glm::vec3& acceleration, float dt )
+{
+	typedef typename Vec::value_type Real;
+	Vec newVelocity = velocity * Real( powf(0.9f,dt) );
+	position += newVelocity * /**/ Real( dt ) + Vec( oldAcceleration ) * Real( 0.5f*dt*dt );
 
-		//applySurfaceDensity( particles[i] );
-		particle.volume = 1.0f/particle.density;
-		particle.density *= particleMass;
-		particle.pressure = fluidConstantK * ( particle.density - restDensity )/restDensity;
-	}
+	velocity = newVelocity /**/ + Vec( acceleration + oldAcceleration ) * Real( 0.5f*dt );
 }
 
 void SPHSystem3d::animate( float dt )
 {
 	if(!particleCount) return;
-	pairs.clear();
+	bool countingBefore = AllocationCounter::isThreadCounting();
+	AllocationCounter::setThreadCounting( true );
+	unsigned long long allocationsBefore = AllocationCounter::getCount();
+	updateParticleOrder();
 
 	for(int i=0; i<particleCount; i++)
 	{
@@ -546,18 +569,13 @@ void SPHSystem3d::animate( float dt )
 	}
 	glm::vec3 rvec;
 
-	bool useGrid = false;
-	
-	if(useGrid)
-		gridDensityUpdate(); 
-	else
-		densityUpdate();
+	neighbourUpdate();
 
-	// Visit pairs
-	for(size_t i=0, iLen = pairs.size(); i<iLen; i++)
+	// Visit neighbours, every particle only writes to itself. The lists need no staged positions.
+	forEachParticle( stageBlocks && !useNeighbourLists, [this]( int i, const NeighbourBlock* block )
 	{
-		applyForces( pairs[i].first, pairs[i].second, pairs[i].rvec );
-	}/**/
+		applyForces( i, block );
+	});
 
 	// calculating pressure and viscosity forces
 	/*int neighboursCount;
@@ -577,10 +595,7 @@ void SPHSystem3d::animate( float dt )
 	
 	glm::vec3 acceleration;
 	glm::vec3 oldPosition;
-	glm::vec3 newVelocity;
 
-	if(useGrid)
-		clearGrid( );	
 	bool wasOK;
 	float cftsq = colorFieldTreshold*colorFieldTreshold;
 	for(int i=0; i<particleCount; i++)
@@ -594,7 +609,7 @@ void SPHSystem3d::animate( float dt )
 			cout << "0";
 		}
 
-		// this is not done since pairs mechanism is used
+		// this is not done in the neighbour pass
 		applySurfaceForces( particle );	
 
 		if(wasOK != ( _isnan(particle.force.x) == 0 ) )	
@@ -641,10 +656,17 @@ void SPHSystem3d::animate( float dt )
 		}
 
 		oldPosition = particle.position;	
-		newVelocity = particle.velocity * powf(0.9f,dt);
-		particle.position += newVelocity * /**/ dt + particle.oldAcceleration * ( 0.5f*dt*dt );
-
-		particle.velocity = newVelocity /**/ + (acceleration + particle.oldAcceleration) * ( 0.5f*dt );
+		if( SPH_PRECISE_STATE )
+		{
+			syncPreciseState( i );
+			leapfrog( precisePositions[i], preciseVelocities[i], particle.oldAcceleration, acceleration, dt );
+			particle.position = glm::vec3( precisePositions[i] );
+			particle.velocity = glm::vec3( preciseVelocities[i] );
+		}
+		else
+		{
+			leapfrog( particle.position, particle.velocity, particle.oldAcceleration, acceleration, dt );
+		}
 		particle.oldAcceleration = acceleration;
 
 		//particle.position.containWithin( glm::vec3(0,0,0), glm::vec3( dWidth, dHeight, dDepth ));
@@ -668,8 +690,157 @@ void SPHSystem3d::animate( float dt )
 		}
 						
 		
-		if(useGrid) putParticleIntoGrid( i );
+		if( SPH_PRECISE_STATE ) syncPreciseState( i );
 	}	
+	stepAllocations = (int)( AllocationCounter::getCount() - allocationsBefore );
+	AllocationCounter::setThreadCounting( countingBefore );
+	checkStepAllocations();
+}
+
+void SPHSystem3d::checkStepAllocations()
+{
+	if( !AllocationCounter::isCounting() ) return;
+	if( particleCount != warmupParticleCount )
+	{
+		warmupParticleCount = particleCount;
+		warmupSteps = 0;
+	}
+	warmupSteps++;
+
+	if( stepAllocations > 0 && warmupSteps > ALLOCATION_WARMUP_STEPS && warmupSteps > reorderInterval + 1 )
+	{
+		cout << "step allocated " << stepAllocations << " times after warm-up (" << warmupSteps
+			 << " steps with " << particleCount << " particles)" << endl;
+	}
+}
+
+// Interleaves the lower 10 bits of x with two zero bits each.
+static unsigned int spreadBits( unsigned int x )
+{
+	x &= 0x3ff;
+	x = ( x | ( x << 16 ) ) & 0x030000ff;
+	x = ( x | ( x << 8 ) ) & 0x0300f00f;
+	x = ( x | ( x << 4 ) ) & 0x030c30c3;
+	x = ( x | ( x << 2 ) ) & 0x09249249;
+	return x;
+}
+
+void SPHSystem3d::updateParticleOrder()
+{
+	if( reorderInterval <= 0 && reorderLocality <= 0 ) return;
+
+	// The neighbour lists still hold the previous step
+	bool degraded = false;
+	if( stepsSinceReorder > 0 && reorderLocality > 0 && !neighbours.empty() )
+	{
+		float locality = getPairLocality();
+		if( stepsSinceReorder == 1 )
+		{
+			sortedLocality = locality;
+		}
+		degraded = locality > reorderLocality*sortedLocality;
+	}
+	bool due = reorderInterval > 0 && stepsSinceReorder >= reorderInterval;
+
+	if( degraded || due )
+	{
+		reorderParticles();
+	}
+	stepsSinceReorder++;
+}
+
+float SPHSystem3d::getPairLocality()
+{
+	double spanSum = 0;
+	for(int i=0; i<neighbours.getParticleCount(); i++)
+	{
+		for(int k=neighbours.begin( i ), kEnd=neighbours.end( i ); k<kEnd; k++)
+		{
+			spanSum += glm::abs( neighbours.getNeighbour( k ) - i );
+		}
+	}
+	return (float)( spanSum / neighbours.getEntryCount() );
+}
+
+void SPHSystem3d::reorderParticles()
+{
+	stepsSinceReorder = 0;
+	if( particleCount < 2 ) return;
+
+	// 10 bits per axis over the domain
+	glm::vec3 scale = glm::vec3( 1023.0f ) / glm::vec3( dWidth, dHeight, dDepth );
+	sortKeys.resize( particleCount );
+	for(int i=0; i<particleCount; i++)
+	{
+		glm::ivec3 q = glm::clamp( glm::ivec3( particles[i].position * scale ), glm::ivec3( 0 ), glm::ivec3( 1023 ) );
+		sortKeys[i] = make_pair( spreadBits( q.x ) | ( spreadBits( q.y ) << 1 ) | ( spreadBits( q.z ) << 2 ), i );
+	}
+	sort( sortKeys.begin(), sortKeys.end() );
+
+	newIndices.resize( particleCount );
+	sortedParticles.clear();
+	for(int i=0; i<particleCount; i++)
+	{
+		newIndices[ sortKeys[i].second ] = i;
+		sortedParticles.push_back( particles[ sortKeys[i].second ] );
+	}
+	particles.swap( sortedParticles );
+
+	if( SPH_PRECISE_STATE )
+	{
+		sortedState.resize( particleCount );
+		for(int i=0; i<particleCount; i++)
+		{
+			sortedState[i] = precisePositions[ sortKeys[i].second ];
+		}
+		precisePositions.swap( sortedState );
+		for(int i=0; i<particleCount; i++)
+		{
+			sortedState[i] = preciseVelocities[ sortKeys[i].second ];
+		}
+		preciseVelocities.swap( sortedState );
+	}
+
+	for(int id=0; id<particleCount; id++)
+	{
+		idToIndex[id] = newIndices[ idToIndex[id] ];
+		indexToId[ idToIndex[id] ] = id;
+	}
+	if( iteractorID != -1 )
+	{
+		iteractorID = newIndices[iteractorID];
+	}
+	grid.remap( newIndices );
+	// Neighbour lists refer to particle slots, they are rebuilt by the next step
+	neighbours.clear();
+}
+
+void SPHSystem3d::setReorderInterval( int steps )
+{
+	reorderInterval = steps < 0 ? 0 : steps;
+}
+
+int SPHSystem3d::getReorderInterval()
+{
+	return reorderInterval;
+}
+
+int SPHSystem3d::getParticleIndex( int id )
+{
+	return id > -1 && id < particleCount ? idToIndex[id] : -1;
+}
+
+void SPHSystem3d::syncPreciseState( int index )
+{
+	SPHParticle3d& particle = particles[index];
+	if( particle.position != glm::vec3( precisePositions[index] ) )
+	{
+		precisePositions[index] = sphVec3( particle.position );
+	}
+	if( particle.velocity != glm::vec3( preciseVelocities[index] ) )
+	{
+		preciseVelocities[index] = sphVec3( particle.velocity );
+	}
 }
 
 void SPHSystem3d::draw( MarchingCubes* ms )
@@ -702,42 +873,135 @@ void SPHSystem3d::draw( MarchingCubesBasic* ms )
 
 void SPHSystem3d::draw( MarchingCubesShaded* ms )
 {
-	unitRadius = sqrt(particleMass / (restDensity*PI));
-	float r ;
+	splatPositions.clear();
+	fieldWeights.clear();
 	for(int i=0; i<particleCount; i++)
 	{
 		//r = particles[i].density*10*unitRadius;
 		//r = particles[i].volume;
-		r = unitRadius;
-		if( r>smoothingLength ) r = smoothingLength;
 		if (particles[i].isInteractor) continue;
-		ms->putSphere( particles[i].position.x, particles[i].position.y, particles[i].position.z, r );
+		splatPositions.push_back( particles[i].position );
+		if( surfaceField == COLOR_FIELD )
+		{
+			// Densities of the last step, rest density before the first one
+			float density = particles[i].density > 0 ? particles[i].density : restDensity;
+			fieldWeights.push_back( particles[i].mass / density );
+		}
+		else if( surfaceField == DENSITY_FIELD )
+		{
+			fieldWeights.push_back( particles[i].mass / restDensity );
+		}
 	}
+	if( surfaceField == SPLAT_FIELD )
+		ms->putSpheres( splatPositions, getSplatRadius() );
+	else
+		ms->putParticles( splatPositions, fieldWeights, smoothingLength );
 }
 
 
 void SPHSystem3d::draw( PointDataVisualiser* pdv )
 {
-	unitRadius = sqrt(particleMass / (restDensity*PI));
-	
-	//Customize
-	unitRadius = 0.2f;
-	pdv->setPointSize( unitRadius );
-	pdv->clearBuffer();
+	pdv->setPointSize( getPointSize() );
+	if( pdv->isCulling() )
+	{
+		// Culling needs all points before it writes
+		splatPositions.resize( particleCount );
+		for(int i=0; i<particleCount; i++)
+		{
+			splatPositions[i] = particles[i].position;
+		}
+		pdv->setPoints( splatPositions.data(), particleCount );
+		return;
+	}
+	glm::vec3* points = pdv->beginPoints( particleCount );
 	for(int i=0; i<particleCount; i++)
 	{
 		//if (particles[i].isInteractor) continue;
-		pdv->pushPoint( particles[i].position );
+		points[i] = particles[i].position;
 	}
+	pdv->endPoints();
+}
+
+void SPHSystem3d::getFrame( SPHFrame& frame, bool withFields )
+{
+	// Frames list the particles by id, so recordings keep their order when particles are reordered
+	frame.interactorIndex = iteractorID == -1 ? -1 : indexToId[iteractorID];
+	frame.splatRadius = getSplatRadius();
+	frame.pointSize = getPointSize();
+	frame.positions.resize( particleCount );
+	for(int id=0; id<particleCount; id++)
+	{
+		frame.positions[id] = particles[ idToIndex[id] ].position;
+	}
+
+	if( !withFields )
+	{
+		frame.velocities.clear();
+		frame.densities.clear();
+		frame.pressures.clear();
+		return;
+	}
+
+	frame.velocities.resize( particleCount );
+	frame.densities.resize( particleCount );
+	frame.pressures.resize( particleCount );
+	for(int id=0; id<particleCount; id++)
+	{
+		const SPHParticle3d& particle = particles[ idToIndex[id] ];
+		frame.velocities[id] = particle.velocity;
+		frame.densities[id] = particle.density;
+		frame.pressures[id] = particle.pressure;
+	}
+}
+
+float SPHSystem3d::getSplatRadius()
+{
+	unitRadius = sqrt(particleMass / (restDensity*PI));
+	return unitRadius > smoothingLength ? smoothingLength : unitRadius;
+}
+
+float SPHSystem3d::getPointSize()
+{
+	//Customize
+	return 0.2f;
 }
 
 void SPHSystem3d::draw(Interactor* in)
 {
 	in->setPointSize(2);
 	in->clearBuffer();
+	if( iteractorID == -1 ) return;
 	in->pushPoint( particles[iteractorID].position + glm::vec3(-2.05,1.2,1.9));
 }
 
+SPHSystem3d::SurfaceField SPHSystem3d::parseSurfaceField( const string& name, SurfaceField fallback )
+{
+	if( name == "splat" ) return SPLAT_FIELD;
+	if( name == "color" ) return COLOR_FIELD;
+	if( name == "density" ) return DENSITY_FIELD;
+	return fallback;
+}
+
+const char* SPHSystem3d::getSurfaceFieldName( SurfaceField field )
+{
+	switch( field )
+	{
+		case COLOR_FIELD: return "color";
+		case DENSITY_FIELD: return "density";
+		default: return "splat";
+	}
+}
+
+void SPHSystem3d::setSurfaceField( SurfaceField field )
+{
+	surfaceField = field;
+}
+
+SPHSystem3d::SurfaceField SPHSystem3d::getSurfaceField()
+{
+	return surfaceField;
+}
+
 void SPHSystem3d::setUseGravity( bool value )
 {
 	useGravity = value;
@@ -748,6 +1012,60 @@ bool SPHSystem3d::usesGravity()
 	return useGravity;
 }
 
+void SPHSystem3d::setUseGrid( bool value )
+{
+	useGrid = value;
+}
+
+bool SPHSystem3d::usesGrid()
+{
+	return useGrid;
+}
+
+void SPHSystem3d::setCacheDistances( bool value )
+{
+	neighbours.setCacheDistances( value );
+}
+
+void SPHSystem3d::setUseNeighbourLists( bool value )
+{
+	useNeighbourLists = value;
+	if( !useNeighbourLists )
+	{
+		neighbours.release();
+	}
+}
+
+bool SPHSystem3d::usesNeighbourLists()
+{
+	return useNeighbourLists;
+}
+
+void SPHSystem3d::setBlockSize( int cells )
+{
+	blockSize = cells < 0 ? 0 : cells;
+}
+
+int SPHSystem3d::getBlockSize()
+{
+	return blockSize;
+}
+
+void SPHSystem3d::setStageBlocks( bool value )
+{
+	stageBlocks = value;
+}
+
+size_t SPHSystem3d::getNeighbourMemory()
+{
+	return neighbours.getMemoryUsage();
+}
+
+int SPHSystem3d::getStepAllocations()
+{
+	return stepAllocations;
+}
+
 int SPHSystem3d::getParticleCount()
 {
 	return particleCount;
@@ -756,7 +1074,13 @@ int SPHSystem3d::getParticleCount()
 void SPHSystem3d::clearAllParticles()
 {
 	particles.clear();
-	clearGrid();
+	precisePositions.clear();
+	preciseVelocities.clear();
+	idToIndex.clear();
+	indexToId.clear();
+	neighbours.clear();
+	grid.clear();
+	iteractorID = -1;
 	particleCount = 0;
 }
 
@@ -804,6 +1128,20 @@ void SPHSystem3d::setSmoothingLength( float smLen )
 	cout << "New smoothing length: " << smoothingLength << endl;		
 }
 
+void SPHSystem3d::setTabulatedKernels( bool value )
+{
+	tabulatedKernels = value;
+	if( tabulatedKernels )
+	{
+		buildKernelTables();
+	}
+}
+
+bool SPHSystem3d::usesTabulatedKernels()
+{
+	return tabulatedKernels;
+}
+
 float SPHSystem3d::getColorFieldTreshold( )
 {
 	return colorFieldTreshold;
@@ -832,6 +1170,19 @@ void SPHSystem3d::paramOutput()
 	cout << "constant K: " << fluidConstantK << endl;
 	cout << "viscosity: " << viscosityConstant << endl;
 	cout << "smoothing length: " << smoothingLength << endl;
+	cout << "precision: " << getPrecisionName() << endl;
+	cout << "neighbour lists: " << ( useNeighbourLists ? "on" : "off" ) << endl;
+	cout << "large pages: " << ( AlignedMemory::usesLargePages() ? "on" : "off" ) << ", "
+		 << AlignedMemory::getLargePageBytes() / 1024 << " kB " << AlignedMemory::getLargePageState() << ", "
+		 << AlignedMemory::getFallbackBytes() / 1024 << " kB in normal pages" << endl;
+	if( AllocationCounter::isCounting() )
+	{
+		cout << "step allocations: " << stepAllocations << endl;
+	}
+	else
+	{
+		cout << "step allocations: not counted (build with SPH_COUNT_ALLOCATIONS)" << endl;
+	}
 }
 
 void SPHSystem3d::adjustSmoothingLength( float h )
@@ -854,5 +1205,29 @@ void SPHSystem3d::adjustSmoothingLength( float h )
 	kvlaplacianFactor = 45 / ( PI * pow( h, 6 ) );
 
 	hSquared = h*h;
+	if( tabulatedKernels )
+	{
+		buildKernelTables();
+	}
 	createGrid();
 }
+
+// Samples the kernels used by densityKernel, pressureGradient and viscosityLaplacian for the
+// current smoothing length, every table has to stay within KernelTable::getErrorBound.
+bool SPHSystem3d::buildKernelTables()
+{
+	float h = smoothingLength;
+	bool valid = kp6baseTable.build( [this]( float rSq ){ return kp6base( rSq ); }, hSquared, tableSize );
+	valid = ksgradientTable.build( [this, h]( float rSq ){ float d = h - sqrtf( rSq ); return ksgradientFactor * d*d; }, hSquared, tableSize ) && valid;
+	valid = kvlaplacianTable.build( [this]( float rSq ){ return kvlaplacian( sqrtf( rSq ) ); }, hSquared, tableSize ) && valid;
+
+	if( !valid )
+	{
+		cout << "Kernel tables of " << tableSize << " samples exceed the relative error bound "
+			 << KernelTable::getErrorBound( tableSize ) << " (poly6 " << kp6baseTable.getMaxError()
+			 << ", spiky gradient " << ksgradientTable.getMaxError() << ", viscosity laplacian "
+			 << kvlaplacianTable.getMaxError() << "), using the analytic kernels" << endl;
+		tabulatedKernels = false;
+	}
+	return valid;
+}
@@ -4,8 +4,14 @@
 
 #include "SPHParticle3d.h"
 #include "SmoothingKernels.h"
+#include "KernelTable.h"
+#include "SPHGrid.h"
+#include "SPHNeighbourList.h"
+#include "SPHGridBlock.h"
+#include "AlignedAllocator.h"
 #include <vector>
 #include <memory>
+#include <string>
 #include <glm\gtx\norm.hpp>
 
 #include "Interactor.h"
@@ -16,36 +22,75 @@ class MarchingCubesBasic;
 class SPHInteractor3d;
 class PointDataVisualiser;
 class MarchingCubesShaded;
-
-struct SPHPair
-{
-	SPHPair( SPHParticle3d& f, SPHParticle3d& s, glm::vec3 r ) : first(f), second(s), rvec(r)
-	{}
-
-	SPHPair& operator=( SPHPair& other )
-	{
-		first = other.first;
-		second = other.second;
-		rvec = other.rvec;
-		return *this;
-	}
-
-	SPHParticle3d& first;
-	SPHParticle3d& second;
-	glm::vec3 rvec;	
-};
+struct SPHFrame;
 
 class SPHSystem3d
 {
-	std::vector<SPHParticle3d> particles;
+public:
+	// What draw( MarchingCubesShaded* ) puts into the grid: spheres of the splat radius, the color
+	// field (sum of m/density_j W) or the density normalised by the rest density.
+	enum SurfaceField { SPLAT_FIELD, COLOR_FIELD, DENSITY_FIELD };
+
+	// "splat", "color" or "density", anything else gives the fallback.
+	static SurfaceField parseSurfaceField( const std::string& name, SurfaceField fallback = SPLAT_FIELD );
+	static const char* getSurfaceFieldName( SurfaceField field );
+
+private:
+	// Particle arrays are AlignedMemory blocks, in large pages if the "largePages" setting asks
+	// for them and the system grants them.
+	AlignedVector<SPHParticle3d> particles;
+	// Double state of mixed precision builds (see SPHPrecision.h), empty otherwise. The position
+	// and velocity of the particles are rounded copies.
+	AlignedVector<sphVec3> precisePositions;
+	AlignedVector<sphVec3> preciseVelocities;
+
+	// Particles are put into Morton (Z) order of their positions every reorderInterval steps, or
+	// earlier when the locality (mean index distance of the pairs of a step) grows beyond
+	// reorderLocality times its value right after the last reorder. Zero disables either.
+	// Particle ids are the insertion order, the maps are kept up to date by reorderParticles.
+	int reorderInterval;
+	float reorderLocality;
+	int stepsSinceReorder;
+	float sortedLocality;		// Locality of the first step after the last reorder
+	std::vector<int> idToIndex;
+	std::vector<int> indexToId;
+	std::vector< std::pair<unsigned int, int> > sortKeys;
+	std::vector<int> newIndices;
+	AlignedVector<SPHParticle3d> sortedParticles;
+	AlignedVector<sphVec3> sortedState;
+
+	// Reorders when the interval or the locality of the last step ask for it.
+	void updateParticleOrder();
+	// Mean index distance of the neighbour lists.
+	float getPairLocality();
 	
-	std::vector< std::vector< int > > grid;
-	int gridOffsets[13];
-	int gridWidth;
-	int gridHeight;
-	int gridDepth;
-
-	std::vector< SPHPair > pairs;
+	// Neighbours are searched in the grid (cells of the smoothing length, rebuilt every step) or,
+	// without it, among all particles. The lists of a step are used by the force pass and hold
+	// both particles of every pair. Without neighbour lists (low memory mode) the force pass
+	// searches the neighbours again, which trades a second search for the memory of the lists
+	// (and disables the locality trigger of the reordering).
+	bool useGrid;
+	bool useNeighbourLists;
+	SPHGrid<3> grid;
+	SPHNeighbourList neighbours;
+
+	// The grid passes visit blocks of blockSize^3 cells (0 visits the particles in index order),
+	// one block per task. With stageBlocks the neighbour search of a block reads the positions
+	// from a compact copy of the block and its halo (see SPHGridBlock).
+	typedef SPHGridBlock<3, sphVec3> NeighbourBlock;
+	int blockSize;
+	bool stageBlocks;
+
+	// Heap allocations of the last step, see AllocationCounter. The buffers of a step (grid,
+	// neighbour lists, staging and reordering) keep their capacity, so once they have grown to the
+	// largest size the scene needs a step allocates nothing.
+	static const int ALLOCATION_WARMUP_STEPS = 100;
+	int stepAllocations;
+	int warmupSteps;			// Steps since the particle count changed
+	int warmupParticleCount;
+
+	// Warns about a step that allocated after the warm-up steps and the first reorder.
+	void checkStepAllocations();
 
 	std::vector<std::unique_ptr<SPHInteractor3d>> surfaces;
 	int particleCount;
@@ -63,18 +108,23 @@ class SPHSystem3d
 
 	float unitRadius;
 
+	std::vector<glm::vec3> splatPositions;	// Marching cubes drawing, interactor excluded
+	std::vector<float> fieldWeights;		// Per splat position, for the kernel fields
+	SurfaceField surfaceField;
+
 	float particleMass;
 
 	bool useGravity;
 	glm::vec3 gravityAcc;
 
-	// Updates densities for both particles and generates neighbourhood data,
-	// but only in the first particle (to avoid colisions in later calculations).
-	void applyDensity( SPHParticle3d& first, SPHParticle3d& second );
-	// Updates the forces for a given particle pair. It is asumed that the 
-	// particles are neighbours and therefore proximity check is not made.
-	void applyForces( SPHParticle3d& first, SPHParticle3d& second );
-	void applyForces( SPHParticle3d& first, SPHParticle3d& second, glm::vec3 rvec );
+	// Sets density, volume and pressure of a particle from its kernel sum (the particle itself
+	// counted as 1).
+	void applyDensity( int index, sphReal kernelSum );
+	// Adds the forces of all neighbours of the particle to it, the other particles are only read.
+	void applyForces( int index, const NeighbourBlock* block );
+	// Adds the pair terms of a neighbour to the sums of a particle, rvec points from the neighbour.
+	void addNeighbourForces( const SPHParticle3d& particle, const SPHParticle3d& other, glm::vec3 rvec, float r,
+							 glm::vec3& force, glm::vec3& colorGradient, float& colorLaplacian );
 	// Updates the density against all surfaces (SPHInteractor).
 	void applySurfaceDensity( SPHParticle3d& particle );
 	// Updates the forces against all surfaces (SPHInteractor).
@@ -85,16 +135,35 @@ class SPHSystem3d
 	void createGrid();
 	// Reposition all existing particles. Assumes the grid is clear.
 	void fillGrid();
-	// Clears all grid vectors. Used prior to fillGrid method.
-	void clearGrid();
+	// Particles outside of the domain are moved onto its border.
 	void putParticleIntoGrid( int particleIndex );
 
-	// Traversal of the grid for initial density calculation. ApplyDensity is
-	// called on valid particle pairs. This also generates neighbourhood lists!
-	void gridDensityUpdate( );
-	// Matches every particle to every other particle for density and neighbourhood
-	// update.
-	void densityUpdate();
+	// first.position - second.position, taken from the double state in mixed precision builds.
+	inline glm::vec3 separation( int first, int second )
+	{
+		if( SPH_PRECISE_STATE ) return glm::vec3( precisePositions[first] - precisePositions[second] );
+		return particles[first].position - particles[second].position;
+	}
+	// Position the separations are taken from.
+	inline sphVec3 statePosition( int index )
+	{
+		return SPH_PRECISE_STATE ? precisePositions[index] : sphVec3( particles[index].position );
+	}
+	// Mixed precision: position and velocity changes made outside of the integrator (surfaces,
+	// interactor, grid border) replace the double state.
+	void syncPreciseState( int index );
+
+	// Calls neighbourFunction( otherIndex, rvec, rSq ) for every other particle closer than the
+	// smoothing length, safe to call from several threads. The block is the staged block of the
+	// particle or null.
+	template<class NeighbourFunction>
+	void forEachNeighbour( int index, const NeighbourBlock* block, NeighbourFunction neighbourFunction );
+	// Calls particleFunction( index, block ) for every particle in parallel, block by block if
+	// they are used. block is the staged block of the particle if stage is set, null otherwise.
+	template<class ParticleFunction>
+	void forEachParticle( bool stage, ParticleFunction particleFunction );
+	// Rebuilds the grid and the neighbour lists (if used) and updates the densities, in parallel.
+	void neighbourUpdate();
 
 	float hSquared;
 	float kp6baseFactor;
@@ -107,7 +176,25 @@ class SPHSystem3d
 	float kvgradientFactor;
 	float kvlaplacianFactor;
 
+	// Optional fast-math mode: the kernels of the density and force passes are read from tables
+	// indexed by r^2 (see KernelTable), rebuilt by adjustSmoothingLength. The spiky table holds
+	// |gradient W|, which is divided by r afterwards, as |gradient W|/r itself can not be
+	// interpolated near r = 0. The poly6 gradient and laplacian are cheap polynomials in r^2 and
+	// stay analytic, so do the interactor forces, which reach beyond the smoothing length.
+	bool tabulatedKernels;
+	int tableSize;
+	KernelTable kp6baseTable;
+	KernelTable ksgradientTable;
+	KernelTable kvlaplacianTable;
+
 	void adjustSmoothingLength( float smlen );
+	// Returns false and switches back to the analytic kernels if a table misses its error bound.
+	bool buildKernelTables();
+
+	// Sphere radius used for marching cubes drawing.
+	float getSplatRadius();
+	// Point size used for point cloud drawing.
+	float getPointSize();
 
 	inline float kp6base( float rSq )
 	{
@@ -151,6 +238,20 @@ class SPHSystem3d
 		return kvlaplacianFactor * ( smoothingLength-r ) / smoothingLength; // /smoothingLength; this is not in the original kernel
 	}
 
+	// Kernels of the solver passes, r and rSq have to belong to the same rvec with rSq <= h^2.
+	inline float densityKernel( float rSq )
+	{
+		return tabulatedKernels ? kp6baseTable.get( rSq ) : kp6base( rSq );
+	}
+	inline glm::vec3 pressureGradient( glm::vec3 rvec, float r, float rSq )
+	{
+		return tabulatedKernels ? rvec*( ksgradientTable.get( rSq ) / r ) : ksgradient( rvec );
+	}
+	inline float viscosityLaplacian( float r, float rSq )
+	{
+		return tabulatedKernels ? kvlaplacianTable.get( rSq ) : kvlaplacian( r );
+	}
+
 public:
 	// Constructor with all necessary parameters and their default values. Does not include bounding surfaces.
 	SPHSystem3d( float w = 30.0f, float h = 30.0f, float d = 30.0f, float density = 0.8f, float constantK = 10.0f, float contantMi = 0.6f, 
@@ -163,6 +264,8 @@ public:
 	// neighbourhood info, applies bounding surface densities, traverses neighbours for force update, updates
 	// bounding surface forces, moves the particles with calculated forces, updates the grid.
 	void animate( float dt );
+	// Heap allocations made by the last animate, always 0 unless built with SPH_COUNT_ALLOCATIONS.
+	int getStepAllocations();
 
 	void addParticle( glm::vec3 position, glm::vec3 velocity );
 	void addDistributedParticles( glm::vec3 start, glm::vec3 direction, glm::vec3 step );
@@ -176,12 +279,41 @@ public:
 	void draw( PointDataVisualiser* pdv );
 	// TODO: alternative drawing method
 
+	// Copies the drawable state of the current step, used for recording. Velocities, densities
+	// and pressures are copied as well when withFields is set (used for exporting).
+	void getFrame( SPHFrame& frame, bool withFields = false );
+
+	void setSurfaceField( SurfaceField field );
+	SurfaceField getSurfaceField();
+
 	void setUseGravity( bool value );
 	bool usesGravity();
 
+	// Grid or all pairs neighbour search, both give the same neighbours.
+	void setUseGrid( bool value );
+	bool usesGrid();
+	// Keeps the pair distances in the neighbour lists instead of taking them again in the force pass.
+	void setCacheDistances( bool value );
+	// Switching the lists off releases their memory.
+	void setUseNeighbourLists( bool value );
+	bool usesNeighbourLists();
+	// Cells per block edge of the grid passes, 0 visits the particles in index order.
+	void setBlockSize( int cells );
+	int getBlockSize();
+	void setStageBlocks( bool value );
+	// Bytes held by the neighbour lists.
+	size_t getNeighbourMemory();
+
 	int getParticleCount();
 	void clearAllParticles();
 
+	// Sorts the particles into Morton order, fixing up the grid, the id maps and the interactor.
+	void reorderParticles();
+	void setReorderInterval( int steps );
+	int getReorderInterval();
+	// Current index of the particle added as the id-th one (the interactor included).
+	int getParticleIndex( int id );
+
 	float getRestDensity( );
 	void setRestDensity( float density );
 	
@@ -194,6 +326,10 @@ public:
 	float getSmoothingLength( );
 	void setSmoothingLength( float smLen );
 
+	// Switches the density and force passes to interpolated kernel tables.
+	void setTabulatedKernels( bool value );
+	bool usesTabulatedKernels();
+
 	float getColorFieldTreshold();
 	void setColorFieldTreshold( float cfTreshold );
 
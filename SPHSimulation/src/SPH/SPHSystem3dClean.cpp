@@ -8,6 +8,7 @@
 #include "MappedData.h"
 #include "DataLine.h"
 #include "PointDataVisualiser.h"
+#include "AllocationCounter.h"
 #include <iostream>
 #include <math.h>
 #include <glm\common.hpp>
@@ -21,8 +22,9 @@ using namespace std;
 SPHSystem3dClean::SPHSystem3dClean( float w, float h, float d, float density, float constantK, float constantMi, 
 							float cfTreshold, float surfTension,  float mass, float smLen )
 {
-	particles = vector<SPHParticleNeighbour3d>();
+	particles = vector<SPHParticle3d>();
 	particleCount = 0;
+	stepAllocations = 0;
 	
 	dWidth = w;
 	dHeight = h;
@@ -44,6 +46,8 @@ SPHSystem3dClean::SPHSystem3dClean( float w, float h, float d, float density, fl
 	kernel = KernelBuilder::getKernel( "KernelPoly6", smoothingLength );
 	pressureKernel = KernelBuilder::getKernel( "KernelPoly6", smoothingLength );
 	viscousKernel = KernelBuilder::getKernel( "KernelPoly6", smoothingLength );
+
+	grid.create( glm::vec3( dWidth, dHeight, dDepth ), smoothingLength );
 }
 
 // Creates a SPH System 3d from a mapped data file. The file must contain the following
@@ -55,8 +59,9 @@ SPHSystem3dClean::SPHSystem3dClean( float w, float h, float d, float density, fl
 SPHSystem3dClean::SPHSystem3dClean( const char* file )
 {
 	MappedData map( file );
-	particles = vector<SPHParticleNeighbour3d>();
+	particles = vector<SPHParticle3d>();
 	particleCount = 0;
+	stepAllocations = 0;
 
 	dWidth = map.getData( "grid", "width" ).get<float>();
 	dHeight = map.getData( "grid", "height" ).get<float>();
@@ -83,6 +88,8 @@ SPHSystem3dClean::SPHSystem3dClean( const char* file )
 	
 	unitRadius = sqrt( particleMass / (restDensity*PI) );
 	useGravity = true;	
+
+	grid.create( glm::vec3( dWidth, dHeight, dDepth ), smoothingLength );
 }
 
 
@@ -114,7 +121,7 @@ void SPHSystem3dClean::setKernel( SPHKernelUse kernelUse, KernelType type )
 void SPHSystem3dClean::addParticle( glm::vec3 position, glm::vec3 velocity )
 {
 	position = glm::clamp( position, glm::vec3(0,0,0), glm::vec3( dWidth, dHeight, dDepth ) );
-	particles.push_back(SPHParticleNeighbour3d( position, velocity, particleMass, restDensity ) );
+	particles.push_back(SPHParticle3d( position, velocity, particleMass, restDensity ) );
 	particleCount++;
 }
 
@@ -132,21 +139,24 @@ void SPHSystem3dClean::toggleSurface(int index)
 }
 
 
-void SPHSystem3dClean::applyDensity(SPHParticleNeighbour3d& first, SPHParticleNeighbour3d& second )
+template<class Kernels>
+bool SPHSystem3dClean::applyDensity( const Kernels& kernels, SPHParticle3d& first, SPHParticle3d& second )
 {
 	glm::vec3 rvec = first.position - second.position;
 	float r = glm::length( rvec );
 	if( r < smoothingLength )
 	{
-		float additionalDensity = particleMass * kernel->base(r);
+		float additionalDensity = particleMass * kernels.base.base(r);
 		first.density += additionalDensity;
 		second.density += additionalDensity;
-		first.neighbours.push_back( &second );
+		return true;
 	}
+	return false;
 }
 
 // NOTE: Assume this is called on neighbourhood data. No smoothing check is made.
-void SPHSystem3dClean::applyForces( SPHParticle3d& first, SPHParticle3d& second )
+template<class Kernels>
+void SPHSystem3dClean::applyForces( const Kernels& kernels, SPHParticle3d& first, SPHParticle3d& second )
 {
 	glm::vec3 rvec = (first.position - second.position);
 	float r = glm::length( rvec );
@@ -158,7 +168,7 @@ void SPHSystem3dClean::applyForces( SPHParticle3d& first, SPHParticle3d& second
 	}
 	/*
 	glm::vec3 commonPressureInfluence = 
-		pressureKernel->gradient( rvec ) * 
+		kernels.pressure.gradient( rvec ) * 
 		( 
 			particleMass * 
 			(
@@ -166,7 +176,7 @@ void SPHSystem3dClean::applyForces( SPHParticle3d& first, SPHParticle3d& second
 			) / 2.0
 		); /* unified */
 	glm::vec3 commonPressureInfluence = 
-		pressureKernel->gradient( rvec ) * 
+		kernels.pressure.gradient( rvec ) * 
 		( 
 			particleMass * 
 			(	
@@ -178,29 +188,30 @@ void SPHSystem3dClean::applyForces( SPHParticle3d& first, SPHParticle3d& second
 	// viscosity forces
 		
 	/*glm::vec3 commonViscousInfluence = (second.velocity - first.velocity) * 
-		(viscosityConstant * particleMass * viscousKernel->laplacian( r )); /* unified */
+		(viscosityConstant * particleMass * kernels.viscous.laplacian( r )); /* unified */
 	glm::vec3 commonViscousInfluence = 
 		(second.velocity - first.velocity) * 
 		(
 			viscosityConstant * particleMass * 
-			viscousKernel->laplacian( r ) / 
+			kernels.viscous.laplacian( r ) / 
 			(second.density*first.density)
 		);/* by definition */
 
 	first.force += ( commonPressureInfluence + commonViscousInfluence) / second.density;
 	second.force += (-commonPressureInfluence - commonViscousInfluence) / first.density;
 
-	glm::vec3 commonColorGradient = kernel->gradient( rvec ) * particleMass;
+	glm::vec3 commonColorGradient = kernels.base.gradient( rvec ) * particleMass;
 	first.colorGradient += commonColorGradient / second.density;
 	second.colorGradient += commonColorGradient / first.density;
 
-	float commonColorLaplacian = kernel->laplacian( r ) * particleMass;
+	float commonColorLaplacian = kernels.base.laplacian( r ) * particleMass;
 	first.colorLaplacian += commonColorLaplacian / second.density;
 	second.colorLaplacian += commonColorLaplacian / first.density;
 		
 }
 
-void SPHSystem3dClean::applySurfaceDensity( SPHParticle3d& particle )
+template<class Kernels>
+void SPHSystem3dClean::applySurfaceDensity( const Kernels& kernels, SPHParticle3d& particle )
 {
 	glm::vec3 rvec;
 	float r;
@@ -210,12 +221,13 @@ void SPHSystem3dClean::applySurfaceDensity( SPHParticle3d& particle )
 		r = glm::length( rvec );
 		if( r < smoothingLength )//smoothingLength )
 		{
-			particle.density += particleMass * kernel->base(r);
+			particle.density += particleMass * kernels.base.base(r);
 		}
 	}
 }
 
-void SPHSystem3dClean::applySurfaceForces( SPHParticle3d& particle )
+template<class Kernels>
+void SPHSystem3dClean::applySurfaceForces( const Kernels& kernels, SPHParticle3d& particle )
 {
 	glm::vec3 rvec;
 	float r;
@@ -226,48 +238,83 @@ void SPHSystem3dClean::applySurfaceForces( SPHParticle3d& particle )
 		if( r < smoothingLength )//smoothingLength )
 		{
 			// pressure
-			particle.force -= pressureKernel->gradient( rvec ) * particleMass * particle.pressure / particle.density;
+			particle.force -= kernels.pressure.gradient( rvec ) * particleMass * particle.pressure / particle.density;
 			// viscosity
-			particle.force += ( -particle.velocity ) * (viscousKernel->laplacian( r ) * viscosityConstant * particleMass / particle.density);
+			particle.force += ( -particle.velocity ) * (kernels.viscous.laplacian( r ) * viscosityConstant * particleMass / particle.density);
 		}
 	}
 }
 
+// Kernel types are resolved once per step, the pair loops call the kernels without virtual dispatch.
 void SPHSystem3dClean::animate( float dt )
 {
 	if(!particleCount) return;
 
+	bool countingBefore = AllocationCounter::isThreadCounting();
+	AllocationCounter::setThreadCounting( true );
+	unsigned long long allocationsBefore = AllocationCounter::getCount();
+	AnimateStep step = { this, dt };
+	dispatchKernels( *kernel, *pressureKernel, *viscousKernel, step );
+	stepAllocations = (int)( AllocationCounter::getCount() - allocationsBefore );
+	AllocationCounter::setThreadCounting( countingBefore );
+}
+
+int SPHSystem3dClean::getStepAllocations()
+{
+	return stepAllocations;
+}
+
+template<class Kernels>
+void SPHSystem3dClean::animateWith( float dt, const Kernels& kernels )
+{
 	for(int i=0; i<particleCount; i++)
 	{
 		particles[i].reset();
 	}
 	
 	// Calculating densities and pressures for all particles
-	// Non grid, optimization is the calculation of neighbourhood lists
+	// Grid walk, optimization is the calculation of neighbourhood lists
+	grid.clear();
 	for(int i=0; i<particleCount; i++)
-	{		
-		// particle - particle 
-		particles[i].density = particleMass;
-		for(int j=i+1; j<particleCount; j++)
+	{
+		grid.insert( i, particles[i].position );
+	}
+	grid.sort();
+	neighbourPool.clear();
+	neighbourStarts.resize( particleCount );
+	neighbourCounts.resize( particleCount );
+	int pairsStart = 0;
+	grid.forEachPair( 
+		[&]( int first, int second )
 		{
-			applyDensity( particles[i], particles[j] );
-		}
-
-		applySurfaceDensity( particles[i] );
+			if( applyDensity( kernels, particles[first], particles[second] ) )
+			{
+				neighbourPool.push_back( second );
+			}
+		},
+		[&]( int index )
+		{
+			// The pairs of a particle are visited one after another
+			neighbourStarts[index] = pairsStart;
+			neighbourCounts[index] = (int)neighbourPool.size() - pairsStart;
+			pairsStart = (int)neighbourPool.size();
 
-		particles[i].pressure = fluidConstantK * ( particles[i].density - restDensity );
-	}
+			SPHParticle3d& particle = particles[index];
+			particle.density += particleMass;
+			applySurfaceDensity( kernels, particle );
+			particle.pressure = fluidConstantK * ( particle.density - restDensity );
+		});
 
 	// calculating pressure and viscosity forces
 	for(int i=0; i<particleCount; i++)
 	{		
 		// visit all neighbours
-		for (size_t j = 0, jLen = particles[i].neighbours.size(); j<jLen; j++)
+		for (int j = neighbourStarts[i], jEnd = j + neighbourCounts[i]; j<jEnd; j++)
 		{
-			applyForces( particles[i], *(particles[i].neighbours[j]) );
+			applyForces( kernels, particles[i], particles[ neighbourPool[j] ] );
 		}
 		
-		applySurfaceForces( particles[i] );		
+		applySurfaceForces( kernels, particles[i] );		
 	}
 
 	// TODO: collisions and user interaction
@@ -419,6 +466,7 @@ void SPHSystem3dClean::setSmoothingLength( float smLen )
 	pressureKernel->adjustSmoothingLength( smoothingLength );
 	viscousKernel->adjustSmoothingLength( smoothingLength );
 	kernel->adjustSmoothingLength( smoothingLength );	
+	grid.create( glm::vec3( dWidth, dHeight, dDepth ), smoothingLength );
 }
 
 float SPHSystem3dClean::getColorFieldTreshold( )
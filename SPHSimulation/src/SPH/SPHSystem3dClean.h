@@ -4,6 +4,7 @@
 
 #include "SPHParticle3d.h"
 #include "SmoothingKernels.h"
+#include "SPHGrid.h"
 #include <vector>
 #include <memory>
 
@@ -13,26 +14,23 @@ class SPHInteractor3d;
 class PointDataVisualiser;
 
 
-struct SPHParticleNeighbour3d : SPHParticle3d
-{
-	using SPHParticle3d::SPHParticle3d;
-
-	std::vector<SPHParticleNeighbour3d*> neighbours;
-
-	void reset() 
-	{
-		SPHParticle3d::reset();
-		neighbours.clear();
-	}
-};
-
 // This is the first and basic implementation. It has many weak and slow points.
 // Replaced by SPHSystem3d.
 class SPHSystem3dClean
 {
-	std::vector<SPHParticleNeighbour3d> particles;
+	std::vector<SPHParticle3d> particles;
 	int particleCount;
 
+	SPHGrid<3> grid;	// Rebuilt at the start of every step
+
+	// Neighbourhood data of a step: the neighbours of particle i (the second particles of its
+	// pairs) are neighbourPool[ neighbourStarts[i] ] on, neighbourCounts[i] of them. The vectors
+	// keep their capacity, a step only allocates if it finds more pairs than any before.
+	std::vector<int> neighbourPool;
+	std::vector<int> neighbourStarts;
+	std::vector<int> neighbourCounts;
+	int stepAllocations;
+
 	std::vector<std::unique_ptr<SPHInteractor3d>> surfaces;
 
 	float dWidth;
@@ -57,16 +55,34 @@ class SPHSystem3dClean
 	iKernel::unique pressureKernel;
 	iKernel::unique viscousKernel;	
 
-	// Updates densities for both particles and generates neighbourhood data,
-	// but only in the first particle (to avoid colisions in later calculations).
-	void applyDensity(SPHParticleNeighbour3d& first, SPHParticleNeighbour3d& second );
+	// Updates densities for both particles, returns true if they are neighbours. The
+	// neighbourhood data is kept for the first particle only (to avoid colisions in later calculations).
+	template<class Kernels>
+	bool applyDensity( const Kernels& kernels, SPHParticle3d& first, SPHParticle3d& second );
 	// Updates the forces for a given particle pair. It is asumed that the 
 	// particles are neighbours and therefore proximity check is not made.
-	void applyForces( SPHParticle3d& first, SPHParticle3d& second );
+	template<class Kernels>
+	void applyForces( const Kernels& kernels, SPHParticle3d& first, SPHParticle3d& second );
 	// Updates the density against all surfaces (SPHInteractor).
-	void applySurfaceDensity( SPHParticle3d& particle );
+	template<class Kernels>
+	void applySurfaceDensity( const Kernels& kernels, SPHParticle3d& particle );
 	// Updates the forces against all surfaces (SPHInteractor).
-	void applySurfaceForces( SPHParticle3d& particle );
+	template<class Kernels>
+	void applySurfaceForces( const Kernels& kernels, SPHParticle3d& particle );
+
+	// Forwards the concrete kernel types chosen by dispatchKernels to animateWith.
+	struct AnimateStep
+	{
+		SPHSystem3dClean* system;
+		float dt;
+
+		template<class Kernels>
+		void operator()( const Kernels& kernels ) { system->animateWith( dt, kernels ); }
+	};
+
+	// The step of animate with the kernels resolved at compile time.
+	template<class Kernels>
+	void animateWith( float dt, const Kernels& kernels );
 	
 public:
 	// Constructor with all necessary parameters and their default values. Does not include bounding surfaces.
@@ -80,6 +96,8 @@ public:
 	// neighbourhood info, applies bounding surface densities, traverses neighbours for force update, updates
 	// bounding surface forces, moves the particles with calculated forces, updates the grid.
 	void animate( float dt );
+	// Heap allocations made by the last animate, always 0 unless built with SPH_COUNT_ALLOCATIONS.
+	int getStepAllocations();
 
 	void setKernel( SPHKernelUse kernelUse, KernelType type );
 
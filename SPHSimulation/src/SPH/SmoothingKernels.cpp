@@ -46,66 +46,17 @@ KernelPoly6::KernelPoly6( float h )
 	adjustSmoothingLength( h );
 }
 
-inline void KernelPoly6::adjustSmoothingLength( float h )
+void KernelPoly6::adjustSmoothingLength( float h )
 {
 	this->h = h;
 	baseFactor = 315.0f / (64 * PI * pow( h, 9 ));
 	// CHECK
 	// this gives a negative gradient graph, in Muller the graph is positive...
 	gradientFactor = 6.0f*baseFactor;// -6*315 / (64 * PI * pow( h, 9 ) );
-	laplacianFactor = 24.0f*baseFactor;//24*315 / (64 * PI * pow( h, 9 ) );
+	laplacianFactor = 24.0f*baseFactor/(3*PI);//24*315 / (64 * PI * pow( h, 9 ) ), 3PI is experimental constant
 	hSquared = h*h;
 }
 
-inline float KernelPoly6::base( float r )
-{
-	r = abs(r);
-	if( r < h )
-	{
-		return baseFactor * ( pow(hSquared - r*r, 3) );
-	}else
-	{
-		return 0.0;
-	}
-}
-
-inline glm::vec2 KernelPoly6::gradient( glm::vec2 rvec )
-{
-	
-	float rSq = glm::dot(rvec, rvec);
-	if( rSq >= 0 && rSq < hSquared )
-	{
-		return rvec*( gradientFactor*pow(hSquared - rSq, 2) );
-	}else
-	{
-		return glm::vec2(0,0);
-	}
-}
-
-inline glm::vec3 KernelPoly6::gradient( glm::vec3 rvec )
-{
-	float rSq = glm::dot(rvec, rvec);
-	if( rSq >= 0 && rSq < hSquared )
-	{
-		return rvec*( gradientFactor*pow(hSquared - rSq, 2) );
-	}else
-	{
-		return glm::vec3(0,0,0);
-	}
-}
-
-inline float KernelPoly6::laplacian( float r )
-{
-	float rSq = r*r;
-	if( rSq >= 0 && rSq < hSquared )
-	{
-		return laplacianFactor * (hSquared - rSq) * ( -0.75f*(hSquared - rSq) + rSq )/(3*PI); // 3PI is experimental constant
-	}else
-	{
-		return 0.0;
-	}
-}
-
 /****************
  * Kernel Spiky *
  ****************/
@@ -115,7 +66,7 @@ KernelSpiky::KernelSpiky( float h )
 	adjustSmoothingLength( h );
 }
 
-inline void KernelSpiky::adjustSmoothingLength( float h )
+void KernelSpiky::adjustSmoothingLength( float h )
 {
 	this->h = h;
 	baseFactor = 15.0f / ( PI * pow( h, 6 ) );
@@ -123,57 +74,6 @@ inline void KernelSpiky::adjustSmoothingLength( float h )
 	laplacianFactor = -6 * baseFactor;// 90 / ( PI * pow( h, 6 ) );
 }
 
-inline float KernelSpiky::base( float r )
-{
-	r = abs(r);
-	if( r < h )
-	{
-		return baseFactor * pow(h-r, 3);
-	}else
-	{
-		return 0.0;
-	}
-}
-
-inline glm::vec2 KernelSpiky::gradient( glm::vec2 rvec )
-{
-	float rSq = glm::dot(rvec, rvec);
-	if( rSq < h*h )
-	{
-		rSq = sqrtf(rSq);
-		return rvec *( gradientFactor * pow(h-rSq, 2) / rSq );
-	}else
-	{
-		return glm::vec2();
-	}
-}
-
-inline glm::vec3 KernelSpiky::gradient( glm::vec3 rvec )
-{
-	float rSq = glm::dot(rvec, rvec);
-	if( rSq < h*h )
-	{
-		rSq = sqrtf(rSq);
-		return rvec *( gradientFactor * pow(h-rSq, 2) / rSq );
-	}else
-	{
-		return glm::vec3();
-	}
-}
-
-inline float KernelSpiky::laplacian( float r )
-{
-	r = abs(r);
-	if( r < h )
-	{
-		if( r<0.0001f ) r = 0.0001f;
-		return laplacianFactor *(h*h/r-3*h+2*r);
-	}else
-	{
-		return 0.0f;
-	}
-}
-
 /********************
  * Kernel Viscosity *
  ********************/
@@ -182,7 +82,7 @@ KernelViscosity::KernelViscosity( float h )
 	adjustSmoothingLength( h );
 }
 
-inline void KernelViscosity::adjustSmoothingLength( float h )
+void KernelViscosity::adjustSmoothingLength( float h )
 {
 	this->h = h;
 	baseFactor = 15 / ( 2 * PI * pow( h, 3 ) );
@@ -190,54 +90,6 @@ inline void KernelViscosity::adjustSmoothingLength( float h )
 	laplacianFactor = 45 / ( PI * pow( h, 6 ) );
 }
 
-inline float KernelViscosity::base( float r )
-{
-	r = abs(r);
-	if( r < h )
-	{
-		float rh = r/h;
-		return baseFactor * ( -(rh*rh*rh/2) + rh*rh + 1/(rh*2) - 1  );
-	}else
-	{
-		return 0.0;
-	}
-}
-
-inline glm::vec2 KernelViscosity::gradient( glm::vec2 rvec )
-{
-	float r = glm::length(rvec);
-	if( r > -h && r < h )
-	{
-		return  rvec*(( gradientFactor * ( -(3*r*r/(2*h*h*h)) + 2*r/(h*h) - h/(2*r*r)  ) )/r);
-	}else
-	{
-		return glm::vec2();
-	}
-}
-
-inline glm::vec3 KernelViscosity::gradient( glm::vec3 rvec )
-{
-	float r = glm::length(rvec);
-	if( r > -h && r < h )
-	{
-		return  rvec*(( gradientFactor * ( -(3*r*r/(2*h*h*h)) + 2*r/(h*h) - h/(2*r*r)  ) )/r);
-	}else
-	{
-		return glm::vec3();
-	}
-}
-
-inline float KernelViscosity::laplacian( float r )
-{
-	r = abs(r);
-	if( r > -h && r < h )
-	{
-		return laplacianFactor * ( h-r )/h;
-	}else
-	{
-		return 0.0;
-	}
-}
 /*
 float KernelSplineGaussian::base( float h, float r )
 {
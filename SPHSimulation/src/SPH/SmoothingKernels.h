@@ -5,6 +5,9 @@
 #include "GlmVec.h"
 #include <string>
 #include <memory>
+#include <glm\common.hpp>
+#include <glm\exponential.hpp>
+#include <glm\geometric.hpp>
 
 enum KernelType
 {
@@ -32,14 +35,19 @@ protected:
 public:
 	typedef std::unique_ptr<iKernel> unique;
 
+	virtual ~iKernel() {}
+
 	virtual float base( float r )=0;
 	virtual glm::vec2 gradient( glm::vec2 r )=0;
 	virtual glm::vec3 gradient( glm::vec3 r )=0;
 	virtual float laplacian( float r )=0;
 	virtual void  adjustSmoothingLength( float h )=0;
+	virtual KernelType getType() const=0;
 };
 
-class KernelPoly6 : public iKernel
+// The kernels are final and their evaluation is defined inline below, so calls made through
+// the concrete type (see dispatchKernels) are resolved at compile time and can be inlined.
+class KernelPoly6 final : public iKernel
 {	
 	float hSquared;
 
@@ -51,9 +59,10 @@ public:
 	glm::vec3 gradient( glm::vec3 r );
 	float laplacian( float r );
 	void  adjustSmoothingLength( float h );
+	KernelType getType() const { return POLY6; }
 };
 
-class KernelSpiky : public iKernel
+class KernelSpiky final : public iKernel
 {
 public:
 	KernelSpiky( float smoothingLength );
@@ -63,9 +72,10 @@ public:
 	glm::vec3 gradient( glm::vec3 r );
 	float laplacian( float r );
 	void  adjustSmoothingLength( float h );
+	KernelType getType() const { return SPIKY; }
 };
 
-class KernelViscosity : public iKernel
+class KernelViscosity final : public iKernel
 {
 public:
 	KernelViscosity( float smoothingLength );
@@ -75,8 +85,77 @@ public:
 	glm::vec3 gradient( glm::vec3 r );
 	float laplacian( float r );
 	void  adjustSmoothingLength( float h );
+	KernelType getType() const { return VISCOSITY; }
 };
 
+/*
+	Kernel triple with the concrete kernel types of a solver step. Solvers template their pair
+	loops on it, so the kernels chosen at runtime cost no virtual call per particle pair.
+*/
+template<class Base, class Pressure, class Viscous>
+struct KernelSet
+{
+	Base& base;
+	Pressure& pressure;
+	Viscous& viscous;
+};
+
+namespace KernelDispatch
+{
+	template<class Base, class Pressure, class Function>
+	void withViscous( Base& base, Pressure& pressure, iKernel& viscous, Function& function )
+	{
+		switch( viscous.getType() )
+		{
+		case SPIKY:
+			function( KernelSet<Base, Pressure, KernelSpiky>{ base, pressure, static_cast<KernelSpiky&>( viscous ) } );
+			break;
+		case VISCOSITY:
+			function( KernelSet<Base, Pressure, KernelViscosity>{ base, pressure, static_cast<KernelViscosity&>( viscous ) } );
+			break;
+		default:
+			function( KernelSet<Base, Pressure, KernelPoly6>{ base, pressure, static_cast<KernelPoly6&>( viscous ) } );
+			break;
+		}
+	}
+
+	template<class Base, class Function>
+	void withPressure( Base& base, iKernel& pressure, iKernel& viscous, Function& function )
+	{
+		switch( pressure.getType() )
+		{
+		case SPIKY:
+			withViscous( base, static_cast<KernelSpiky&>( pressure ), viscous, function );
+			break;
+		case VISCOSITY:
+			withViscous( base, static_cast<KernelViscosity&>( pressure ), viscous, function );
+			break;
+		default:
+			withViscous( base, static_cast<KernelPoly6&>( pressure ), viscous, function );
+			break;
+		}
+	}
+}
+
+// Calls function( KernelSet<...> ) with the concrete types of the three kernels. Meant to be
+// called once per step, every kernel combination instantiates the templated step once.
+template<class Function>
+void dispatchKernels( iKernel& base, iKernel& pressure, iKernel& viscous, Function& function )
+{
+	switch( base.getType() )
+	{
+	case SPIKY:
+		KernelDispatch::withPressure( static_cast<KernelSpiky&>( base ), pressure, viscous, function );
+		break;
+	case VISCOSITY:
+		KernelDispatch::withPressure( static_cast<KernelViscosity&>( base ), pressure, viscous, function );
+		break;
+	default:
+		KernelDispatch::withPressure( static_cast<KernelPoly6&>( base ), pressure, viscous, function );
+		break;
+	}
+}
+
 class KernelBuilder
 {
 public:
@@ -84,4 +163,160 @@ public:
 	static iKernel::unique getKernel( KernelType type, float smoothingLength );
 };
 
+/*********************
+ * Kernel evaluation *
+ *********************/
+
+inline float KernelPoly6::base( float r )
+{
+	r = glm::abs(r);
+	if( r < h )
+	{
+		float d = hSquared - r*r;
+		return baseFactor * d*d*d;
+	}else
+	{
+		return 0.0;
+	}
+}
+
+inline glm::vec2 KernelPoly6::gradient( glm::vec2 rvec )
+{
+	float rSq = glm::dot(rvec, rvec);
+	if( rSq >= 0 && rSq < hSquared )
+	{
+		float d = hSquared - rSq;
+		return rvec*( gradientFactor*d*d );
+	}else
+	{
+		return glm::vec2(0,0);
+	}
+}
+
+inline glm::vec3 KernelPoly6::gradient( glm::vec3 rvec )
+{
+	float rSq = glm::dot(rvec, rvec);
+	if( rSq >= 0 && rSq < hSquared )
+	{
+		float d = hSquared - rSq;
+		return rvec*( gradientFactor*d*d );
+	}else
+	{
+		return glm::vec3(0,0,0);
+	}
+}
+
+inline float KernelPoly6::laplacian( float r )
+{
+	float rSq = r*r;
+	if( rSq >= 0 && rSq < hSquared )
+	{
+		return laplacianFactor * (hSquared - rSq) * ( -0.75f*(hSquared - rSq) + rSq );
+	}else
+	{
+		return 0.0;
+	}
+}
+
+inline float KernelSpiky::base( float r )
+{
+	r = glm::abs(r);
+	if( r < h )
+	{
+		float d = h-r;
+		return baseFactor * d*d*d;
+	}else
+	{
+		return 0.0;
+	}
+}
+
+inline glm::vec2 KernelSpiky::gradient( glm::vec2 rvec )
+{
+	float rSq = glm::dot(rvec, rvec);
+	if( rSq < h*h )
+	{
+		float r = glm::sqrt(rSq);
+		return rvec *( gradientFactor * (h-r)*(h-r) / r );
+	}else
+	{
+		return glm::vec2();
+	}
+}
+
+inline glm::vec3 KernelSpiky::gradient( glm::vec3 rvec )
+{
+	float rSq = glm::dot(rvec, rvec);
+	if( rSq < h*h )
+	{
+		float r = glm::sqrt(rSq);
+		return rvec *( gradientFactor * (h-r)*(h-r) / r );
+	}else
+	{
+		return glm::vec3();
+	}
+}
+
+inline float KernelSpiky::laplacian( float r )
+{
+	r = glm::abs(r);
+	if( r < h )
+	{
+		if( r<0.0001f ) r = 0.0001f;
+		return laplacianFactor *(h*h/r-3*h+2*r);
+	}else
+	{
+		return 0.0f;
+	}
+}
+
+inline float KernelViscosity::base( float r )
+{
+	r = glm::abs(r);
+	if( r < h )
+	{
+		float rh = r/h;
+		return baseFactor * ( -(rh*rh*rh/2) + rh*rh + 1/(rh*2) - 1  );
+	}else
+	{
+		return 0.0;
+	}
+}
+
+inline glm::vec2 KernelViscosity::gradient( glm::vec2 rvec )
+{
+	float r = glm::length(rvec);
+	if( r > -h && r < h )
+	{
+		return  rvec*(( gradientFactor * ( -(3*r*r/(2*h*h*h)) + 2*r/(h*h) - h/(2*r*r)  ) )/r);
+	}else
+	{
+		return glm::vec2();
+	}
+}
+
+inline glm::vec3 KernelViscosity::gradient( glm::vec3 rvec )
+{
+	float r = glm::length(rvec);
+	if( r > -h && r < h )
+	{
+		return  rvec*(( gradientFactor * ( -(3*r*r/(2*h*h*h)) + 2*r/(h*h) - h/(2*r*r)  ) )/r);
+	}else
+	{
+		return glm::vec3();
+	}
+}
+
+inline float KernelViscosity::laplacian( float r )
+{
+	r = glm::abs(r);
+	if( r > -h && r < h )
+	{
+		return laplacianFactor * ( h-r )/h;
+	}else
+	{
+		return 0.0;
+	}
+}
+
 #endif
\ No newline at end of file
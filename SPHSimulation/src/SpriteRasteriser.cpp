@@ -0,0 +1,238 @@
+#include "SpriteRasteriser.h"
+#include "ThreadPool.h"
+#include "Utility.h"
+#include "lodepng.h"
+#include <glm\common.hpp>
+#include <iostream>
+#include <cmath>
+
+using namespace std;
+
+static const int PROJECT_CHUNK = 4096;
+
+// Pixels whose centers lie inside the rect, clamped to the image. Returns false if there are none.
+static bool getPixelRange( float x0, float y0, float x1, float y1, int width, int height, int& px0, int& py0, int& px1, int& py1 )
+{
+	px0 = glm::max( (int)ceil( x0 - 0.5f ), 0 );
+	py0 = glm::max( (int)ceil( y0 - 0.5f ), 0 );
+	px1 = glm::min( (int)ceil( x1 - 0.5f ) - 1, width - 1 );
+	py1 = glm::min( (int)ceil( y1 - 0.5f ) - 1, height - 1 );
+	return px0 <= px1 && py0 <= py1;
+}
+
+SpriteRasteriser::SpriteRasteriser( const char* spriteFile ) :
+	spriteWidth(0), spriteHeight(0), contentMin(0, 0), contentMax(-1, -1), width(0), height(0), tilesX(0), tilesY(0)
+{
+	vector<unsigned char> image;
+	unsigned w, h;
+	unsigned error = lodepng::decode( image, w, h, spriteFile );
+	if( error != 0 )
+	{
+		cout << "SpriteRasteriser: could not load " << spriteFile << ": " << lodepng_error_text( error ) << endl;
+		return;
+	}
+
+	// Same power of two padding as TextureManager, texture coordinates span the padded image
+	spriteWidth = (int)nextPOT( w );
+	spriteHeight = (int)nextPOT( h );
+	sprite.assign( spriteWidth*spriteHeight*3, 0.0f );
+	contentMin = glm::ivec2( spriteWidth, spriteHeight );
+	contentMax = glm::ivec2( -1, -1 );
+	for(unsigned y=0; y<h; y++)
+	{
+		for(unsigned x=0; x<w; x++)
+		{
+			const unsigned char* texel = &image[ (y*w + x)*4 ];
+			for(int c=0; c<3; c++)
+			{
+				sprite[ (y*spriteWidth + x)*3 + c ] = texel[c] / 255.0f;
+			}
+			if( texel[0] || texel[1] || texel[2] )
+			{
+				contentMin = glm::min( contentMin, glm::ivec2( x, y ) );
+				contentMax = glm::max( contentMax, glm::ivec2( x, y ) );
+			}
+		}
+	}
+	if( contentMax.x < 0 )
+	{
+		cout << "SpriteRasteriser: " << spriteFile << " is black, nothing will be drawn" << endl;
+	}
+}
+
+bool SpriteRasteriser::isLoaded() const
+{
+	return !sprite.empty();
+}
+
+void SpriteRasteriser::setResolution( int width, int height )
+{
+	this->width = glm::max( width, 1 );
+	this->height = glm::max( height, 1 );
+	tilesX = ( this->width + TILE_SIZE - 1 ) / TILE_SIZE;
+	tilesY = ( this->height + TILE_SIZE - 1 ) / TILE_SIZE;
+}
+
+int SpriteRasteriser::getWidth() const
+{
+	return width;
+}
+
+int SpriteRasteriser::getHeight() const
+{
+	return height;
+}
+
+void SpriteRasteriser::projectSprites( const glm::vec3* points, int count, const glm::mat4& modelView, const glm::mat4& projection, float halfSize )
+{
+	rects.resize( count );
+	float w = (float)width;
+	float h = (float)height;
+	int chunks = ( count + PROJECT_CHUNK - 1 ) / PROJECT_CHUNK;
+	ThreadPool::getInstance().parallelFor( chunks, [&]( int chunk )
+	{
+		int end = glm::min( (chunk+1)*PROJECT_CHUNK, count );
+		for(int i=chunk*PROJECT_CHUNK; i<end; i++)
+		{
+			SpriteRect& rect = rects[i];
+			rect.x0 = 1.0f;
+			rect.x1 = 0.0f;
+
+			// Quad corners are offset in view space, as in the geometry shader
+			glm::vec4 center = modelView * glm::vec4( points[i], 1.0f );
+			glm::vec4 lo = projection * ( center + glm::vec4( -halfSize, -halfSize, 0.0f, 0.0f ) );
+			glm::vec4 hi = projection * ( center + glm::vec4( halfSize, halfSize, 0.0f, 0.0f ) );
+			if( lo.w <= 0.0f || hi.w <= 0.0f ) continue;
+			float depth = lo.z / lo.w;
+			if( depth < -1.0f || depth > 1.0f ) continue;
+
+			float left = ( lo.x / lo.w * 0.5f + 0.5f ) * w;
+			float right = ( hi.x / hi.w * 0.5f + 0.5f ) * w;
+			float top = ( 0.5f - hi.y / hi.w * 0.5f ) * h;
+			float bottom = ( 0.5f - lo.y / lo.w * 0.5f ) * h;
+			if( right <= left || bottom <= top ) continue;
+
+			// Shrink the quad to the sprite content, texture coordinate v grows upwards in view
+			// space while pixel rows grow downwards
+			rect.uScale = spriteWidth / ( right - left );
+			rect.vScale = spriteHeight / ( bottom - top );
+			rect.u0 = (float)contentMin.x;
+			rect.v0 = (float)contentMin.y;
+			rect.x0 = left + contentMin.x / rect.uScale;
+			rect.x1 = left + ( contentMax.x + 1 ) / rect.uScale;
+			rect.y0 = bottom - ( contentMax.y + 1 ) / rect.vScale;
+			rect.y1 = bottom - contentMin.y / rect.vScale;
+		}
+	});
+}
+
+void SpriteRasteriser::binSprites()
+{
+	int tileCount = tilesX * tilesY;
+	tileStarts.assign( tileCount + 1, 0 );
+	int px0, py0, px1, py1;
+	for(size_t i=0; i<rects.size(); i++)
+	{
+		const SpriteRect& r = rects[i];
+		if( !getPixelRange( r.x0, r.y0, r.x1, r.y1, width, height, px0, py0, px1, py1 ) ) continue;
+		for(int ty=py0/TILE_SIZE; ty<=py1/TILE_SIZE; ty++)
+		{
+			for(int tx=px0/TILE_SIZE; tx<=px1/TILE_SIZE; tx++)
+			{
+				tileStarts[ ty*tilesX + tx + 1 ]++;
+			}
+		}
+	}
+	for(int t=0; t<tileCount; t++)
+	{
+		tileStarts[t+1] += tileStarts[t];
+	}
+
+	tileSprites.resize( tileStarts[tileCount] );
+	tileFill.assign( tileStarts.begin(), tileStarts.end() - 1 );
+	for(size_t i=0; i<rects.size(); i++)
+	{
+		const SpriteRect& r = rects[i];
+		if( !getPixelRange( r.x0, r.y0, r.x1, r.y1, width, height, px0, py0, px1, py1 ) ) continue;
+		for(int ty=py0/TILE_SIZE; ty<=py1/TILE_SIZE; ty++)
+		{
+			for(int tx=px0/TILE_SIZE; tx<=px1/TILE_SIZE; tx++)
+			{
+				tileSprites[ tileFill[ ty*tilesX + tx ]++ ] = (int)i;
+			}
+		}
+	}
+}
+
+void SpriteRasteriser::drawTile( int tile, vector<unsigned char>& rgba ) const
+{
+	float accum[TILE_SIZE*TILE_SIZE*3];
+	fill( accum, accum + TILE_SIZE*TILE_SIZE*3, 0.0f );
+
+	int left = ( tile % tilesX ) * TILE_SIZE;
+	int top = ( tile / tilesX ) * TILE_SIZE;
+	int right = glm::min( left + TILE_SIZE, width ) - 1;
+	int bottom = glm::min( top + TILE_SIZE, height ) - 1;
+
+	int columns[TILE_SIZE];
+	int px0, py0, px1, py1;
+	for(int n=tileStarts[tile]; n<tileStarts[tile+1]; n++)
+	{
+		const SpriteRect& r = rects[ tileSprites[n] ];
+		getPixelRange( r.x0, r.y0, r.x1, r.y1, width, height, px0, py0, px1, py1 );
+		px0 = glm::max( px0, left );
+		py0 = glm::max( py0, top );
+		px1 = glm::min( px1, right );
+		py1 = glm::min( py1, bottom );
+
+		// Nearest texel columns are the same for every row of the sprite
+		for(int px=px0; px<=px1; px++)
+		{
+			columns[ px - px0 ] = glm::clamp( (int)( r.u0 + ( px + 0.5f - r.x0 ) * r.uScale ), contentMin.x, contentMax.x ) * 3;
+		}
+		for(int py=py0; py<=py1; py++)
+		{
+			int sy = glm::clamp( (int)( r.v0 + ( r.y1 - ( py + 0.5f ) ) * r.vScale ), contentMin.y, contentMax.y );
+			const float* row = &sprite[ sy*spriteWidth*3 ];
+			float* out = &accum[ ( ( py - top )*TILE_SIZE + px0 - left )*3 ];
+			for(int px=px0; px<=px1; px++, out+=3)
+			{
+				const float* texel = row + columns[ px - px0 ];
+				out[0] += texel[0];
+				out[1] += texel[1];
+				out[2] += texel[2];
+			}
+		}
+	}
+
+	for(int py=top; py<=bottom; py++)
+	{
+		const float* in = &accum[ ( py - top )*TILE_SIZE*3 ];
+		unsigned char* out = &rgba[ ( py*width + left )*4 ];
+		for(int px=left; px<=right; px++, in+=3, out+=4)
+		{
+			out[0] = (unsigned char)( glm::min( in[0], 1.0f ) * 255.0f + 0.5f );
+			out[1] = (unsigned char)( glm::min( in[1], 1.0f ) * 255.0f + 0.5f );
+			out[2] = (unsigned char)( glm::min( in[2], 1.0f ) * 255.0f + 0.5f );
+			out[3] = 255;
+		}
+	}
+}
+
+void SpriteRasteriser::render( const glm::vec3* points, int count, const glm::mat4& modelView, const glm::mat4& projection,
+							   float halfSize, vector<unsigned char>& rgba )
+{
+	rgba.resize( width*height*4 );
+	if( !isLoaded() || width == 0 || contentMax.x < 0 )
+	{
+		fill( rgba.begin(), rgba.end(), (unsigned char)0 );
+		return;
+	}
+
+	projectSprites( points, count, modelView, projection, halfSize );
+	binSprites();
+	ThreadPool::getInstance().parallelFor( tilesX * tilesY, [&]( int tile )
+	{
+		drawTile( tile, rgba );
+	});
+}
@@ -0,0 +1,69 @@
+#pragma once
+#ifndef SPRITE_RASTERISER_H
+#define SPRITE_RASTERISER_H
+
+#include "GlmVec.h"
+#include <glm\mat4x4.hpp>
+#include <vector>
+
+/*
+	CPU replacement for the point sprite path of PointDataVisualiser (testPS shaders), used to
+	render preview images without a GL context. Every point becomes a view aligned quad of
+	2*halfSize, textured with the sprite image and blended additively (GL_ONE, GL_ONE) onto a
+	black background, like the GL path. The sprite is padded to a power of two and sampled
+	nearest, as TextureManager uploads it. Output is 8 bit RGBA with the top row first, as
+	lodepng expects it, alpha is always opaque.
+
+	The image is split into tiles of TILE_SIZE pixels. Sprites are projected in parallel,
+	sorted into the tiles they overlap (counting sort) and every tile is then accumulated by one
+	task on the ThreadPool in a float buffer of its own, so no two threads write the same pixel.
+*/
+class SpriteRasteriser
+{
+public:
+	static const int TILE_SIZE = 64;
+
+private:
+	struct SpriteRect
+	{
+		float x0, y0, x1, y1;	// Pixel bounds of the sprite content, y grows downwards; x0 > x1 marks a clipped sprite
+		float u0, v0;			// Texel at (x0, y1)
+		float uScale, vScale;	// Texels per pixel
+	};
+
+	std::vector<float> sprite;	// RGB in [0,1], first row is texture coordinate v = 0
+	int spriteWidth;
+	int spriteHeight;
+	glm::ivec2 contentMin;		// Texels outside of these bounds are black and add nothing, sprites
+	glm::ivec2 contentMax;		// are only drawn over the pixels of this part (inclusive bounds)
+
+	int width;
+	int height;
+	int tilesX;
+	int tilesY;
+
+	std::vector<SpriteRect> rects;
+	std::vector<int> tileStarts;
+	std::vector<int> tileSprites;
+	std::vector<int> tileFill;
+
+	void projectSprites( const glm::vec3* points, int count, const glm::mat4& modelView, const glm::mat4& projection, float halfSize );
+	void binSprites();
+	void drawTile( int tile, std::vector<unsigned char>& rgba ) const;
+
+public:
+	SpriteRasteriser( const char* spriteFile );
+
+	bool isLoaded() const;
+
+	void setResolution( int width, int height );
+	int getWidth() const;
+	int getHeight() const;
+
+	// Draws the points (model space) into rgba, which is resized to width*height*4 bytes.
+	// halfSize is the half width of a sprite in view space units, like Size2 of the shader.
+	void render( const glm::vec3* points, int count, const glm::mat4& modelView, const glm::mat4& projection,
+				 float halfSize, std::vector<unsigned char>& rgba );
+};
+
+#endif
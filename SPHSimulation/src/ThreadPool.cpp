@@ -0,0 +1,119 @@
+#include "ThreadPool.h"
+#include "AllocationCounter.h"
+
+using namespace std;
+
+ThreadPool* ThreadPool::current = nullptr;
+
+ThreadPool& ThreadPool::getInstance()
+{
+	static ThreadPool serial( 1 );
+	return current ? *current : serial;
+}
+
+void ThreadPool::setInstance( ThreadPool* pool )
+{
+	current = pool;
+}
+
+ThreadPool::ThreadPool( int threadCount ) :
+	task(nullptr), taskCount(0), nextIndex(0), activeWorkers(0), countAllocations(false),
+	generation(0), running(false), stop(false)
+{
+	if( threadCount <= 0 )
+	{
+		threadCount = (int)thread::hardware_concurrency();
+	}
+
+	for( int i=1; i<threadCount; i++ )
+	{
+		workers.push_back( thread( &ThreadPool::workerLoop, this ) );
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	if( current == this )
+	{
+		current = nullptr;
+	}
+	{
+		lock_guard<mutex> guard( lock );
+		stop = true;
+	}
+	wake.notify_all();
+	for( size_t i=0; i<workers.size(); i++ )
+	{
+		workers[i].join();
+	}
+}
+
+int ThreadPool::getThreadCount()
+{
+	return (int)workers.size() + 1;
+}
+
+void ThreadPool::workerLoop()
+{
+	unsigned int seen = 0;
+	unique_lock<mutex> guard( lock );
+	while( true )
+	{
+		wake.wait( guard, [this, &seen]{ return stop || generation != seen; } );
+		if( stop ) return;
+		seen = generation;
+		bool counting = countAllocations;
+
+		guard.unlock();
+		AllocationCounter::setThreadCounting( counting );
+		runTasks();
+		AllocationCounter::setThreadCounting( false );
+		guard.lock();
+
+		activeWorkers--;
+		if( activeWorkers == 0 )
+		{
+			finished.notify_all();
+		}
+	}
+}
+
+void ThreadPool::runTasks()
+{
+	int index;
+	while( (index = nextIndex++) < taskCount )
+	{
+		(*task)( index );
+	}
+}
+
+void ThreadPool::parallelFor( int count, const function<void(int)>& body )
+{
+	unique_lock<mutex> guard( lock );
+	if( running || workers.empty() || count < 2 )
+	{
+		guard.unlock();
+		for( int i=0; i<count; i++ )
+		{
+			body( i );
+		}
+		return;
+	}
+
+	running = true;
+	task = &body;
+	taskCount = count;
+	nextIndex = 0;
+	activeWorkers = (int)workers.size();
+	countAllocations = AllocationCounter::isThreadCounting();
+	generation++;
+	guard.unlock();
+	wake.notify_all();
+
+	runTasks();
+
+	guard.lock();
+	finished.wait( guard, [this]{ return activeWorkers == 0; } );
+	task = nullptr;
+	running = false;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#ifndef _THREAD_POOL_H
+#define _THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+/*
+	Fixed set of worker threads for data parallel loops. parallelFor hands out the indices
+	dynamically and returns after all of them were processed, the calling thread takes part
+	in the work. A parallelFor called from inside a task runs serially.
+
+	The pool shared by the program is owned by main and registered with setInstance, so its
+	workers are joined before main returns instead of during static destruction. Without a
+	registered pool getInstance gives one without workers, which runs the loops serially.
+*/
+class ThreadPool
+{
+private:
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable finished;
+
+	const std::function<void(int)>* task;
+	int taskCount;
+	std::atomic<int> nextIndex;
+	int activeWorkers;
+	bool countAllocations;		// The caller counts allocations, see AllocationCounter
+	unsigned int generation;
+	bool running;
+	bool stop;
+
+	static ThreadPool* current;
+
+	void workerLoop();
+	void runTasks();
+
+public:
+	static ThreadPool& getInstance();
+	// The pool unregisters itself when it is destroyed.
+	static void setInstance( ThreadPool* pool );
+
+	// Thread count 0 uses one thread per hardware thread (the caller included).
+	ThreadPool( int threadCount = 0 );
+	~ThreadPool();
+
+	// Number of threads working on a parallelFor, including the calling thread.
+	int getThreadCount();
+
+	void parallelFor( int count, const std::function<void(int)>& body );
+};
+
+#endif